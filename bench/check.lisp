@@ -0,0 +1,30 @@
+;;
+;; Loaded before each benchmark. A benchmark ends with a `check` of its
+;; result, which fails the run on a wrong answer by calling an unbound symbol.
+;;
+
+(define (not x) (if x nil t))
+
+(define (equal? a b)
+  (if (pair? a)
+      (if (pair? b)
+          (if (equal? (car a) (car b))
+              (equal? (cdr a) (cdr b))
+              nil)
+          nil)
+      (eq? a b)))
+
+(define (check got want)
+  (if (equal? got want)
+      t
+      (benchmark-failed got want)))
+
+(define (length xs)
+  (foldl (lambda (n x) (+ n 1)) 0 xs))
+
+(define (iota n)
+  (define (iota-aux n acc)
+    (if (= n 0)
+        acc
+        (iota-aux (- n 1) (cons (- n 1) acc))))
+  (iota-aux n nil))
@@ -0,0 +1,26 @@
+;;
+;; Allocation churn: short-lived trees built and dropped while a long-lived
+;; structure stays reachable, so each collection has both to deal with.
+;;
+
+(define (make-tree depth)
+  (if (= depth 0)
+      nil
+      (cons (make-tree (- depth 1)) (make-tree (- depth 1)))))
+
+(define (tree-size tree)
+  (if tree
+      (+ 1 (tree-size (car tree)) (tree-size (cdr tree)))
+      0))
+
+(define long-lived (make-tree 14))
+
+(define (churn k depth)
+  (if (= k 0)
+      0
+      (begin (make-tree depth)
+             (churn (- k 1) depth))))
+
+(churn 40 10)
+(churn 400 6)
+(check (tree-size long-lived) 16383)
@@ -0,0 +1,10 @@
+;;
+;; Doubly recursive Fibonacci: closure calls and integer arithmetic.
+;;
+
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1)) (fib (- n 2)))))
+
+(check (fib 24) 46368)
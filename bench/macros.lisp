@@ -0,0 +1,40 @@
+;;
+;; Macro-heavy code. Macros are expanded each time a call is evaluated, so
+;; the loop body below is re-expanded on every iteration.
+;;
+
+(defmacro (when test . body)
+  `(if ,test (begin ,@body) nil))
+
+(defmacro (unless test . body)
+  `(if ,test nil (begin ,@body)))
+
+(defmacro (and . xs)
+  (if xs
+      (if (cdr xs)
+          `(if ,(car xs) (and ,@(cdr xs)) nil)
+          (car xs))
+      t))
+
+(defmacro (or . xs)
+  (if xs
+      `(let ((or-value ,(car xs)))
+         (if or-value or-value (or ,@(cdr xs))))
+      nil))
+
+(defmacro (swap-args f a b)
+  `(,f ,b ,a))
+
+(define (step i)
+  (let ((a (- i 1))
+        (b (+ i 1)))
+    (when (and (< a i) (swap-args < b i) (or (= a -1) (>= a 0)))
+      (unless (or (< i 0) (and (= i a) (= i b)))
+        1))))
+
+(define (loop i n hits)
+  (if (< i n)
+      (loop (+ i 1) n (if (step i) (+ hits 1) hits))
+      hits))
+
+(check (loop 0 500 0) 500)
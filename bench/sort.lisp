@@ -0,0 +1,43 @@
+;;
+;; Merge sort of a pseudo-random list, checked against the sorted numbers.
+;;
+
+(define (mod a b) (- a (* (/ a b) b)))
+
+;; A list of n distinct numbers below n in scrambled order: 7919 is prime,
+;; so i*7919 mod n visits each residue once when n isn't a multiple of it.
+(define (scrambled n)
+  (map (lambda (i) (mod (* i 7919) n)) (iota n)))
+
+(define (split xs)
+  (if (pair? xs)
+      (if (pair? (cdr xs))
+          (let ((rest (split (cdr (cdr xs)))))
+            (cons (cons (car xs) (car rest))
+                  (cons (car (cdr xs)) (cdr rest))))
+          (cons xs nil))
+      (cons nil nil)))
+
+(define (merge a b)
+  (if (pair? a)
+      (if (pair? b)
+          (if (< (car b) (car a))
+              (cons (car b) (merge a (cdr b)))
+              (cons (car a) (merge (cdr a) b)))
+          a)
+      b))
+
+(define (sort xs)
+  (if (pair? (cdr xs))
+      (let ((halves (split xs)))
+        (merge (sort (car halves)) (sort (cdr halves))))
+      xs))
+
+(define (sort-times k n)
+  (if (= k 0)
+      nil
+      (begin (sort (scrambled n))
+             (sort-times (- k 1) n))))
+
+(sort-times 2 400)
+(check (sort (scrambled 400)) (iota 400))
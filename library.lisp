@@ -69,6 +69,35 @@
   `((lambda ,(map car defs) ,@body)
     ,@(map cadr defs)))
 
+(defmacro (future expr)
+  `(future-call (lambda () ,expr)))
+
+(defmacro (profile expr . file)
+  `(profile-stop ((lambda () (profile-start) ,expr)) ,@file))
+
+;;
+;; Weak tables: association lists of weak pairs, so that an entry doesn't
+;; keep its key alive. Once the key is collected the entry's car becomes nil,
+;; and the next weak-table-put drops it.
+;;
+
+(define (weak-table-get table key default)
+  (if table
+      (if (eq? (caar table) key)
+          (cdr (car table))
+          (weak-table-get (cdr table) key default))
+      default))
+
+(define (weak-table-remove table key)
+  (if table
+      (if (if (caar table) (eq? (caar table) key) 't)
+          (weak-table-remove (cdr table) key)
+          (cons (car table) (weak-table-remove (cdr table) key)))
+      nil))
+
+(define (weak-table-put table key value)
+  (cons (weak-cons key value) (weak-table-remove table key)))
+
 ;;
 ;; Integer functions
 ;;
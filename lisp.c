@@ -1,4 +1,5 @@
 #include "lisp_config.h"
+#include "lisp.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,8 +7,25 @@
 #include <strings.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <setjmp.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -28,7 +46,10 @@ typedef enum {
   AtomType_Integer,
   AtomType_Builtin,
   AtomType_Closure,
-  AtomType_Macro
+  AtomType_Macro,
+  AtomType_String,
+  AtomType_Future,
+  AtomType_Port
 } AtomType;
 
 typedef int (*Builtin)(Atom args, Atom *result);
@@ -59,18 +80,398 @@ typedef struct Allocation Allocation;
 
 struct Allocation {
   Pair pair;
-  int mark : 1;
+  atomic_uchar mark;    // Set by whichever marking thread gets here first.
+  unsigned char string; // The cdr points at a buffer owned by this allocation.
+  unsigned char block;  // Part of a Block, so never freed on its own.
+  unsigned char weak;   // The car doesn't keep what it points to alive.
   Allocation *next;
 };
 
-static Allocation* last_allocation = NULL;
+// Allocations the heap has been compacted into (see "Garbage collection").
+typedef struct Block Block;
+
+struct Block {
+  Block *next;
+  Allocation cells[];
+};
+
+// Allocations marked but not yet scanned (see "Garbage collection").
+typedef struct {
+  Allocation **items;
+  size_t len;
+  size_t cap;
+  unsigned long marked; // Allocations this stack's owner has marked.
+
+  // Weak pairs this stack's owner has scanned, for `gc_weak`.
+  Allocation **weak;
+  size_t nweak;
+  size_t weak_cap;
+} MarkStack;
+
+typedef struct GcMarkers GcMarkers;
+
+typedef struct {
+  unsigned long allocated;   // Cells, counted by each Mutator until `gc_count`.
+  unsigned long freed;
+  unsigned long live;        // Cells marked by the last collection.
+  unsigned long collections; // Marks completed.
+  unsigned long compactions;
+  unsigned long pauses;      // Calls to `gc` that did any work.
+  uint64_t pause_total;      // Nanoseconds.
+  uint64_t pause_max;
+} GcStats;
+
+typedef struct CallCache CallCache;
+typedef struct JitCode JitCode;
+typedef struct JitEntry JitEntry;
+
+typedef struct ThreadPool ThreadPool;
+typedef struct PtrMap PtrMap;
+size_t *ptrmap_get(PtrMap *m, const void *key);
+void ptrmap_put(PtrMap *m, const void *key, size_t value);
+typedef struct Profile Profile;
+typedef struct Port Port;
+typedef struct SymbolTrie SymbolTrie;
+
+// Pointers to the locals of a running `eval_expr`, which hold its roots.
+typedef struct EvalRoots EvalRoots;
+
+struct EvalRoots {
+  Atom *expr;
+  Atom *original;
+  Atom *env;
+  Atom *stack;
+  Atom *result;
+  EvalRoots *prev;
+};
+
+// Atoms in C locals pushed onto a thread's shadow stack (see PUSH_ROOT).
+typedef struct {
+  Atom *atoms;
+  size_t count;
+} RootSpan;
+
+#ifdef LISP_STATS
+// Builtins `VmStats` has room for.
+#define VM_STATS_BUILTINS 64
+
+// Evaluator counters for `(vm-stats)`, built in with -DLISP_STATS=ON. Each
+// thread keeps its own, updated with relaxed loads and stores rather than
+// atomic increments, so others may read them at any time.
+typedef struct {
+  atomic_ulong eval_steps;
+  atomic_ulong frames;
+  atomic_ulong env_lookups;
+  atomic_ulong env_links;       // Environments those lookups searched.
+  atomic_ulong macro_expansions;
+  atomic_ulong builtin_calls[VM_STATS_BUILTINS]; // Indexed like `builtins`.
+  atomic_ulong builtin_time[VM_STATS_BUILTINS];  // Nanoseconds, inclusive.
+} VmStats;
+#endif
+
+// A thread running Lisp code in a context: the thread that entered it, or a
+// worker of its pool.
+typedef struct {
+  Allocation **heap;        // List `cons` adds new allocations to.
+  Allocation *allocations;  // A worker's own list, swept with the context's.
+
+  // The list as it was at the end of the last mark, swept a little at a time
+  // by `cons`.
+  Allocation *sweep;
+
+  // Garbage found in blocks, for `cons` to reuse.
+  Allocation *free;
+
+  // Non-zero while compiled closure code is running, which a collection would
+  // discard, or while holding a lock a collection could wait on. Collection
+  // is postponed until it's back to zero.
+  int gc_inhibit;
+
+  // Allocations since the last collection, and evaluation steps in all.
+  unsigned long alloc_count;
+  unsigned long eval_steps;
+
+  int jit_depth;
+  int aot_depth;   // Nested calls of `--compile-to-c` code (see `aot_run`),
+  char *aot_stack; // and the stack pointer at the outermost.
+
+  // Cells allocated and freed by this thread since `gc_count`.
+  unsigned long allocated;
+  unsigned long freed;
+
+  // Innermost running `eval_expr`, the locals C code has pushed with
+  // PUSH_ROOT, and atoms C code needs kept while it waits.
+  EvalRoots *roots;
+  RootSpan *shadow;
+  size_t nshadow;
+  size_t shadow_cap;
+  Atom pinned;
+
+#ifdef LISP_STATS
+  VmStats stats;
+#endif
+} Mutator;
+
+// Everything one interpreter owns. Contexts share nothing, so a process can
+// host several, one per thread at a time; `lisp` is the one the calling thread
+// is running (see `lisp_enter`), and `self` is that thread's Mutator.
+struct LispContext {
+  Allocation *last_allocation;
+  Atom sym_table;
+
+  // Index of `sym_table` by prefix, for completion. Built by the REPL the
+  // first time it's needed, then kept up to date by `make_sym` and dropped
+  // when symbols are pruned (see "REPL").
+  SymbolTrie *sym_trie;
+
+  // The root environment, from `initial_env` or a heap image.
+  Atom global_env;
+
+  // Where `out_of_memory` unwinds to while `lisp_open` fills the context in.
+  jmp_buf *oom;
+
+  // Bumped whenever a new binding is added to an existing environment (which
+  // may shadow a binding further up the chain) and after every collection
+  // (which may recycle pair addresses). Any inline cache entry recorded under
+  // an older version is stale.
+  atomic_ulong env_version;
+
+  // Arrays of atoms in C statics, which must survive every collection.
+  RootSpan *gc_protected;
+  size_t nprotected;
+
+  // The thread that entered the context. Only it collects garbage; workers
+  // park at a safepoint while it does (see "Futures").
+  Mutator main;
+  ThreadPool *pool;      // Started by the first future.
+  int threads;           // Workers in the pool, or 0 for one per other CPU.
+  atomic_bool stop_world; // Workers must park at their next safepoint.
+  atomic_bool gc_wanted;  // A worker has done enough work for a collection.
+
+  // Guards the symbol table and `env_set` once there are workers.
+  pthread_mutex_t shared_lock;
+
+  MarkStack mark_stack;  // The collector's.
+  GcMarkers *markers;    // Helper threads, started by the first collection.
+  int gc_threads;        // Threads marking, or 0 for one per CPU (up to 8).
+
+  // Incremental collection (`--gc-incremental`): each call to `gc` marks for
+  // at most `gc_budget` microseconds, and `cons` marks a little more while
+  // `marking` is set.
+  bool gc_incremental;
+  long gc_budget;
+  bool marking;
+  GcStats gc_stats;
+  bool gc_trace;         // Log each collection to stderr.
+
+  // Allocations (by any one thread) between collections, set by each from
+  // the number of cells it found live.
+  unsigned long gc_threshold;
+
+  // `--gc-copy`: compact the heap between top-level forms. `compacted` is
+  // `collections` as of the last compaction.
+  bool gc_copy;
+  Block *blocks;
+  unsigned long compacted;
+
+  // `--gc-weak-symbols`: between top-level forms, after any collection,
+  // collect again and drop symbols nothing refers to from `sym_table`
+  // (`prune_symbols` is set meanwhile). `symbols_pruned` is `collections` as
+  // of the last time.
+  bool gc_weak_symbols;
+  bool prune_symbols;
+  unsigned long symbols_pruned;
+
+  // Weak pairs (object . finalizer) for each object given a finalizer, and
+  // strong ones for those found unreachable, whose finalizers are yet to
+  // run.
+  Atom finalizers;
+  Atom finalize_ready;
+  bool finalizing;
+
+  // `--gc-stress`: collect at every allocation, so that an atom C code forgot
+  // to root is freed as soon as possible.
+  bool gc_stress;
+
+  // Steps a thread may evaluate before `eval_expr` fails with Error_Limit,
+  // or 0 for no limit. The fuzzer sets it so that loops end.
+  unsigned long eval_limit;
+
+  // Ports and the operations queued on them (see "Ports and the event loop").
+  Port *ports;
+  size_t nports;
+  long free_port;        // First closed slot, or -1.
+  Atom io_ops;
+  int epoll_fd;          // Or -1 until the event loop first runs.
+
+  Profile *profile;      // Running, if not NULL (see "Profiler").
+  PtrMap *closure_names; // Closure -> name of the symbol first bound to it.
+
+  // Allocations mapped in from a heap image. They're marked like any other
+  // but never swept.
+  Allocation *image_heap;
+  size_t image_count;
+  char *image_base;
+  size_t image_size;
+
+  CallCache *call_cache;
+
+  bool compile_closures; // `--compile-closures` (see "Closure compilation").
+  bool jit;              // `--jit`: compiled closures get machine code too.
+  JitEntry *jit_table;
+  JitCode *jit_codes;
+};
+
+static _Thread_local LispContext *lisp = NULL;
+static _Thread_local Mutator *self = NULL;
+
+// Out of memory where there's no error to return, as in `cons`. In
+// `lisp_open`, that unwinds back to it, to return NULL. Otherwise there's no
+// telling what the program would go on to do without the allocation, so the
+// process ends.
+_Noreturn void out_of_memory(void) {
+  if (lisp && lisp->oom && self == &lisp->main) longjmp(*lisp->oom, 1);
+  fprintf(stderr, "Out of memory\n");
+  abort();
+}
+
+// realloc (or with `p` NULL, malloc) that calls `out_of_memory` rather than
+// return NULL.
+void *checked_realloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (!p) out_of_memory();
+  return p;
+}
+
+#ifdef LISP_STATS
+#define stat_get(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+#define stat_add(counter, n) \
+  atomic_store_explicit(&self->stats.counter, stat_get(self->stats.counter) + (n), \
+                        memory_order_relaxed)
+#else
+#define stat_add(counter, n) ((void) 0)
+#endif
+
+// Shadow stack. C code keeping an atom in a local across a call that may
+// allocate, and so collect, pushes the local first and pops it after:
+//
+//   Atom list = nil;
+//   PUSH_ROOT(list);
+//   ...
+//   POP_ROOTS(1);
+//
+// PUSH_ROOTS does the same for an array, which must hold valid atoms. The
+// arguments of `cons` are safe during the call, and a builtin's `args` and
+// `*result` are rooted by its caller.
+static inline void shadow_push(Atom *atoms, size_t count) {
+  if (self->nshadow == self->shadow_cap) {
+    self->shadow_cap = self->shadow_cap ? 2 * self->shadow_cap : 64;
+    self->shadow = checked_realloc(self->shadow, self->shadow_cap * sizeof(RootSpan));
+  }
+  self->shadow[self->nshadow++] = (RootSpan) { atoms, count };
+}
+
+#define PUSH_ROOT(x) shadow_push(&(x), 1)
+#define PUSH_ROOTS(xs, n) shadow_push((xs), (n))
+#define POP_ROOTS(n) (self->nshadow -= (n))
+
+void gc_shade(Atom atom);
+
+// Write barrier. While an incremental mark is under way, whatever a store
+// into an existing pair overwrites is marked first, so that everything
+// reachable when the mark began is marked before it ends.
+static inline void gc_barrier(Atom old) {
+  if (lisp->marking) gc_shade(old);
+}
+
+// The new value is an argument, so it's computed before the barrier runs: an
+// allocation in computing it may start a mark, which must see the old value.
+static inline void set_car(Atom p, Atom x) {
+  gc_barrier(car(p));
+  car(p) = x;
+}
+
+static inline void set_cdr(Atom p, Atom x) {
+  gc_barrier(cdr(p));
+  cdr(p) = x;
+}
+
+// Read barrier, for the car of a pair handed to the program. A weak pair's
+// referent isn't marked through it, so one read during an incremental mark
+// could be stored where the mark has already looked and then be freed; it's
+// marked as it's read instead.
+static inline Atom pair_car(Atom p) {
+  if (lisp->marking && ((Allocation*) p.value.pair)->weak) gc_shade(car(p));
+  return car(p);
+}
+
+// Sweep the next of `m`'s allocations left by the last mark: put it back on
+// its list if it was marked, or else free its string buffer, if any, and
+// return it.
+Allocation *sweep_next(Mutator *m) {
+  Allocation *a = m->sweep;
+  m->sweep = a->next;
+  if (atomic_load_explicit(&a->mark, memory_order_relaxed)) {
+    atomic_store_explicit(&a->mark, 0, memory_order_relaxed);
+    a->next = *m->heap;
+    *m->heap = a;
+    return NULL;
+  }
+  if (a->string) free((char*) a->pair.atom[1].value.symbol);
+  ++m->freed;
+  return a;
+}
+
+// Free an allocation `sweep_next` returned, if any, or if it's part of a
+// block, keep it on `m`'s free list.
+void gc_release(Mutator *m, Allocation *a) {
+  if (!a) return;
+  if (a->block) {
+    a->next = m->free;
+    m->free = a;
+  } else {
+    free(a);
+  }
+}
+
+void gc_step();
+void gc(Atom expr, Atom env, Atom stack);
+
+// Allocations `cons` sweeps, at most, before giving up and calling malloc.
+#define SWEEP_BATCH 8
 
 Atom cons(Atom car, Atom cdr) {
-  // Track pair allocations on global linked list `last_allocation`.
-  Allocation* a = malloc(sizeof(Allocation)); // TODO: NULL check.
-  a->mark = 0;
-  a->next = last_allocation;
-  last_allocation = a;
+  // Collect once this thread has allocated enough, or when a worker asks.
+  if (++self->alloc_count >= lisp->gc_threshold || lisp->gc_stress ||
+      (lisp->gc_wanted && self == &lisp->main))
+    gc(car, cdr, nil);
+
+  // Sweep a few of the allocations left by the last collection, reusing the
+  // first garbage found.
+  Allocation *a = NULL;
+  for (int i = 0; i < SWEEP_BATCH && self->sweep && !a; ++i)
+    a = sweep_next(self);
+  if (!a && self->free) {
+    a = self->free;
+    self->free = a->next;
+  }
+  if (!a) {
+    a = checked_realloc(NULL, sizeof(Allocation));
+    a->block = 0;
+  }
+
+  // Allocations made during an incremental mark are marked already; they
+  // were not reachable when it began, so it must not scan them.
+  if (lisp->marking) gc_step();
+  atomic_store_explicit(&a->mark, lisp->marking, memory_order_relaxed);
+
+  // Track pair allocations on the thread's linked list, usually
+  // `last_allocation`.
+  ++self->allocated;
+  a->string = 0;
+  a->weak = 0;
+  a->next = *self->heap;
+  *self->heap = a;
 
   Atom p;
   p.type = AtomType_Pair;
@@ -87,31 +488,88 @@ Atom make_int(long i) {
   return a;
 }
 
-static Atom sym_table = { AtomType_Nil };
+// Strings are allocations whose car holds the length and whose cdr points at
+// a NUL-terminated buffer, freed when the string is collected.
+#define string_length(s) (car(s).value.integer)
+#define string_data(s) ((char*) cdr(s).value.symbol)
+
+Atom make_string(const char *s, size_t len) {
+  Atom str = cons(make_int(len), nil);
+  char *buf = checked_realloc(NULL, len + 1);
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  cdr(str).value.symbol = buf;
+  ((Allocation*) str.value.pair)->string = 1;
+  str.type = AtomType_String;
+  return str;
+}
+
+// Names of symbols made by `make_sym` follow a mark, which collections set
+// for each symbol they reach while `prune_symbols` is set. Those of symbols
+// from a heap image are in its strings, and have none.
+typedef struct {
+  atomic_uchar mark;
+  char name[];
+} SymbolName;
+
+#define symbol_header(s) ((SymbolName*) ((s) - offsetof(SymbolName, name)))
+
+bool symbol_in_image(const char *name) {
+  return name >= lisp->image_base && name < lisp->image_base + lisp->image_size;
+}
 
 typedef enum {
   Result_OK = 0,
   Error_Syntax,
   Error_Unbound,
   Error_Args,
-  Error_Type
+  Error_Type,
+  Error_Limit
 } Result;
 
+bool sym_trie_insert(SymbolTrie *t, const char *name);
+void sym_trie_free(SymbolTrie *t);
+
 Atom make_sym(const char s[]) {
+  // A collection under the lock could wait forever for a worker waiting on it.
+  bool shared = lisp->pool != NULL;
+  if (shared) {
+    ++self->gc_inhibit;
+    pthread_mutex_lock(&lisp->shared_lock);
+  }
+
   // Return symbol if it's already in the `sym_table`.
-  Atom p = sym_table;
-  while (!nilp(p)) {
-    Atom a = car(p);
-    if (strcmp(a.value.symbol, s) == 0) return a;
-    p = cdr(p);
+  Atom a = nil;
+  for (Atom p = lisp->sym_table; !nilp(p); p = cdr(p)) {
+    if (strcmp(car(p).value.symbol, s) == 0) {
+      a = car(p);
+      break;
+    }
   }
 
-  // Otherwise, create a new one and add it to the table.
-  Atom a;
-  a.type = AtomType_Symbol;
-  a.value.symbol = strdup(s); // TODO: unchecked for NULL return.
-  sym_table = cons(a, sym_table);
+  // Otherwise, create a new one and add it to the table. The table's new
+  // pair comes first, so the name isn't lost if `cons` runs out of memory.
+  if (nilp(a)) {
+    Atom entry = cons(nil, lisp->sym_table);
+    size_t len = strlen(s);
+    SymbolName *name = checked_realloc(NULL, sizeof(SymbolName) + len + 1);
+    atomic_store_explicit(&name->mark, 0, memory_order_relaxed);
+    memcpy(name->name, s, len + 1);
+    a.type = AtomType_Symbol;
+    a.value.symbol = name->name;
+    car(entry) = a;
+    lisp->sym_table = entry;
+    // A trie missing a name is no use, so drop it, to be rebuilt.
+    if (lisp->sym_trie && !sym_trie_insert(lisp->sym_trie, name->name)) {
+      sym_trie_free(lisp->sym_trie);
+      lisp->sym_trie = NULL;
+    }
+  }
 
+  if (shared) {
+    pthread_mutex_unlock(&lisp->shared_lock);
+    --self->gc_inhibit;
+  }
   return a;
 }
 
@@ -142,1069 +600,6807 @@ int make_closure(Atom env, Atom args, Atom body, Atom *result) {
   return Result_OK;
 }
 
+// Whether `env` is a chain of environments as `env_create` makes them, each a
+// pair of its parent and a list of `(symbol . value)` bindings. `seen` maps
+// the environments already walked to `walk`, which is different for each
+// call, so those found valid by an earlier call aren't walked again. At most
+// `*limit` pairs are walked, so a cycle is rejected rather than looped over.
+bool env_valid(Atom env, PtrMap *seen, size_t walk, size_t *limit) {
+  for (; !nilp(env); env = car(env)) {
+    if (env.type != AtomType_Pair || !(*limit)--) return false;
+    size_t *n = ptrmap_get(seen, env.value.pair);
+    if (n) return *n != walk;
+    ptrmap_put(seen, env.value.pair, walk);
+    Atom bs = cdr(env);
+    for (; bs.type == AtomType_Pair; bs = cdr(bs)) {
+      Atom b = car(bs);
+      if (!(*limit)-- || b.type != AtomType_Pair || car(b).type != AtomType_Symbol) return false;
+    }
+    if (!nilp(bs)) return false;
+  }
+  return true;
+}
+
+// Whether a closure or macro from outside, such as serialized data, has the
+// parameter list and body LAMBDA would have given it; the evaluator relies on
+// the body having at least one expression. Its environment is for the caller
+// to check with `env_valid`, once per environment.
+bool closure_valid(Atom closure, size_t *limit) {
+  Atom rest = cdr(closure);
+  if (rest.type != AtomType_Pair || !(*limit)--) return false;
+
+  Atom p = car(rest);
+  for (; p.type == AtomType_Pair; p = cdr(p))
+    if (!(*limit)-- || car(p).type != AtomType_Symbol) return false;
+  if (!nilp(p) && p.type != AtomType_Symbol) return false;
+
+  p = cdr(rest);
+  if (p.type != AtomType_Pair) return false;
+  for (; p.type == AtomType_Pair; p = cdr(p))
+    if (!(*limit)--) return false;
+  return nilp(p);
+}
+
 // -----------------------------------------------------------------------------
 // Garbage collection.
+//
+// Marking uses an explicit stack, not recursion, and sets each mark with an
+// atomic exchange, so several threads can mark one heap: the collector pushes
+// the roots onto its stack, then it and the helper threads (`--gc-threads`)
+// drain their stacks. A thread whose stack grows long while another is idle
+// moves a chunk of it to the shared deque, where idle threads take work from.
+// Marking is over once every thread is idle and the deque is empty.
+//
+// Sweeping is lazy. At the end of the mark each thread's allocation list is
+// set aside, and `cons` sweeps it a few allocations at a time, reusing the
+// first garbage it comes to. The next collection finishes what's left before
+// it marks.
+//
+// With `--gc-incremental` the mark is spread over many calls to `gc` instead,
+// each bounded by `gc_budget`, and over allocations. It marks what was
+// reachable at the first call (the snapshot): that call marks the roots, the
+// write barrier (`set_car` and `set_cdr`) marks any reference overwritten
+// since, and new allocations are born marked. Workers store into pairs without
+// the barrier, so once there's a pool collection stops the world again.
+//
+// Collection never moves anything, since C code may hold atoms anywhere. But
+// between top-level forms, every atom is in a root or on the shadow stack, so
+// there, after any collection, `--gc-copy` compacts the heap: whatever is
+// reachable is copied into a single new block in the order of a Cheney scan,
+// cdrs before cars so that the cells of a list end up adjacent, and the rest
+// freed. Blocks are freed whole, by the next compaction, so garbage in them
+// goes on a free list for `cons` rather than back to malloc.
+//
+// Collection is started by `cons`, once a thread has made `gc_threshold`
+// allocations since the last: as many as the last collection found live, but
+// at least GC_MIN_ALLOCATIONS. The roots are the global tables, the locals of
+// every running `eval_expr` and whatever C code has pushed on the shadow stack.
 // -----------------------------------------------------------------------------
 
-void gc_mark(Atom root) {
-  switch (root.type) {
-    case AtomType_Pair:
-    case AtomType_Closure:
-    case AtomType_Macro: {
-      Allocation* a = (Allocation*)root.value.pair - offsetof(Allocation, pair);
+// Objects `cons` scans per allocation during an incremental mark.
+#define GC_STEP_WORK 8
 
-      if (a->mark) break;
-      a->mark = 1;
+#define GC_MIN_ALLOCATIONS 65536
 
-      gc_mark(car(root));
-      gc_mark(cdr(root));
-      break;
-    }
-    default:
-      break;
-  }
-}
+// Allocations between the calls to `gc` that make up an incremental
+// collection.
+#define GC_SLICE_ALLOCATIONS 8192
 
-void gc(Atom expr, Atom env, Atom stack) {
-  gc_mark(expr);
-  gc_mark(env);
-  gc_mark(stack);
-  gc_mark(sym_table);
-
-  // Sweep - free unmarked allocations.
-  Allocation **p = &last_allocation;
-  while (*p != NULL) {
-    Allocation* a = *p;
-    if (!a->mark) {
-      *p = a->next;
-
-      // XXX: What happens when we free the `root` pair?
-      // XXX: i.e. `last_allocation`
-      if (a == last_allocation) {
-        printf("a == last_allocation!!!\n");
-      }
+#define MARK_CHUNK 256
 
-      free(a);
-    } else {
-      p = &a->next; // XXX: seems v.similar to *p = a->next;
-    }
-  }
+typedef struct MarkChunk MarkChunk;
 
-  // Clear marks.
-  // XXX: Couldn't we clear marks and sweep in one iteration?
-  for (Allocation* a = last_allocation; a != NULL; a = a->next) {
-    a->mark = 0;
+struct MarkChunk {
+  MarkChunk *next;
+  Allocation *items[MARK_CHUNK];
+};
+
+typedef struct {
+  GcMarkers *markers;
+  pthread_t thread;
+  unsigned long epoch;  // Of the last mark it joined.
+  MarkStack stack;
+} GcHelper;
+
+struct GcMarkers {
+  pthread_mutex_t lock;
+  pthread_cond_t start;   // Broadcast when `epoch` is bumped or on shutdown.
+  pthread_cond_t changed; // Signalled on any change below.
+  MarkChunk *chunks;      // The shared deque.
+  atomic_int idle;        // Marking threads, the collector included, with no work.
+  int running;            // Helpers yet to finish the current mark.
+  bool done;
+  bool shutdown;
+  unsigned long epoch;    // Bumped to start each mark.
+  GcHelper *helpers;
+  int nhelpers;
+};
+
+void mark_push(MarkStack *s, Allocation *a) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? 2 * s->cap : 1024;
+    s->items = checked_realloc(s->items, s->cap * sizeof(Allocation*));
   }
+  s->items[s->len++] = a;
 }
 
-// -----------------------------------------------------------------------------
-// atom_print
-// -----------------------------------------------------------------------------
-void atom_print(Atom atom) {
+// Mark `atom` and, if it's the first to, push it for its car and cdr to be
+// marked too.
+void mark_atom(MarkStack *s, Atom atom) {
   switch (atom.type) {
-    case AtomType_Nil: printf("NIL"); break;
     case AtomType_Pair:
-      putchar('(');
-      atom_print(car(atom));
-      atom = cdr(atom);
-      while (!nilp(atom)) {
-        if (atom.type == AtomType_Pair) {
-          putchar(' ');
-          atom_print(car(atom));
-          atom = cdr(atom);
-        } else {
-          printf(" . ");
-          atom_print(atom);
-          break;
-        }
-      }
-      putchar(')');
-      break;
-    case AtomType_Symbol:
-      printf("%s", atom.value.symbol);
-      break;
-    case AtomType_Integer:
-      printf("%ld", atom.value.integer);
-      break;
-    case AtomType_Builtin:
-      printf("#<BUILTIN:%p>", atom.value.builtin);
-      break;
-    case AtomType_Closure: {
-      printf("#<CLOSURE>\n");
-      Atom as_list = atom;
-      as_list.type = AtomType_Pair;
-      atom_print(as_list);
+    case AtomType_Closure:
+    case AtomType_Macro:
+    case AtomType_Future: {
+      Allocation *a = (Allocation*) atom.value.pair;
+      if (atomic_load_explicit(&a->mark, memory_order_relaxed) ||
+          atomic_exchange_explicit(&a->mark, 1, memory_order_relaxed))
+        break;
+      ++s->marked;
+      mark_push(s, a);
       break;
     }
-    case AtomType_Macro: {
-      printf("#<MACRO>\n");
-      Atom as_list = atom;
-      as_list.type = AtomType_Pair;
-      atom_print(as_list);
+    case AtomType_String: {
+      Allocation *a = (Allocation*) atom.value.pair;
+      if (!atomic_exchange_explicit(&a->mark, 1, memory_order_relaxed))
+        ++s->marked;
       break;
     }
+    case AtomType_Symbol:
+      if (lisp->prune_symbols && !symbol_in_image(atom.value.symbol))
+        atomic_store_explicit(&symbol_header(atom.value.symbol)->mark, 1, memory_order_relaxed);
+      break;
+    default:
+      break;
   }
 }
 
-// -----------------------------------------------------------------------------
-// Parser
-// -----------------------------------------------------------------------------
-
-Result lex(const char str[], const char **start, const char **end) {
-  const char ws[] = " \t\n";
-  const char delim[] = "() \t\n";
-  const char prefix[] = "()'`";
+// Record the weak pair `a` for `gc_weak` to clear its car if that's unmarked.
+void mark_weak(MarkStack *s, Allocation *a) {
+  if (s->nweak == s->weak_cap) {
+    s->weak_cap = s->weak_cap ? 2 * s->weak_cap : 64;
+    s->weak = checked_realloc(s->weak, s->weak_cap * sizeof(Allocation*));
+  }
+  s->weak[s->nweak++] = a;
+}
 
-  str += strspn(str, ws);
-  if (str[0] == '\0') {
-    *start = *end = str;
-    return Result_OK;
+// Mark the car and cdr of `a`, or if it's a weak pair, only the cdr and
+// record it for `gc_weak`.
+void mark_scan(MarkStack *s, Allocation *a) {
+  if (a->weak) {
+    mark_weak(s, a);
+  } else {
+    mark_atom(s, a->pair.atom[0]);
   }
+  mark_atom(s, a->pair.atom[1]);
+}
 
-  *start = str;
+// Move the top chunk of `s` to the shared deque.
+void mark_share(GcMarkers *m, MarkStack *s) {
+  MarkChunk *chunk = malloc(sizeof(MarkChunk));
+  if (!chunk) return;
+  s->len -= MARK_CHUNK;
+  memcpy(chunk->items, s->items + s->len, sizeof(chunk->items));
+
+  pthread_mutex_lock(&m->lock);
+  chunk->next = m->chunks;
+  m->chunks = chunk;
+  pthread_cond_signal(&m->changed);
+  pthread_mutex_unlock(&m->lock);
+}
 
-  if (strchr(prefix, str[0]) != NULL) {
-    *end = str + 1; // Recognises any single prefix char as a token.
-  } else if (str[0] == ',') {
-    // Regcognise both unquote "," and unquote-splicing ",@".
-    *end = str + (str[1] == '@'? 2 : 1);
-  } else if (str[0] == ';') {
-    const char *s = strchr(str, '\n');
-    if (s != NULL) {
-      return lex(s, start, end);
-    } else {
-      str = strchr(str, '\0');
-      *start = *end = str;
-      return Result_OK;
+// Mark everything reachable from the allocations on `s`, sharing the work
+// with the other threads of `m`, if it isn't NULL, until they're all done.
+void gc_drain(GcMarkers *m, MarkStack *s) {
+  for (;;) {
+    while (s->len > 0) {
+      mark_scan(s, s->items[--s->len]);
+      if (m && s->len >= 2 * MARK_CHUNK &&
+          atomic_load_explicit(&m->idle, memory_order_relaxed) > 0)
+        mark_share(m, s);
     }
-  } else {
-    *end = str + strcspn(str, delim); // Recognise "other" token.
+    if (!m) return;
+
+    pthread_mutex_lock(&m->lock);
+    ++m->idle;
+    while (!m->chunks && !m->done) {
+      if (m->idle == m->nhelpers + 1) {
+        m->done = true;
+        pthread_cond_broadcast(&m->changed);
+        break;
+      }
+      pthread_cond_wait(&m->changed, &m->lock);
+    }
+    if (m->done) {
+      pthread_mutex_unlock(&m->lock);
+      return;
+    }
+    --m->idle;
+    MarkChunk *chunk = m->chunks;
+    m->chunks = chunk->next;
+    pthread_mutex_unlock(&m->lock);
+
+    for (int i = 0; i < MARK_CHUNK; ++i)
+      mark_push(s, chunk->items[i]);
+    free(chunk);
   }
-  return Result_OK;
 }
 
-int read_expr(const char *input, const char **end, Atom *result);
+void *gc_helper_main(void *arg) {
+  GcHelper *h = arg;
+  GcMarkers *m = h->markers;
 
-int parse_simple(const char *start, const char *end, Atom *result) {
-  // Is it an integer?
-  char *p;
-  long val = strtol(start, &p, 10);
-  if (p == end) {
-    result->type = AtomType_Integer;
-    result->value.integer = val;
-    return Result_OK;
+  pthread_mutex_lock(&m->lock);
+  for (;;) {
+    while (m->epoch == h->epoch && !m->shutdown)
+      pthread_cond_wait(&m->start, &m->lock);
+    if (m->shutdown) break;
+    h->epoch = m->epoch;
+    pthread_mutex_unlock(&m->lock);
+
+    gc_drain(m, &h->stack);
+
+    pthread_mutex_lock(&m->lock);
+    if (--m->running == 0) pthread_cond_broadcast(&m->changed);
   }
+  pthread_mutex_unlock(&m->lock);
+  return NULL;
+}
 
-  // NIL or symbol
-  char* buf = malloc(end - start + 1); // FIXME: NULL check.
-  p = buf;
-  while (start != end) {
-    *p++ = toupper(*start);
-    ++start;
+// The helper threads, or NULL if the collector marks alone.
+GcMarkers *gc_markers() {
+  if (lisp->markers) return lisp->markers;
+
+  int n = lisp->gc_threads;
+  if (n <= 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 8) n = 8;
   }
-  *p = '\0';
+  if (n <= 1) return NULL;
+
+  GcMarkers *m = calloc(1, sizeof(GcMarkers));
+  GcHelper *helpers = calloc(n - 1, sizeof(GcHelper));
+  if (!m || !helpers) {
+    free(m);
+    free(helpers);
+    return NULL;
+  }
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->start, NULL);
+  pthread_cond_init(&m->changed, NULL);
+  m->helpers = helpers;
+
+  for (int i = 0; i < n - 1; ++i) {
+    GcHelper *h = &helpers[i];
+    h->markers = m;
+    if (pthread_create(&h->thread, NULL, gc_helper_main, h) != 0) break;
+    ++m->nhelpers;
+  }
+  lisp->markers = m;
+  return m;
+}
 
-  if (strcmp(buf, "NIL") == 0)
-    *result = nil;
-  else
-    *result = make_sym(buf);
+void gc_markers_close(GcMarkers *m) {
+  pthread_mutex_lock(&m->lock);
+  m->shutdown = true;
+  pthread_cond_broadcast(&m->start);
+  pthread_mutex_unlock(&m->lock);
 
-  free(buf);
+  for (int i = 0; i < m->nhelpers; ++i) {
+    pthread_join(m->helpers[i].thread, NULL);
+    free(m->helpers[i].stack.items);
+    free(m->helpers[i].stack.weak);
+  }
+  pthread_mutex_destroy(&m->lock);
+  pthread_cond_destroy(&m->start);
+  pthread_cond_destroy(&m->changed);
+  free(m->helpers);
+  free(m);
+}
 
-  return Result_OK;
+void gc_mark(Atom root) {
+  mark_atom(&lisp->mark_stack, root);
 }
 
-int read_list(const char *start, const char **end, Atom *result) {
-  Atom p;
+void gc_shade(Atom atom) {
+  mark_atom(&lisp->mark_stack, atom);
+}
 
-  *end = start;
-  p = *result = nil;
+void gc_step() {
+  MarkStack *s = &lisp->mark_stack;
+  for (int i = 0; i < GC_STEP_WORK && s->len > 0; ++i)
+    mark_scan(s, s->items[--s->len]);
+}
 
-  for (;;) {
-    const char *token;
-    Atom item;
+uint64_t gc_clock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
 
-    Result r = lex(*end, &token, end);
-    if (r)
-      return r;
+// Mark from the collector's stack until it's empty, returning true, or the
+// clock passes `deadline`.
+bool gc_drain_until(uint64_t deadline) {
+  MarkStack *s = &lisp->mark_stack;
+  while (s->len > 0) {
+    for (int i = 0; i < 256 && s->len > 0; ++i)
+      mark_scan(s, s->items[--s->len]);
+    if (gc_clock() >= deadline) return s->len == 0;
+  }
+  return true;
+}
 
-    if (token[0] == ')')
-      return Result_OK;
+// Likewise for the lazy sweep of `m`'s allocations.
+bool gc_sweep_until(Mutator *m, uint64_t deadline) {
+  while (m->sweep) {
+    for (int i = 0; i < 256 && m->sweep; ++i)
+      gc_release(m, sweep_next(m));
+    if (gc_clock() >= deadline) return m->sweep == NULL;
+  }
+  return true;
+}
 
-    if (token[0] == '.' && *end - token == 1) {
-      // Improper list.
-      if (nilp(p))
-        return Error_Syntax;
+// Drop an incremental mark in progress, for the collection to start over
+// with the world stopped.
+void gc_abandon() {
+  lisp->marking = false;
+  lisp->mark_stack.len = 0;
+  lisp->mark_stack.marked = 0;
+  lisp->mark_stack.nweak = 0;
+  for (Allocation *a = lisp->last_allocation; a; a = a->next)
+    atomic_store_explicit(&a->mark, 0, memory_order_relaxed);
+  for (size_t i = 0; i < lisp->image_count; ++i)
+    atomic_store_explicit(&lisp->image_heap[i].mark, 0, memory_order_relaxed);
+}
 
-      r = read_expr(*end, end, &item);
-      if (r)
-        return r;
+// Mark everything reachable from the roots passed to `gc_mark`.
+void gc_mark_all() {
+  GcMarkers *m = gc_markers();
+  if (!m || m->nhelpers == 0) {
+    gc_drain(NULL, &lisp->mark_stack);
+    return;
+  }
 
-      cdr(p) = item;
+  pthread_mutex_lock(&m->lock);
+  m->idle = 0;
+  m->done = false;
+  m->running = m->nhelpers;
+  ++m->epoch;
+  pthread_cond_broadcast(&m->start);
+  pthread_mutex_unlock(&m->lock);
 
-      // Read the closing ')'.
-      r = lex(*end, &token, end);
-      if (!r && token[0] != ')')
-        r = Error_Syntax;
+  gc_drain(m, &lisp->mark_stack);
 
-      return r;
-    }
+  pthread_mutex_lock(&m->lock);
+  while (m->running > 0)
+    pthread_cond_wait(&m->changed, &m->lock);
+  pthread_mutex_unlock(&m->lock);
+}
 
-    r = read_expr(token, end, &item);
-    if (r)
-      return r;
+// Keep the `count` atoms at `atoms`, which must stay where they are, alive
+// for good.
+void gc_protect(Atom *atoms, size_t count) {
+  lisp->gc_protected = checked_realloc(lisp->gc_protected, (lisp->nprotected + 1) * sizeof(RootSpan));
+  lisp->gc_protected[lisp->nprotected++] = (RootSpan) { atoms, count };
+}
 
-    if (nilp(p)) {
-      // First item.
-      *result = cons(item, nil);
-      p = *result;
-    } else {
-      cdr(p) = cons(item, nil);
-      p = cdr(p);
-    }
+void gc_mark_mutator(Mutator *m) {
+  for (EvalRoots *r = m->roots; r; r = r->prev) {
+    gc_mark(*r->expr);
+    gc_mark(*r->original);
+    gc_mark(*r->env);
+    gc_mark(*r->stack);
+    gc_mark(*r->result);
   }
+  for (size_t i = 0; i < m->nshadow; ++i) {
+    for (size_t j = 0; j < m->shadow[i].count; ++j)
+      gc_mark(m->shadow[i].atoms[j]);
+  }
+  gc_mark(m->pinned);
 }
 
-int read_expr(const char *input, const char **end, Atom *result) {
-  const char *token;
-  Result r = lex(input, &token, end);
-  if (r) return r;
-
-  if (token[0] == '\0')
-    return Error_Syntax;
-  else if (token[0] == '(')
-    return read_list(*end, end, result);
-  else if (token[0] == ')')
-    return Error_Syntax;
-  else if (token[0] == '\'') {
-    *result = cons(make_sym("QUOTE"), cons(nil, nil));
-    return read_expr(*end, end, &car(cdr(*result))); // XXX: Hmm, clobber previous pair.
-  } else if (token[0] == '`') {
-    *result = cons(make_sym("QUASIQUOTE"), cons(nil, nil));
-    Result r = read_expr(*end, end, &car(cdr(*result))); // XXX: Hmm, clobber previous pair.
-    return r;
-  } else if (token[0] == ',') {
-    *result = cons(make_sym(token[1] == '@'? "UNQUOTE-SPLICING" : "UNQUOTE"),
-                   cons(nil, nil));
-    Result r = read_expr(*end, end, &car(cdr(*result))); // XXX: Hmm, clobber previous pair.
-    return r;
-  } else
-    return parse_simple(token, *end, result);
+// Finish the lazy sweep of `m`'s allocations: free the garbage and put the
+// rest back on its list, unmarked.
+void gc_sweep(Mutator *m) {
+  while (m->sweep)
+    gc_release(m, sweep_next(m));
 }
 
-// -----------------------------------------------------------------------------
-// environments
-// -----------------------------------------------------------------------------
-
-bool sym_eq(Atom sym1, Atom sym2) {
-  assert(sym1.type == AtomType_Symbol);
-  assert(sym2.type == AtomType_Symbol);
-
-  return sym1.value.symbol == sym2.value.symbol;
+// Add `m`'s counts to the statistics.
+void gc_count(Mutator *m) {
+  lisp->gc_stats.allocated += m->allocated;
+  lisp->gc_stats.freed += m->freed;
+  m->allocated = m->freed = 0;
 }
 
-Atom env_create(Atom parent) {
-  return cons(parent, nil);
+// Set `m`'s allocations aside, marks and all, for `cons` to sweep.
+void gc_defer_sweep(Mutator *m) {
+  m->sweep = *m->heap;
+  *m->heap = NULL;
 }
 
-int env_get(Atom env, Atom symbol, Atom *result) {
-  Atom parent = car(env);
-  Atom bs = cdr(env);
+void jit_reset();
+bool pool_stop_world(ThreadPool *pool);
+void pool_resume(ThreadPool *pool);
+void pool_mark(ThreadPool *pool);
+void pool_sweep(ThreadPool *pool);
+void pool_defer_sweep(ThreadPool *pool);
+void pool_count(ThreadPool *pool);
+void pool_want_gc(ThreadPool *pool);
+
+// Mark the cells of the symbol table but not the symbols, clearing their
+// marks instead.
+void gc_mark_sym_table() {
+  MarkStack *s = &lisp->mark_stack;
+  for (Atom p = lisp->sym_table; !nilp(p); p = cdr(p)) {
+    Allocation *a = (Allocation*) p.value.pair;
+    if (!atomic_exchange_explicit(&a->mark, 1, memory_order_relaxed)) ++s->marked;
+    const char *name = car(p).value.symbol;
+    if (!symbol_in_image(name))
+      atomic_store_explicit(&symbol_header(name)->mark, 0, memory_order_relaxed);
+  }
+}
 
-  // Find in this environment's bindings (`bs`).
-  while (!nilp(bs)) {
-    Atom binding = car(bs);
-    if (sym_eq(car(binding), symbol)) {
-      *result = cdr(binding);
-      return Result_OK;
-    }
-    bs = cdr(bs);
+void gc_mark_roots(Atom expr, Atom env, Atom stack) {
+  gc_mark(expr);
+  gc_mark(env);
+  gc_mark(stack);
+  if (lisp->prune_symbols)
+    gc_mark_sym_table();
+  else
+    gc_mark(lisp->sym_table);
+  gc_mark(lisp->global_env);
+  gc_mark(lisp->finalizers);
+  gc_mark(lisp->finalize_ready);
+  gc_mark(lisp->io_ops);
+  for (size_t i = 0; i < lisp->nprotected; ++i) {
+    for (size_t j = 0; j < lisp->gc_protected[i].count; ++j)
+      gc_mark(lisp->gc_protected[i].atoms[j]);
   }
+  gc_mark_mutator(&lisp->main);
+  if (lisp->pool) pool_mark(lisp->pool);
+}
 
-  // Try parent environment.
-  if (!nilp(parent)) return env_get(parent, symbol, result);
+void profile_prune();
+PtrMap *profile_names();
+void ptrmap_free(PtrMap *m);
 
-  printf("Symbol '%s' is not bound\n", symbol.value.symbol);
-  return Error_Unbound;
+// Whether a collection that has finished marking found `atom` unreachable.
+// Symbols only can be while `prune_symbols` is set.
+bool gc_dead(Atom atom) {
+  switch (atom.type) {
+    case AtomType_Pair:
+    case AtomType_Closure:
+    case AtomType_Macro:
+    case AtomType_String:
+    case AtomType_Future:
+      return !atomic_load_explicit(&((Allocation*) atom.value.pair)->mark, memory_order_relaxed);
+    case AtomType_Symbol:
+      return lisp->prune_symbols && !symbol_in_image(atom.value.symbol) &&
+             !atomic_load_explicit(&symbol_header(atom.value.symbol)->mark, memory_order_relaxed);
+    default:
+      return false;
+  }
 }
 
-int env_set(Atom env, Atom symbol, Atom value) {
-  Atom bs = cdr(env);
-  Atom binding = nil;
+void gc_clear_weak(MarkStack *s) {
+  for (size_t i = 0; i < s->nweak; ++i) {
+    if (gc_dead(s->weak[i]->pair.atom[0])) s->weak[i]->pair.atom[0] = nil;
+  }
+  s->nweak = 0;
+}
 
-  while (!nilp(bs)) {
-    binding = car(bs);
-    if (sym_eq(car(binding), symbol)) {
-      cdr(binding) = value;
-      return Result_OK;
+// Drop the symbols nothing refers to from the symbol table and free their
+// names, except those the profiler has kept.
+void gc_prune_symbols() {
+  PtrMap *keep = profile_names();
+  Atom *p = &lisp->sym_table;
+  while (!nilp(*p)) {
+    Atom sym = car(*p);
+    if (gc_dead(sym) && !(keep && ptrmap_get(keep, sym.value.symbol))) {
+      *p = cdr(*p);
+      free(symbol_header(sym.value.symbol));
+      sym_trie_free(lisp->sym_trie);
+      lisp->sym_trie = NULL;
+    } else {
+      p = &cdr(*p);
     }
-    bs = cdr(bs);
   }
-
-  // Binding not found -- create a new one.
-  binding = cons(symbol, value);
-  cdr(env) = cons(binding, cdr(env));
-
-  return Result_OK;
+  if (keep) ptrmap_free(keep);
+  free(keep);
 }
 
-// -----------------------------------------------------------------------------
-// builtin functions
-// -----------------------------------------------------------------------------
+// Once marking is done: keep objects with finalizers that were found
+// unreachable, and whatever they refer to, until the finalizers have run;
+// then clear the car of each weak pair whose referent is still unmarked.
+void gc_weak() {
+  MarkStack *s = &lisp->mark_stack;
+  Atom *p = &lisp->finalizers;
+  while (!nilp(*p)) {
+    Atom cell = *p;
+    Atom entry = car(cell);
+    if (gc_dead(car(entry))) {
+      ((Allocation*) entry.value.pair)->weak = 0;
+      *p = cdr(cell);
+      cdr(cell) = lisp->finalize_ready;
+      lisp->finalize_ready = cell;
+      mark_atom(s, car(entry));
+    } else {
+      p = &cdr(cell);
+    }
+  }
+  gc_drain(NULL, s);
 
-Atom make_builtin(Builtin f) {
-  Atom a;
-  a.type = AtomType_Builtin;
-  a.value.builtin = f;
-  return a;
+  gc_clear_weak(s);
+  if (lisp->markers) {
+    for (int i = 0; i < lisp->markers->nhelpers; ++i)
+      gc_clear_weak(&lisp->markers->helpers[i].stack);
+  }
+  if (lisp->prune_symbols) gc_prune_symbols();
 }
 
-// Create a _shallow_ copy of the argument list.
-Atom copy_list(Atom list) {
-  if (nilp(list)) return nil;
-
-  Atom a = cons(car(list), nil);
-  Atom p = a;
-  list = cdr(list);
+// The number of allocations the marking threads have marked, resetting
+// their counts.
+unsigned long gc_marked() {
+  unsigned long marked = lisp->mark_stack.marked;
+  lisp->mark_stack.marked = 0;
+  if (lisp->markers) {
+    for (int i = 0; i < lisp->markers->nhelpers; ++i) {
+      marked += lisp->markers->helpers[i].stack.marked;
+      lisp->markers->helpers[i].stack.marked = 0;
+    }
+  }
+  return marked;
+}
 
-  while (!nilp(list)) {
-    cdr(p) = cons(car(list), nil);
-    p = cdr(p);
-    list = cdr(list);
+// The mark is complete: leave the heap to be swept lazily.
+void gc_finish() {
+  GcStats *stats = &lisp->gc_stats;
+  gc_weak();
+  stats->live = gc_marked();
+  gc_count(&lisp->main);
+  if (lisp->pool) pool_count(lisp->pool);
+  profile_prune();
+
+  gc_defer_sweep(&lisp->main);
+  if (lisp->pool) pool_defer_sweep(lisp->pool);
+  for (size_t i = 0; i < lisp->image_count; ++i) {
+    atomic_store_explicit(&lisp->image_heap[i].mark, 0, memory_order_relaxed);
   }
 
-  return a;
+  // Freed pairs may be reused, so addresses in inline caches mean nothing now.
+  ++lisp->env_version;
+  jit_reset();
+  ++stats->collections;
+
+  lisp->gc_threshold = stats->live > GC_MIN_ALLOCATIONS ? stats->live : GC_MIN_ALLOCATIONS;
 }
 
-Result eval_expr(Atom expr, Atom env, Atom *result);
+// Count a pause that began at `start`, logging it if it finished a
+// collection (`stats->collections` was `collections` before).
+void gc_pause(uint64_t start, unsigned long collections, unsigned long freed) {
+  GcStats *stats = &lisp->gc_stats;
+  uint64_t pause = gc_clock() - start;
+  ++stats->pauses;
+  stats->pause_total += pause;
+  if (pause > stats->pause_max) stats->pause_max = pause;
+
+  if (lisp->gc_trace && stats->collections != collections) {
+    fprintf(stderr, "gc %lu: %lu live, %lu freed, %lu in heap, %.3f ms pause%s\n",
+            stats->collections, stats->live, stats->freed - freed,
+            stats->allocated - stats->freed, pause / 1e6,
+            lisp->compacted == stats->collections ? " (compacted)" : "");
+  }
+}
 
-int apply(Atom f, Atom args, Atom *result) {
-  if (f.type == AtomType_Builtin) {
-    return (*f.value.builtin)(args, result);
-  } else if (f.type == AtomType_Closure) {
-    Atom env = env_create(car(f));
-    Atom arg_names = car(cdr(f));
-    Atom body = cdr(cdr(f));
+void gc(Atom expr, Atom env, Atom stack) {
+  if (self->gc_inhibit) return;
+  self->alloc_count = 0;
+
+  // Only the main thread collects; workers ask it to.
+  ThreadPool *pool = lisp->pool;
+  if (self != &lisp->main) {
+    pool_want_gc(pool);
+    return;
+  }
 
-    // Bind the arguments in the new environment.
-    while (!nilp(arg_names)) {
-      if (arg_names.type == AtomType_Symbol) {
-        // Process in improper list which gets the rest of the args.
-        Atom sym = arg_names;
-        env_set(env, sym, args);
-        args = nil; // Don't trip up below on "Too many args".
-        break;
-      } else {
-        if (nilp(args)) return Error_Args;
-        env_set(env, car(arg_names), car(args));
-        arg_names = cdr(arg_names);
-        args = cdr(args);
+  GcStats *stats = &lisp->gc_stats;
+  unsigned long collections = stats->collections;
+  unsigned long freed = stats->freed;
+
+  uint64_t start = gc_clock();
+  if (lisp->gc_incremental && !pool) {
+    uint64_t deadline = start + lisp->gc_budget * 1000;
+    lisp->gc_threshold = GC_SLICE_ALLOCATIONS; // Until `gc_finish`.
+    // The last collection's sweep must be done before the next mark.
+    if (lisp->marking || gc_sweep_until(&lisp->main, deadline)) {
+      if (!lisp->marking) {
+        gc_mark_roots(expr, env, stack);
+        lisp->marking = true;
+      }
+      if (gc_drain_until(deadline)) {
+        lisp->marking = false;
+        gc_finish();
       }
     }
+  } else {
+    if (pool && !pool_stop_world(pool)) return;
 
-    if (!nilp(args)) return Error_Args; // Too many args.
-
-    // Evaluate the body (body is a sequence of expressions).
-    while (!nilp(body)) {
-      Result r = eval_expr(car(body), env, result);
-      if (r) return r;
-      body = cdr(body);
-    }
+    gc_sweep(&lisp->main);
+    if (pool) pool_sweep(pool);
+    gc_mark_roots(expr, env, stack);
+    gc_mark_all();
+    gc_finish();
 
-    return Result_OK;
+    lisp->gc_wanted = false;
+    if (pool) pool_resume(pool);
   }
-  printf("Expecting type builtin or closure in apply");
-  return Error_Type;
+
+  gc_pause(start, collections, freed);
 }
 
-#define ENSURE_0_ARGS() \
-  if (!nilp(args)) return Error_Args
+#define GC_FORWARDED 2 // The mark of an allocation `gc_compact` has copied.
 
-#define ENSURE_1_ARG() \
-  if (nilp(args) || !nilp(cdr(args))) return Error_Args
+bool gc_in_image(Allocation *a) {
+  return a >= lisp->image_heap && a < lisp->image_heap + lisp->image_count;
+}
 
-#define ENSURE_2_ARGS() \
-  if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args)))) return Error_Args
+// Point `atom` at the copy of its allocation, if it has one, copying it to
+// `*next` first if it hasn't been already. The car of the original holds the
+// copy's address.
+void gc_forward(Atom *atom, Allocation **next) {
+  switch (atom->type) {
+    case AtomType_Pair:
+    case AtomType_Closure:
+    case AtomType_Macro:
+    case AtomType_String:
+    case AtomType_Future:
+      break;
+    default:
+      return;
+  }
+  Allocation *a = (Allocation*) atom->value.pair;
+  if (gc_in_image(a)) return;
+  if (atomic_load_explicit(&a->mark, memory_order_relaxed) != GC_FORWARDED) {
+    Allocation *to = (*next)++;
+    to->pair = a->pair;
+    to->string = a->string;
+    to->block = 1;
+    to->weak = a->weak;
+    atomic_store_explicit(&to->mark, 0, memory_order_relaxed);
+    atomic_store_explicit(&a->mark, GC_FORWARDED, memory_order_relaxed);
+    a->pair.atom[0].value.pair = &to->pair;
+  }
+  atom->value.pair = a->pair.atom[0].value.pair;
+}
 
-#define ENSURE_3_ARGS() \
-  if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args))) || !nilp(cdr(cdr(cdr(args))))) \
-    return Error_Args
+void gc_forward_span(Atom *atoms, size_t count, Allocation **next) {
+  for (size_t i = 0; i < count; ++i)
+    gc_forward(&atoms[i], next);
+}
 
-int apply_builtin(Atom args, Atom *result) {
-  ENSURE_2_ARGS();
+void profile_forward();
+
+// Compact the heap: copy everything reachable into a new block and free the
+// rest (see "Garbage collection"). Besides the usual roots, `*env` and
+// `*value` are the only atoms the caller holds, and are updated.
+void gc_compact(Atom *env, Atom *value) {
+  GcStats *stats = &lisp->gc_stats;
+  unsigned long collections = stats->collections;
+  unsigned long freed = stats->freed;
+  uint64_t start = gc_clock();
+
+  if (lisp->marking) gc_abandon();
+  gc_sweep(&lisp->main);
+  gc_mark_roots(*env, *value, nil);
+  gc_mark_all();
+  gc_weak();
+
+  // Only live allocations are copied, so the block needs room for no more
+  // than were marked.
+  unsigned long marked = gc_marked();
+  Block *block = malloc(sizeof(Block) + marked * sizeof(Allocation));
+  if (!block) {
+    gc_abandon();
+    return;
+  }
 
-  Atom fn = car(args);
-  args = car(cdr(args));
+  // Copy the roots, then scan the copies in order, copying what they point
+  // to after them. Cdrs go first, so that the cells of a list are adjacent.
+  Allocation *scan = block->cells, *next = block->cells;
+  gc_forward(env, &next);
+  gc_forward(value, &next);
+  gc_forward(&lisp->sym_table, &next);
+  gc_forward(&lisp->global_env, &next);
+  gc_forward(&lisp->finalizers, &next);
+  gc_forward(&lisp->finalize_ready, &next);
+  gc_forward(&lisp->io_ops, &next);
+  for (size_t i = 0; i < lisp->nprotected; ++i)
+    gc_forward_span(lisp->gc_protected[i].atoms, lisp->gc_protected[i].count, &next);
+  Mutator *m = &lisp->main;
+  for (EvalRoots *r = m->roots; r; r = r->prev) {
+    gc_forward(r->expr, &next);
+    gc_forward(r->original, &next);
+    gc_forward(r->env, &next);
+    gc_forward(r->stack, &next);
+    gc_forward(r->result, &next);
+  }
+  for (size_t i = 0; i < m->nshadow; ++i)
+    gc_forward_span(m->shadow[i].atoms, m->shadow[i].count, &next);
+  gc_forward(&m->pinned, &next);
+
+  // Image allocations stay put, but those reachable may point into the heap.
+  for (size_t i = 0; i < lisp->image_count; ++i) {
+    Allocation *a = &lisp->image_heap[i];
+    if (atomic_load_explicit(&a->mark, memory_order_relaxed) && !a->string)
+      gc_forward_span(a->pair.atom, 2, &next);
+  }
+  while (scan < next) {
+    if (!scan->string) {
+      gc_forward(&scan->pair.atom[1], &next);
+      gc_forward(&scan->pair.atom[0], &next);
+    }
+    ++scan;
+  }
+  profile_forward();
+  for (size_t i = 0; i < lisp->image_count; ++i)
+    atomic_store_explicit(&lisp->image_heap[i].mark, 0, memory_order_relaxed);
+
+  // Free the old allocations, and the blocks of earlier compactions along
+  // with the garbage kept from them.
+  Allocation *a = lisp->last_allocation;
+  while (a) {
+    Allocation *following = a->next;
+    if (atomic_load_explicit(&a->mark, memory_order_relaxed) != GC_FORWARDED) {
+      if (a->string) free((char*) a->pair.atom[1].value.symbol);
+      ++m->freed;
+    }
+    if (!a->block) free(a);
+    a = following;
+  }
+  while (lisp->blocks) {
+    Block *b = lisp->blocks;
+    lisp->blocks = b->next;
+    free(b);
+  }
+  m->free = NULL;
+
+  // The copies are the heap now, in address order, and any room left over is
+  // free.
+  block->next = NULL;
+  lisp->blocks = block;
+  lisp->last_allocation = NULL;
+  for (Allocation *c = next; c > block->cells; ) {
+    --c;
+    c->next = lisp->last_allocation;
+    lisp->last_allocation = c;
+  }
+  for (Allocation *c = next; c < block->cells + marked; ++c) {
+    c->string = 0;
+    c->weak = 0;
+    c->block = 1;
+    c->next = m->free;
+    m->free = c;
+  }
 
-  if (!listp(args)) return Error_Syntax;
+  stats->live = marked;
+  gc_count(m);
+  ++lisp->env_version;
+  jit_reset();
+  ++stats->collections;
+  ++stats->compactions;
+  lisp->compacted = stats->collections;
+  lisp->gc_threshold = stats->live > GC_MIN_ALLOCATIONS ? stats->live : GC_MIN_ALLOCATIONS;
+  self->alloc_count = 0;
+
+  gc_pause(start, collections, freed);
+}
 
-  return apply(fn, args, result);
+// Called between top-level forms, where the only atoms C code holds are
+// `*env`, `*value` (if not NULL) and those on the shadow stack. If there's
+// been a collection since, compact the heap with `--gc-copy` and prune the
+// symbol table with `--gc-weak-symbols`, in one more collection.
+void gc_top_level(Atom *env, Atom *value) {
+  if (lisp->pool || self != &lisp->main || self->roots || self->gc_inhibit) return;
+  GcStats *stats = &lisp->gc_stats;
+  bool copy = lisp->gc_copy && stats->collections != lisp->compacted;
+  lisp->prune_symbols = lisp->gc_weak_symbols && stats->collections != lisp->symbols_pruned;
+  if (!copy && !lisp->prune_symbols) return;
+
+  Atom none = nil;
+  if (!value) value = &none;
+  if (copy) {
+    gc_compact(env, value);
+  } else {
+    unsigned long collections = stats->collections;
+    unsigned long freed = stats->freed;
+    uint64_t start = gc_clock();
+    if (lisp->marking) gc_abandon();
+    gc_sweep(&lisp->main);
+    gc_mark_roots(*env, *value, nil);
+    gc_mark_all();
+    gc_finish();
+    gc_pause(start, collections, freed);
+  }
+  if (lisp->prune_symbols) lisp->symbols_pruned = stats->collections;
+  lisp->prune_symbols = false;
 }
 
-int car_builtin(Atom args, Atom *result) {
-  ENSURE_1_ARG();
+int apply(Atom f, Atom args, Atom *result);
+const char *result_message(Result r);
+
+// Call the finalizer of each object found unreachable, with the object.
+// Called from the evaluation loop after a collection; errors are reported
+// and otherwise ignored.
+void gc_run_finalizers() {
+  lisp->finalizing = true;
+  while (!nilp(lisp->finalize_ready)) {
+    Atom entry = car(lisp->finalize_ready);
+    lisp->finalize_ready = cdr(lisp->finalize_ready);
+    Atom args = nil, result = nil;
+    PUSH_ROOT(entry);
+    PUSH_ROOT(args);
+    PUSH_ROOT(result);
+    args = cons(car(entry), nil);
+    Result r = apply(cdr(entry), args, &result);
+    if (r) printf("Error in finalizer: %s\n", result_message(r));
+    POP_ROOTS(3);
+  }
+  lisp->finalizing = false;
+}
 
-  Atom arg = car(args);
+// Open-addressed map from pointers to offsets, indices or other pointers.
+struct PtrMap {
+  const void **keys;
+  size_t *values;
+  size_t count;
+  size_t cap;
+};
 
-  if (nilp(arg) || arg.type != AtomType_Pair) *result = nil;
-  else if (arg.type != AtomType_Pair) {
-    printf("Expecting a pair in car\n");
-    return Error_Type;
-  } else *result = car(arg);
-  return Result_OK;
+size_t *ptrmap_get(PtrMap *m, const void *key) {
+  if (m->cap == 0) return NULL;
+  size_t i = ((uintptr_t) key >> 4) * 0x9E3779B97F4A7C15ull & (m->cap - 1);
+  while (m->keys[i]) {
+    if (m->keys[i] == key) return &m->values[i];
+    i = (i + 1) & (m->cap - 1);
+  }
+  return NULL;
 }
 
-int cdr_builtin(Atom args, Atom *result) {
-  ENSURE_1_ARG();
+void ptrmap_put(PtrMap *m, const void *key, size_t value) {
+  if (2 * (m->count + 1) > m->cap) {
+    PtrMap bigger = { NULL, NULL, 0, m->cap ? 2 * m->cap : 64 };
+    bigger.keys = calloc(bigger.cap, sizeof(void*));
+    bigger.values = calloc(bigger.cap, sizeof(size_t));
+    if (!bigger.keys || !bigger.values) out_of_memory();
+    for (size_t i = 0; i < m->cap; ++i)
+      if (m->keys[i]) ptrmap_put(&bigger, m->keys[i], m->values[i]);
+    free(m->keys);
+    free(m->values);
+    *m = bigger;
+  }
 
-  Atom arg = car(args);
+  size_t i = ((uintptr_t) key >> 4) * 0x9E3779B97F4A7C15ull & (m->cap - 1);
+  while (m->keys[i] && m->keys[i] != key)
+    i = (i + 1) & (m->cap - 1);
+  if (!m->keys[i]) ++m->count;
+  m->keys[i] = key;
+  m->values[i] = value;
+}
 
-  if (nilp(arg) || arg.type != AtomType_Pair) *result = nil;
-  else if (arg.type != AtomType_Pair) {
-    printf("Expecting a pair in cdr\n");
-    return Error_Type;
-  } else *result = cdr(arg);
-  return Result_OK;
+void ptrmap_free(PtrMap *m) {
+  free(m->keys);
+  free(m->values);
 }
 
-int cons_builtin(Atom args, Atom *result) {
-  ENSURE_2_ARGS();
+// -----------------------------------------------------------------------------
+// atom_print
+//
+// Atoms are written into a Printer: a buffer that is either flushed to a
+// stream whenever it fills, or grown and kept (for `write-to-string`). Lists
+// are walked along their cdrs iteratively, and nesting deeper than
+// PRINT_MAX_DEPTH is cut short with "(...)".
+//
+// A pair that's part of a cycle, through cars or cdrs, is printed in full
+// the first time as #n=(...) and as #n# after that, so printing always ends.
+// `print_scan` finds those pairs before anything is printed, with a
+// depth-first walk: every cycle has a pair that the walk reaches again from
+// inside itself. Pairs merely shared, not in a cycle, are printed in full.
+// -----------------------------------------------------------------------------
 
-  Atom a1 = car(args);
-  Atom a2 = car(cdr(args));
+#define PRINT_MAX_DEPTH 1000
 
-  *result = cons(a1, a2);
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *out; // Where to flush, or NULL to keep everything in `buf`.
+} Printer;
 
-  return Result_OK;
+void printer_flush(Printer *p) {
+  if (p->out && p->len) {
+    fwrite(p->buf, 1, p->len, p->out);
+    p->len = 0;
+  }
 }
 
-Atom boolToTF(bool b) {
-    return b ? TRUE_SYM : nil;
+void printer_write(Printer *p, const char *s, size_t len) {
+  if (p->len + len > p->cap) {
+    printer_flush(p);
+    if (p->len + len > p->cap) {
+      if (p->out) {
+        fwrite(s, 1, len, p->out);
+        return;
+      }
+      while (p->len + len > p->cap) p->cap = p->cap ? 2 * p->cap : 256;
+      p->buf = checked_realloc(p->buf, p->cap);
+    }
+  }
+  memcpy(p->buf + p->len, s, len);
+  p->len += len;
 }
 
-int pairp_builtin(Atom args, Atom *result) {
-  ENSURE_1_ARG();
+void printer_puts(Printer *p, const char *s) {
+  printer_write(p, s, strlen(s));
+}
 
-  Atom p = car(args);
+void printer_putc(Printer *p, char c) {
+  printer_write(p, &c, 1);
+}
 
-  *result = boolToTF(p.type == AtomType_Pair);
+// What each pair walked by `print_scan` maps to in the labels: first whether
+// its contents are still being walked, then whether it needs a label, and
+// once it has been printed with label n, PRINT_LABEL + n.
+enum { PRINT_VISITING, PRINT_DONE, PRINT_CYCLE, PRINT_LABEL };
+
+typedef struct {
+  PtrMap pairs;
+  size_t count; // Labels given out so far.
+} PrintLabels;
+
+// Walk the pairs reachable from `atom` into `labels`, marking those in a
+// cycle PRINT_CYCLE. Returns false if out of memory.
+bool print_scan(PtrMap *labels, Atom atom) {
+  // The pairs being walked, each with the number of its children done.
+  struct { Atom pair; int done; } *stack = NULL;
+  size_t depth = 0, cap = 0;
+  bool ok = true;
+  for (;;) {
+    if (atom.type == AtomType_Pair) {
+      size_t *state = ptrmap_get(labels, atom.value.pair);
+      if (state) {
+        if (*state == PRINT_VISITING) *state = PRINT_CYCLE;
+      } else {
+        if (depth == cap) {
+          cap = cap ? 2 * cap : 64;
+          void *bigger = realloc(stack, cap * sizeof(*stack));
+          if (!bigger) {
+            ok = false;
+            break;
+          }
+          stack = bigger;
+        }
+        ptrmap_put(labels, atom.value.pair, PRINT_VISITING);
+        stack[depth].pair = atom;
+        stack[depth++].done = 0;
+      }
+    }
 
-  return Result_OK;
+    while (depth && stack[depth - 1].done == 2) {
+      size_t *state = ptrmap_get(labels, stack[--depth].pair.value.pair);
+      if (*state == PRINT_VISITING) *state = PRINT_DONE;
+    }
+    if (!depth) break;
+    Atom pair = stack[depth - 1].pair;
+    atom = stack[depth - 1].done++ ? cdr(pair) : car(pair);
+  }
+  free(stack);
+  return ok;
 }
 
-int eqp_builtin(Atom args, Atom *result) {
-  ENSURE_2_ARGS();
+// If `pair` needs a label, print it: as a reference, returning true, if the
+// pair has been printed already, and otherwise as the definition that goes
+// before it.
+bool print_label(Printer *p, PrintLabels *labels, Atom pair) {
+  char num[32];
+  size_t *state = ptrmap_get(&labels->pairs, pair.value.pair);
+  if (!state || *state < PRINT_CYCLE) return false;
+  if (*state >= PRINT_LABEL) {
+    printer_write(p, num, snprintf(num, sizeof(num), "#%zu#", *state - PRINT_LABEL));
+    return true;
+  }
+  *state = PRINT_LABEL + labels->count;
+  printer_write(p, num, snprintf(num, sizeof(num), "#%zu=", labels->count++));
+  return false;
+}
 
-  Atom a1 = car(args);
-  Atom a2 = car(cdr(args));
+void print_item(Printer *p, PrintLabels *labels, Atom atom, int depth) {
+  char num[32];
 
-  if (a1.type != a2.type) {
-    *result = boolToTF(false);
-    return Result_OK;
-  } else {
-    switch (a1.type) {
-      case AtomType_Nil:
-        *result = boolToTF(true);
-        break;
-      case AtomType_Pair:
-      case AtomType_Closure:
-      case AtomType_Macro:
-        *result = boolToTF(a1.value.pair == a2.value.pair);
-        break;
-      case AtomType_Symbol:
-        *result = boolToTF(a1.value.symbol == a2.value.symbol);
-        break;
-      case AtomType_Integer:
-        *result = boolToTF(a1.value.integer == a2.value.integer);
-        break;
-      case AtomType_Builtin:
-        *result = boolToTF(a1.value.builtin == a2.value.builtin);
+  switch (atom.type) {
+    case AtomType_Nil: printer_puts(p, "NIL"); break;
+    case AtomType_Pair: {
+      if (print_label(p, labels, atom)) break;
+      if (depth >= PRINT_MAX_DEPTH) {
+        printer_puts(p, "(...)");
         break;
+      }
+      printer_putc(p, '(');
+      print_item(p, labels, car(atom), depth + 1);
+
+      atom = cdr(atom);
+      while (!nilp(atom)) {
+        // A labelled cdr is printed on its own, for its label to go before it.
+        size_t *state = atom.type == AtomType_Pair ? ptrmap_get(&labels->pairs, atom.value.pair) : NULL;
+        if (atom.type != AtomType_Pair || (state && *state >= PRINT_CYCLE)) {
+          printer_puts(p, " . ");
+          print_item(p, labels, atom, depth + 1);
+          break;
+        }
+        printer_putc(p, ' ');
+        print_item(p, labels, car(atom), depth + 1);
+        atom = cdr(atom);
+      }
+      printer_putc(p, ')');
+      break;
+    }
+    case AtomType_Symbol:
+      printer_puts(p, atom.value.symbol);
+      break;
+    case AtomType_Integer:
+      printer_write(p, num, snprintf(num, sizeof(num), "%ld", atom.value.integer));
+      break;
+    case AtomType_Builtin:
+      printer_write(p, num, snprintf(num, sizeof(num), "#<BUILTIN:%p>", atom.value.builtin));
+      break;
+    case AtomType_Closure:
+      printer_write(p, num, snprintf(num, sizeof(num), "#<CLOSURE:%p>", (void*) atom.value.pair));
+      break;
+    case AtomType_Macro:
+      printer_write(p, num, snprintf(num, sizeof(num), "#<MACRO:%p>", (void*) atom.value.pair));
+      break;
+    case AtomType_Future:
+      printer_write(p, num, snprintf(num, sizeof(num), "#<FUTURE:%p>", (void*) atom.value.pair));
+      break;
+    case AtomType_Port:
+      printer_write(p, num, snprintf(num, sizeof(num), "#<PORT:%ld>", atom.value.integer & 0xffffffff));
+      break;
+    case AtomType_String: {
+      const char *s = string_data(atom);
+      const char *end = s + string_length(atom);
+      printer_putc(p, '"');
+      while (s < end) {
+        const char *run = s;
+        while (s < end && *s != '"' && *s != '\\' && isprint((unsigned char) *s)) ++s;
+        printer_write(p, run, s - run);
+        if (s < end) {
+          unsigned char c = *s++;
+          printer_putc(p, '\\');
+          if (c == '"' || c == '\\') {
+            printer_putc(p, c);
+          } else if (c == '\n' || c == '\t') {
+            printer_putc(p, c == '\n' ? 'n' : 't');
+          } else {
+            // Other bytes, as in `serialize` output, print as \xNN.
+            printer_putc(p, 'x');
+            printer_putc(p, "0123456789abcdef"[c >> 4]);
+            printer_putc(p, "0123456789abcdef"[c & 15]);
+          }
+        }
+      }
+      printer_putc(p, '"');
+      break;
     }
   }
+}
 
-  return Result_OK;
+void print_atom(Printer *p, Atom atom) {
+  PrintLabels labels = { { NULL, NULL, 0, 0 }, 0 };
+  if (atom.type == AtomType_Pair && !print_scan(&labels.pairs, atom))
+    printer_puts(p, "(...)");
+  else
+    print_item(p, &labels, atom, 0);
+  ptrmap_free(&labels.pairs);
 }
 
-#define INTEGER_BINOP(FN_NAME, BINOP) \
-  int FN_NAME(Atom args, Atom *result) { \
-    ENSURE_2_ARGS(); \
-\
-    Atom i1 = car(args); \
-    Atom i2 = car(cdr(args)); \
-\
-    if (i1.type != AtomType_Integer || i2.type != AtomType_Integer) { \
-      printf("Expecting two integers in binop\n"); \
-      return Error_Type; \
-    } \
-\
-    *result = make_int(i1.value.integer BINOP i2.value.integer); \
-\
-    return Result_OK; \
-  }
+void atom_fprint(FILE *out, Atom atom) {
+  char buf[4096];
+  Printer p = { buf, 0, sizeof(buf), out };
+  print_atom(&p, atom);
+  printer_flush(&p);
+}
+
+void atom_print(Atom atom) {
+  atom_fprint(stdout, atom);
+}
+
+// Print `atom` into a new string.
+Atom atom_to_string(Atom atom) {
+  Printer p = { NULL, 0, 0, NULL };
+  print_atom(&p, atom);
+  Atom s = make_string(p.buf, p.len);
+  free(p.buf);
+  return s;
+}
+
+// -----------------------------------------------------------------------------
+// Parser
+// -----------------------------------------------------------------------------
+
+Result lex(const char str[], const char **start, const char **end) {
+  const char ws[] = " \t\n";
+  const char delim[] = "() \t\n";
+  const char prefix[] = "()'`";
+
+  str += strspn(str, ws);
+  if (str[0] == '\0') {
+    *start = *end = str;
+    return Result_OK;
+  }
+
+  *start = str;
+
+  if (strchr(prefix, str[0]) != NULL) {
+    *end = str + 1; // Recognises any single prefix char as a token.
+  } else if (str[0] == ',') {
+    // Regcognise both unquote "," and unquote-splicing ",@".
+    *end = str + (str[1] == '@'? 2 : 1);
+  } else if (str[0] == '"') {
+    // Recognise a string, up to the closing quote (if any).
+    const char *s = str + 1;
+    while (*s && *s != '"') {
+      if (*s == '\\' && s[1]) ++s;
+      ++s;
+    }
+    *end = *s ? s + 1 : s;
+  } else if (str[0] == ';') {
+    const char *s = strchr(str, '\n');
+    if (s != NULL) {
+      return lex(s, start, end);
+    } else {
+      str = strchr(str, '\0');
+      *start = *end = str;
+      return Result_OK;
+    }
+  } else {
+    *end = str + strcspn(str, delim); // Recognise "other" token.
+  }
+  return Result_OK;
+}
+
+int read_expr(const char *input, const char **end, Atom *result);
+
+int parse_simple(const char *start, const char *end, Atom *result) {
+  // Is it an integer?
+  char *p;
+  long val = strtol(start, &p, 10);
+  if (p == end) {
+    result->type = AtomType_Integer;
+    result->value.integer = val;
+    return Result_OK;
+  }
+
+  // NIL or symbol
+  char* buf = malloc(end - start + 1); // FIXME: NULL check.
+  p = buf;
+  while (start != end) {
+    *p++ = toupper(*start);
+    ++start;
+  }
+  *p = '\0';
+
+  if (strcmp(buf, "NIL") == 0)
+    *result = nil;
+  else
+    *result = make_sym(buf);
+
+  free(buf);
+
+  return Result_OK;
+}
+
+int parse_string(const char *start, const char *end, Atom *result) {
+  if (end - start < 2 || end[-1] != '"') return Error_Syntax;
+
+  char *buf = malloc(end - start); // FIXME: NULL check.
+  char *p = buf;
+  for (const char *s = start + 1; s < end - 1; ++s) {
+    if (*s == '\\') {
+      ++s;
+      if (*s == 'x' && end - 1 - s > 2 && isxdigit((unsigned char) s[1]) && isxdigit((unsigned char) s[2])) {
+        char hex[3] = { s[1], s[2], '\0' };
+        *p++ = (char) strtol(hex, NULL, 16);
+        s += 2;
+        continue;
+      }
+      *p++ = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+    } else {
+      *p++ = *s;
+    }
+  }
+  *result = make_string(buf, p - buf);
+  free(buf);
+
+  return Result_OK;
+}
+
+int read_list(const char *start, const char **end, Atom *result) {
+  Atom p;
+
+  *end = start;
+  p = *result = nil;
+
+  // The list so far must survive reading each item.
+  PUSH_ROOTS(result, 1);
+  Result r;
+  for (;;) {
+    const char *token;
+    Atom item;
+
+    r = lex(*end, &token, end);
+    if (r)
+      break;
+
+    if (token[0] == ')')
+      break;
+
+    if (token[0] == '.' && *end - token == 1) {
+      // Improper list.
+      if (nilp(p)) {
+        r = Error_Syntax;
+        break;
+      }
+
+      r = read_expr(*end, end, &item);
+      if (r)
+        break;
+
+      set_cdr(p, item);
+
+      // Read the closing ')'.
+      r = lex(*end, &token, end);
+      if (!r && token[0] != ')')
+        r = Error_Syntax;
+
+      break;
+    }
+
+    r = read_expr(token, end, &item);
+    if (r)
+      break;
+
+    if (nilp(p)) {
+      // First item.
+      *result = cons(item, nil);
+      p = *result;
+    } else {
+      set_cdr(p, cons(item, nil));
+      p = cdr(p);
+    }
+  }
+  POP_ROOTS(1);
+  return r;
+}
+
+int read_expr(const char *input, const char **end, Atom *result) {
+  const char *token;
+  Result r = lex(input, &token, end);
+  if (r) return r;
+
+  if (token[0] == '\0')
+    return Error_Syntax;
+  else if (token[0] == '(')
+    return read_list(*end, end, result);
+  else if (token[0] == ')')
+    return Error_Syntax;
+  else if (token[0] == '\'' || token[0] == '`' || token[0] == ',') {
+    const char *name = token[0] == '\'' ? "QUOTE" :
+                       token[0] == '`' ? "QUASIQUOTE" :
+                       token[1] == '@' ? "UNQUOTE-SPLICING" : "UNQUOTE";
+    Atom sym = make_sym(name);
+    *result = cons(sym, cons(nil, nil));
+    Atom item;
+    PUSH_ROOTS(result, 1);
+    Result r = read_expr(*end, end, &item);
+    POP_ROOTS(1);
+    if (!r) set_car(cdr(*result), item);
+    return r;
+  } else if (token[0] == '"')
+    return parse_string(token, *end, result);
+  else
+    return parse_simple(token, *end, result);
+}
+
+// -----------------------------------------------------------------------------
+// environments
+// -----------------------------------------------------------------------------
+
+bool sym_eq(Atom sym1, Atom sym2) {
+  assert(sym1.type == AtomType_Symbol);
+  assert(sym2.type == AtomType_Symbol);
+
+  return sym1.value.symbol == sym2.value.symbol;
+}
+
+Atom env_create(Atom parent) {
+  return cons(parent, nil);
+}
+
+// While there are workers, bindings are read without the lock that
+// `env_set` holds. A binding cell is never changed once linked in: it is
+// published by a release store of the pointer to it, either into the cdr of
+// the environment or into the car of a list pair, and read back with an
+// acquire load. The types of those atoms don't change, except for the first
+// binding of an environment, whose type is stored after its pointer.
+static inline Atom env_load(Atom *p) {
+  if (__atomic_load_n(&p->type, __ATOMIC_ACQUIRE) == AtomType_Nil) return nil;
+  Atom atom;
+  atom.type = AtomType_Pair;
+  atom.value.pair = __atomic_load_n(&p->value.pair, __ATOMIC_ACQUIRE);
+  return atom;
+}
+
+static inline void env_publish(Atom *p, Atom cell) {
+  gc_barrier(*p);
+  __atomic_store_n(&p->value.pair, cell.value.pair, __ATOMIC_RELEASE);
+  __atomic_store_n(&p->type, AtomType_Pair, __ATOMIC_RELEASE);
+}
+
+// Find the `(symbol . value)` binding cell for `symbol`, walking up the chain.
+bool env_find(Atom env, Atom symbol, Atom *binding) {
+  stat_add(env_lookups, 1);
+  while (!nilp(env)) {
+    stat_add(env_links, 1);
+    // Find in this environment's bindings.
+    for (Atom bs = env_load(&cdr(env)); !nilp(bs); bs = cdr(bs)) {
+      Atom b = env_load(&car(bs));
+      if (sym_eq(car(b), symbol)) {
+        *binding = b;
+        return true;
+      }
+    }
+
+    // Try parent environment.
+    env = car(env);
+  }
+  return false;
+}
+
+int env_lookup(Atom env, Atom symbol, Atom *binding) {
+  if (env_find(env, symbol, binding)) return Result_OK;
+
+  printf("Symbol '%s' is not bound\n", symbol.value.symbol);
+  return Error_Unbound;
+}
+
+int env_get(Atom env, Atom symbol, Atom *result) {
+  Atom binding;
+  Result r = env_lookup(env, symbol, &binding);
+  if (!r) *result = cdr(binding);
+  return r;
+}
+
+// Add a binding to a freshly created environment. Nothing can have cached a
+// lookup through an environment that didn't exist, so unlike `env_set` this
+// leaves `env_version` alone.
+void env_bind(Atom env, Atom symbol, Atom value) {
+  set_cdr(env, cons(cons(symbol, value), cdr(env)));
+}
+
+int env_set(Atom env, Atom symbol, Atom value) {
+  bool shared = lisp->pool != NULL;
+  if (shared) {
+    ++self->gc_inhibit; // As in `make_sym`.
+    pthread_mutex_lock(&lisp->shared_lock);
+  }
+
+  Atom bs = cdr(env);
+  Atom binding = nil;
+
+  while (!nilp(bs)) {
+    binding = car(bs);
+    if (sym_eq(car(binding), symbol)) {
+      if (!shared) {
+        set_cdr(binding, value);
+        goto done;
+      }
+      // An atom can't be stored in one step, so rather than change the value
+      // under a worker, give the symbol a new cell. Cached cells are stale.
+      env_publish(&car(bs), cons(symbol, value));
+      break;
+    }
+    bs = cdr(bs);
+  }
+
+  if (nilp(bs)) {
+    // Binding not found -- create a new one.
+    if (shared)
+      env_publish(&cdr(env), cons(cons(symbol, value), cdr(env)));
+    else
+      env_bind(env, symbol, value);
+  }
+  ++lisp->env_version;
+
+done:
+  if (shared) {
+    pthread_mutex_unlock(&lisp->shared_lock);
+    --self->gc_inhibit;
+  }
+  return Result_OK;
+}
+
+// -----------------------------------------------------------------------------
+// Inline caches for operator lookup.
+//
+// A call site `(op args...)` is always evaluated in a fresh frame whose parent
+// is the same lexical scope (e.g. the global environment for the body of a
+// top-level DEFINE). So once `op` has been resolved from a given site and
+// scope, the binding cell can be reused until `env_version` moves on. The
+// innermost frame is new on every call and is always scanned directly.
+// -----------------------------------------------------------------------------
+
+struct CallCache {
+  Pair *site;
+  Pair *scope;
+  unsigned long version;
+  Atom binding;
+};
+
+#define CALL_CACHE_SIZE 1024
+
+// Look up the operator (a symbol) of the call-site expression `site`.
+int env_get_cached(Atom site, Atom env, Atom *result) {
+  Atom symbol = car(site);
+
+  for (Atom bs = env_load(&cdr(env)); !nilp(bs); bs = cdr(bs)) {
+    Atom b = env_load(&car(bs));
+    if (sym_eq(car(b), symbol)) {
+      *result = cdr(b);
+      return Result_OK;
+    }
+  }
+
+  // The cache isn't shared with workers.
+  Atom scope = car(env);
+  if (nilp(scope) || self != &lisp->main) return env_get(env, symbol, result);
+
+  CallCache *c = &lisp->call_cache[((uintptr_t) site.value.pair >> 4) % CALL_CACHE_SIZE];
+  if (c->site != site.value.pair || c->scope != scope.value.pair ||
+      c->version != lisp->env_version) {
+    Atom binding;
+    Result r = env_lookup(scope, symbol, &binding);
+    if (r) return r;
+
+    c->site = site.value.pair;
+    c->scope = scope.value.pair;
+    c->version = lisp->env_version;
+    c->binding = binding;
+  }
+
+  *result = cdr(c->binding);
+  return Result_OK;
+}
+
+// -----------------------------------------------------------------------------
+// builtin functions
+// -----------------------------------------------------------------------------
+
+Atom make_builtin(Builtin f) {
+  Atom a;
+  a.type = AtomType_Builtin;
+  a.value.builtin = f;
+  return a;
+}
+
+// Create a _shallow_ copy of the argument list.
+Atom copy_list(Atom list) {
+  if (nilp(list)) return nil;
+
+  Atom a = cons(car(list), nil);
+  Atom p = a;
+  list = cdr(list);
+
+  PUSH_ROOT(a);
+  while (!nilp(list)) {
+    set_cdr(p, cons(car(list), nil));
+    p = cdr(p);
+    list = cdr(list);
+  }
+  POP_ROOTS(1);
+
+  return a;
+}
+
+Result eval_expr(Atom expr, Atom env, Atom *result);
+void profile_call(Atom env, Atom closure);
+
+#ifdef LISP_STATS
+int builtin_index(Builtin fn);
+
+int call_builtin(Builtin fn, Atom args, Atom *result) {
+  int i = builtin_index(fn);
+  uint64_t start = gc_clock();
+  int r = fn(args, result);
+  if (i >= 0) {
+    stat_add(builtin_calls[i], 1);
+    stat_add(builtin_time[i], gc_clock() - start);
+  }
+  return r;
+}
+#else
+#define call_builtin(fn, args, result) ((fn)(args, result))
+#endif
+
+// Compiled code calls closures through `apply`, recursing on the C stack, so
+// once nested compiled calls have used this much of it closures are
+// interpreted instead.
+#define AOT_MAX_STACK (1 << 20)
+
+// The `--compile-to-c` code of closure `f`, or NULL. The body of a compiled
+// DEFINE starts with the builtin it was compiled to (see `aot_attach`), which
+// evaluates to itself when the closure is interpreted.
+Builtin aot_code(Atom f) {
+  if (f.type != AtomType_Closure) return NULL;
+  Atom body = cdr(cdr(f));
+  return body.type == AtomType_Pair && car(body).type == AtomType_Builtin
+      ? car(body).value.builtin : NULL;
+}
+
+// Run `closure` as compiled code if it has any, returning false if it
+// doesn't or the C stack is already deep in compiled calls.
+bool aot_run(Atom closure, Atom args, Atom *result, int *err) {
+  Builtin code = aot_code(closure);
+  if (!code) return false;
+  char here;
+  if (self->aot_depth == 0)
+    self->aot_stack = &here;
+  else if (self->aot_stack - &here > AOT_MAX_STACK)
+    return false;
+  ++self->aot_depth;
+  *err = code(args, result);
+  --self->aot_depth;
+  return true;
+}
+
+// The caller roots `f` and `args`.
+int apply(Atom f, Atom args, Atom *result) {
+  int err;
+  if (f.type == AtomType_Builtin) {
+    return call_builtin(f.value.builtin, args, result);
+  } else if (aot_run(f, args, result, &err)) {
+    return err;
+  } else if (f.type == AtomType_Closure) {
+    Atom env = env_create(car(f));
+    if (self == &lisp->main && lisp->profile) profile_call(env, f);
+    Atom arg_names = car(cdr(f));
+    Atom body = cdr(cdr(f));
+    PUSH_ROOT(env);
+
+    // Bind the arguments in the new environment.
+    Result r = Result_OK;
+    while (!nilp(arg_names)) {
+      if (arg_names.type == AtomType_Symbol) {
+        // Process in improper list which gets the rest of the args.
+        Atom sym = arg_names;
+        env_bind(env, sym, args);
+        args = nil; // Don't trip up below on "Too many args".
+        break;
+      } else {
+        if (nilp(args)) {
+          r = Error_Args;
+          break;
+        }
+        env_bind(env, car(arg_names), car(args));
+        arg_names = cdr(arg_names);
+        args = cdr(args);
+      }
+    }
+
+    if (!r && !nilp(args)) r = Error_Args; // Too many args.
+
+    // Evaluate the body (body is a sequence of expressions).
+    while (!r && !nilp(body)) {
+      r = eval_expr(car(body), env, result);
+      body = cdr(body);
+    }
+    POP_ROOTS(1);
+
+    return r;
+  }
+  printf("Expecting type builtin or closure in apply");
+  return Error_Type;
+}
+
+#define ENSURE_0_ARGS() \
+  if (!nilp(args)) return Error_Args
+
+#define ENSURE_1_ARG() \
+  if (nilp(args) || !nilp(cdr(args))) return Error_Args
+
+#define ENSURE_2_ARGS() \
+  if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args)))) return Error_Args
+
+#define ENSURE_3_ARGS() \
+  if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args))) || !nilp(cdr(cdr(cdr(args))))) \
+    return Error_Args
+
+int apply_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  Atom fn = car(args);
+  args = car(cdr(args));
+
+  if (!listp(args)) return Error_Syntax;
+  for (Atom p = args; !nilp(p); p = cdr(p))
+    pair_car(p);
+
+  return apply(fn, args, result);
+}
+
+int car_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom arg = car(args);
+
+  if (nilp(arg) || arg.type != AtomType_Pair) *result = nil;
+  else if (arg.type != AtomType_Pair) {
+    printf("Expecting a pair in car\n");
+    return Error_Type;
+  } else *result = pair_car(arg);
+  return Result_OK;
+}
+
+int cdr_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom arg = car(args);
+
+  if (nilp(arg) || arg.type != AtomType_Pair) *result = nil;
+  else if (arg.type != AtomType_Pair) {
+    printf("Expecting a pair in cdr\n");
+    return Error_Type;
+  } else *result = cdr(arg);
+  return Result_OK;
+}
+
+int write_to_string_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  *result = atom_to_string(car(args));
+
+  return Result_OK;
+}
+
+int cons_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  Atom a1 = car(args);
+  Atom a2 = car(cdr(args));
+
+  *result = cons(a1, a2);
+
+  return Result_OK;
+}
+
+// A pair whose car is dropped, becoming nil, once nothing else refers to it.
+int weak_cons_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  *result = cons(car(args), car(cdr(args)));
+  Allocation *a = (Allocation*) result->value.pair;
+  a->weak = 1;
+  // Allocated during an incremental mark, it's marked already and won't be
+  // scanned, so record it here.
+  if (lisp->marking) mark_weak(&lisp->mark_stack, a);
+
+  return Result_OK;
+}
+
+// Have `(proc object)` called once `object` is unreachable, shortly after the
+// collection that finds it so. Returns `object`.
+int finalize_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  Atom entry = cons(car(args), car(cdr(args)));
+  ((Allocation*) entry.value.pair)->weak = 1;
+  lisp->finalizers = cons(entry, lisp->finalizers);
+  *result = car(args);
+
+  return Result_OK;
+}
+
+Atom boolToTF(bool b) {
+    return b ? TRUE_SYM : nil;
+}
+
+int pairp_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom p = car(args);
+
+  *result = boolToTF(p.type == AtomType_Pair);
+
+  return Result_OK;
+}
+
+int eqp_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  Atom a1 = car(args);
+  Atom a2 = car(cdr(args));
+
+  if (a1.type != a2.type) {
+    *result = boolToTF(false);
+    return Result_OK;
+  } else {
+    switch (a1.type) {
+      case AtomType_Nil:
+        *result = boolToTF(true);
+        break;
+      case AtomType_Pair:
+      case AtomType_Closure:
+      case AtomType_Macro:
+      case AtomType_String:
+      case AtomType_Future:
+        *result = boolToTF(a1.value.pair == a2.value.pair);
+        break;
+      case AtomType_Symbol:
+        *result = boolToTF(a1.value.symbol == a2.value.symbol);
+        break;
+      case AtomType_Integer:
+      case AtomType_Port:
+        *result = boolToTF(a1.value.integer == a2.value.integer);
+        break;
+      case AtomType_Builtin:
+        *result = boolToTF(a1.value.builtin == a2.value.builtin);
+        break;
+    }
+  }
+
+  return Result_OK;
+}
+
+#define INTEGER_BINOP(FN_NAME, BINOP) \
+  int FN_NAME(Atom args, Atom *result) { \
+    ENSURE_2_ARGS(); \
+\
+    Atom i1 = car(args); \
+    Atom i2 = car(cdr(args)); \
+\
+    if (i1.type != AtomType_Integer || i2.type != AtomType_Integer) { \
+      printf("Expecting two integers in binop\n"); \
+      return Error_Type; \
+    } \
+\
+    *result = make_int(i1.value.integer BINOP i2.value.integer); \
+\
+    return Result_OK; \
+  }
 
 INTEGER_BINOP(add_builtin, +)
 INTEGER_BINOP(sub_builtin, -)
 INTEGER_BINOP(mul_builtin, *)
 INTEGER_BINOP(div_builtin, /)
 
-#define INTEGER_RELOP(FN_NAME, BINOP) \
-  int FN_NAME(Atom args, Atom *result) { \
-    ENSURE_2_ARGS(); \
-\
-    Atom i1 = car(args); \
-    Atom i2 = car(cdr(args)); \
-\
-    if (i1.type != AtomType_Integer || i2.type != AtomType_Integer) { \
-      printf("Expecting two integers in relop\n"); \
-      return Error_Type; \
-    } \
-\
-    *result = boolToTF(i1.value.integer BINOP i2.value.integer); \
-\
-    return Result_OK; \
+#define INTEGER_RELOP(FN_NAME, BINOP) \
+  int FN_NAME(Atom args, Atom *result) { \
+    ENSURE_2_ARGS(); \
+\
+    Atom i1 = car(args); \
+    Atom i2 = car(cdr(args)); \
+\
+    if (i1.type != AtomType_Integer || i2.type != AtomType_Integer) { \
+      printf("Expecting two integers in relop\n"); \
+      return Error_Type; \
+    } \
+\
+    *result = boolToTF(i1.value.integer BINOP i2.value.integer); \
+\
+    return Result_OK; \
+  }
+
+INTEGER_RELOP(integer_eq_builtin, ==)
+INTEGER_RELOP(integer_lt_builtin, <)
+INTEGER_RELOP(integer_le_builtin, <=)
+INTEGER_RELOP(integer_gt_builtin, >)
+INTEGER_RELOP(integer_ge_builtin, >=)
+
+// The collector's statistics, as an association list. HEAP is the number of
+// cells allocated and not yet freed, garbage not yet swept included; LIVE is
+// the number the last collection found reachable. Times are in microseconds.
+int gc_stats_builtin(Atom args, Atom *result) {
+  ENSURE_0_ARGS();
+
+  gc_count(&lisp->main);
+  GcStats *stats = &lisp->gc_stats;
+  const struct {
+    const char *name;
+    long value;
+  } fields[] = {
+    { "ALLOCATED", stats->allocated },
+    { "FREED", stats->freed },
+    { "HEAP", stats->allocated - stats->freed },
+    { "LIVE", stats->live },
+    { "COLLECTIONS", stats->collections },
+    { "COMPACTIONS", stats->compactions },
+    { "PAUSES", stats->pauses },
+    { "PAUSE-TOTAL", stats->pause_total / 1000 },
+    { "PAUSE-MAX", stats->pause_max / 1000 },
+  };
+
+  *result = nil;
+  for (int i = sizeof(fields) / sizeof(fields[0]) - 1; i >= 0; --i)
+    *result = cons(cons(make_sym(fields[i].name), make_int(fields[i].value)), *result);
+  return Result_OK;
+}
+
+// -----------------------------------------------------------------------------
+// Stack frames.
+// -----------------------------------------------------------------------------
+
+Atom list_get(Atom list, int k) {
+  while (k--)
+    list = cdr(list);
+  return car(list);
+}
+
+void list_set(Atom list, int k, Atom value) {
+  while (k--)
+    list = cdr(list);
+  set_car(list, value);
+}
+
+void list_reverse(Atom *list) {
+  Atom tail = nil;
+  while (!nilp(*list)) {
+    Atom p = cdr(*list);
+    set_cdr(*list, tail);
+    tail = *list;
+    *list = p;
+  }
+  *list = tail;
+}
+
+//
+// Frames take the following form:
+//
+//   (parent env evaluated-op (pending-arg...) (evaluated-arg...) (body...))
+//
+Atom make_frame(Atom parent, Atom env, Atom tail) {
+  stat_add(frames, 1);
+  return cons(
+    parent,
+    cons(env,
+    cons(nil, // op
+    cons(tail,
+    cons(nil, // args
+    cons(nil, // body
+    nil))))));
+}
+
+// -----------------------------------------------------------------------------
+// Evaluation
+//   - a literal evaluates to itself.
+//   - a symbol is looked up in the environment. It's an error if no binding exists.
+//   - a list expression of one of the following is a _special form_:
+//     - (QUOTE expr) => evaluates to expr (which is returned without evaluating).
+//     - (DEFINE sym expr) => creates a binding for `sym` in the evaluation environment.
+//                            The final result is `sym`.
+//     - (DEFINE (name args...) body...) => (DEFINE name (LAMBDA (args...) body...)
+//     - (LAMBDA args body...)
+//     - (IF cond when_true when_false)
+//     - (DEFMACRO (name arg...) body...)
+// -----------------------------------------------------------------------------
+
+void pool_safepoint();
+
+// Set by SIGPROF while profiling (see "Profiler").
+static atomic_bool profile_tick = false;
+void profile_sample();
+void profile_name(Atom value, Atom sym);
+
+int eval_do_exec(Atom *stack, Atom *expr, Atom *env) {
+  *env = list_get(*stack, 1);
+  Atom body = list_get(*stack, 5);
+  *expr = car(body);
+  body = cdr(body);
+  if (nilp(body)) {
+    // Finished function - pop the stack.
+    *stack = car(*stack);
+  } else {
+    list_set(*stack, 5, body);
+  }
+
+  return Result_OK;
+}
+
+bool jit_run(Atom closure, Atom args, Atom *result, int *err);
+
+int eval_do_bind(Atom *stack, Atom *expr, Atom *env, Atom *result) {
+  Atom body = list_get(*stack, 5);
+  if (!nilp(body))
+    return eval_do_exec(stack, expr, env);
+
+  Atom op = list_get(*stack, 2);
+  Atom args = list_get(*stack, 4);
+
+  int err;
+  if (aot_run(op, args, result, &err) || jit_run(op, args, result, &err)) {
+    // Compiled code has done all the work - pop the stack.
+    *stack = car(*stack);
+    Atom quote = make_sym("QUOTE");
+    *expr = cons(quote, cons(*result, nil));
+    return err;
+  }
+
+  *env = env_create(car(op));
+  if (self == &lisp->main && lisp->profile) profile_call(*env, op);
+  Atom arg_names = car(cdr(op));
+  body = cdr(cdr(op));
+  list_set(*stack, 1, *env);
+  list_set(*stack, 5, body);
+
+  // Bind the arguments.
+  while (!nilp(arg_names)) {
+    if (arg_names.type == AtomType_Symbol) {
+      env_bind(*env, arg_names, args);
+      args = nil;
+      break;
+    }
+
+    if (nilp(args))
+      return Error_Args;
+    env_bind(*env, car(arg_names), car(args));
+    arg_names = cdr(arg_names);
+    args = cdr(args);
+  }
+  if (!nilp(args))
+    return Error_Args;
+
+  list_set(*stack, 4, nil);
+
+  return eval_do_exec(stack, expr, env);
+}
+
+int eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result) {
+  Atom op = list_get(*stack, 2);
+  Atom args = list_get(*stack, 4);
+
+  if (!nilp(args)) {
+    list_reverse(&args);
+    list_set(*stack, 4, args);
+  }
+
+  if (op.type == AtomType_Symbol) {
+    if (strcmp(op.value.symbol, "APPLY") == 0) {
+      // Replace the current frame, which holds `args` until the new one is made.
+      *stack = make_frame(car(*stack), *env, nil);
+      op = car(args);
+      args = car(cdr(args));
+      if (!listp(args))
+        return Error_Syntax;
+
+      list_set(*stack, 2, op);
+      list_set(*stack, 4, args);
+    }
+  }
+
+  if (op.type == AtomType_Builtin) {
+    *expr = cons(op, args);
+    *stack = car(*stack);
+    return Result_OK;
+  } else if (op.type != AtomType_Closure) {
+    printf("Expecting closure\n");
+    return Error_Type;
+  }
+
+  return eval_do_bind(stack, expr, env, result);
+}
+
+int eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result) {
+  *env = list_get(*stack, 1);
+  Atom op = list_get(*stack, 2);
+  Atom body = list_get(*stack, 5);
+
+  if (!nilp(body)) {
+    // Still running a procedure; ignore the result.
+    return eval_do_apply(stack, expr, env, result);
+  }
+
+  Atom args;
+  if (nilp(op)) {
+    // Finished evaluating operator.
+    op = *result;
+    list_set(*stack, 2, op);
+
+    if (op.type == AtomType_Macro) {
+      // Don't evaluate macro arguments.
+      stat_add(macro_expansions, 1);
+      args = list_get(*stack, 3);
+      *stack = make_frame(*stack, *env, nil);
+      op.type = AtomType_Closure;
+      list_set(*stack, 2, op);
+      list_set(*stack, 4, args);
+      return eval_do_bind(stack, expr, env, result);
+    }
+  } else if (op.type == AtomType_Symbol) {
+    // Finished working on special form.
+    if (strcmp(op.value.symbol, "DEFINE") == 0) {
+      Atom sym = list_get(*stack, 4);
+      (void) env_set(*env, sym, *result);
+      profile_name(*result, sym);
+      *stack = car(*stack);
+      Atom quote = make_sym("QUOTE");
+      *expr = cons(quote, cons(sym, nil));
+      return Result_OK;
+    } else if (strcmp(op.value.symbol, "IF") == 0) {
+      args = list_get(*stack, 3);
+      *expr = nilp(*result) ? car(cdr(args)) : car(args);
+      *stack = car(*stack);
+      return Result_OK;
+    } else {
+      goto store_arg;
+    }
+  } else if (op.type == AtomType_Macro) {
+    // Finished evaluating macro.
+    *expr = *result;
+    *stack = car(*stack);
+    return Result_OK;
+  } else {
+store_arg:
+    // Store evaluated argument.
+    args = list_get(*stack, 4);
+    list_set(*stack, 4, cons(*result, args));
+  }
+
+  args = list_get(*stack, 3);
+  if (nilp(args)) {
+    // No more arguments left to evaluate.
+    return eval_do_apply(stack, expr, env, result);
+  }
+
+  // Evaluate next argument.
+  *expr = car(args);
+  list_set(*stack, 3, cdr(args));
+  return Result_OK;
+}
+
+Result eval_loop(Atom expr, Atom env, Atom *result, EvalRoots *roots) {
+  Result err = Result_OK;
+  Atom stack = nil;
+  Atom original = expr; // Callers may still report it.
+
+  roots->expr = &expr;
+  roots->original = &original;
+  roots->env = &env;
+  roots->stack = &stack;
+
+  do {
+    if (lisp->stop_world) pool_safepoint();
+    if (profile_tick) profile_sample();
+    stat_add(eval_steps, 1);
+    if (lisp->eval_limit && ++self->eval_steps > lisp->eval_limit) {
+      err = Error_Limit;
+      break;
+    }
+    if (lisp->gc_wanted && self == &lisp->main) gc(nil, nil, nil);
+    if (!nilp(lisp->finalize_ready) && self == &lisp->main && !lisp->finalizing)
+      gc_run_finalizers();
+    if (expr.type == AtomType_Symbol) {
+      err = env_get(env, expr, result);
+    } else if (expr.type != AtomType_Pair) {
+      *result = expr;
+    } else if (!listp(expr)) {
+      return Error_Syntax;
+    } else {
+      Atom op = car(expr);
+      Atom args = cdr(expr);
+
+      if (op.type == AtomType_Symbol) {
+        // Handle special forms.
+        if (strcmp(op.value.symbol, "GC") == 0) {
+          ENSURE_0_ARGS();
+          gc(expr, env, stack);
+          *result = TRUE_SYM;
+          return Result_OK;
+        } else if (strcmp(op.value.symbol, "QUOTE") == 0) {
+          ENSURE_1_ARG();
+          *result = car(args);
+        } else if (strcmp(op.value.symbol, "DEFINE") == 0) {
+          if (nilp(args) || nilp(cdr(args))) return Error_Args; // At least two args.
+
+          Atom sym = car(args);
+          if (sym.type == AtomType_Pair) {
+            // (DEFINE (name args...) body...)
+            err = make_closure(env, cdr(sym), cdr(args), result);
+            sym = car(sym);
+            if (sym.type != AtomType_Symbol) {
+              printf("DEFINE expecting symbol\n");
+              return Error_Type;
+            }
+            (void) env_set(env, sym, *result);
+            profile_name(*result, sym);
+            *result = sym;
+          } else if (sym.type == AtomType_Symbol) {
+            // (DEFINE sym expr)
+            ENSURE_2_ARGS();
+            stack = make_frame(stack, env, nil);
+            list_set(stack, 2, op);
+            list_set(stack, 4, sym);
+            expr = car(cdr(args));
+            continue;
+          } else {
+            printf("Invalid type for DEFINE\n");
+            return Error_Type;
+          }
+        } else if (strcmp(op.value.symbol, "LAMBDA") == 0) {
+          if (nilp(args) || nilp(cdr(args))) return Error_Args;
+          err = make_closure(env, car(args), cdr(args), result);
+        } else if (strcmp(op.value.symbol, "IF") == 0) {
+          ENSURE_3_ARGS();
+
+          stack = make_frame(stack, env, cdr(args));
+          list_set(stack, 2, op);
+          expr = car(args);
+          continue;
+        } else if (strcmp(op.value.symbol, "DEFMACRO") == 0) {
+
+          if (nilp(args) || nilp(cdr(args)))
+            return Error_Args;
+
+          if (car(args).type != AtomType_Pair) {
+            printf("Expecting symbol in DEFMACRO\n");
+            return Error_Syntax;
+          }
+
+          Atom name = car(car(args));
+          if (name.type != AtomType_Symbol) {
+            printf("DEFMACRO expecting symbol\n");
+            return Error_Type;
+          }
+
+          Atom macro;
+          err = make_closure(env, cdr(car(args)), cdr(args), &macro);
+          if (!err) {
+            macro.type = AtomType_Macro; // Clobber AtomType_Closure.
+            *result = name;
+            (void) env_set(env, name, macro);
+            profile_name(macro, name);
+          }
+        } else if (strcmp(op.value.symbol, "APPLY") == 0) {
+          if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+            return Error_Args;
+
+          stack = make_frame(stack, env, cdr(args));
+          list_set(stack, 2, op);
+          expr = car(args);
+          continue;
+        } else {
+          goto push;
+        }
+      } else if (op.type == AtomType_Builtin) {
+        err = call_builtin(op.value.builtin, args, result);
+      } else {
+      push:
+        // Handle function application.
+        stack = make_frame(stack, env, args);
+        if (op.type != AtomType_Symbol) {
+          expr = op;
+          continue;
+        }
+        err = env_get_cached(expr, env, result);
+      }
+    }
+
+    if (nilp(stack))
+      break;
+
+    if (!err)
+      err = eval_do_return(&stack, &expr, &env, result);
+  } while (!err);
+
+  return err;
+}
+
+Result eval_expr(Atom expr, Atom env, Atom *result) {
+  // Collections started while this runs, on this thread or another, find
+  // the roots in its locals.
+  *result = nil;
+  EvalRoots roots = { &expr, &expr, &env, &expr, result, self->roots };
+  self->roots = &roots;
+  Result r = eval_loop(expr, env, result, &roots);
+  self->roots = roots.prev;
+  return r;
+}
+
+// -----------------------------------------------------------------------------
+// Futures
+//
+// `(future expr)` (a macro over `(future-call f args...)`) evaluates `expr`
+// on a worker thread, `(touch x)` waits for a future's value, and
+// `(pmap f list)` is `map` with every call made a future.
+//
+// Each worker has a deque of futures: it pops from the end of its own and,
+// when that's empty, steals from the start of the others'. A thread that
+// touches a future nobody has started runs it itself. All of this is guarded
+// by one lock, as every task is at least one full closure call.
+//
+// Workers share the heap but allocate onto lists of their own, and never
+// collect. When a worker has allocated enough it asks the main thread to,
+// which sets `stop_world` and waits until every worker has parked: at the
+// top of the evaluation loop, idle, or waiting in `touch`. Its roots are then
+// the `EvalRoots`, shadow stack and pinned atoms of every Mutator, plus the
+// queued futures.
+// A worker waiting while its `gc_inhibit` is set can't be scanned, so the
+// collection is skipped instead.
+//
+// Definitions are made under `shared_lock`, but lookups aren't locked, so
+// redefining a global while a worker is using it is a race.
+// -----------------------------------------------------------------------------
+
+enum {
+  Future_Queued,
+  Future_Running,
+  Future_Done,
+  Future_Failed
+};
+
+// A future holds its call `(f arg...)` until it's done, then its value or
+// error code. The status is an integer in the cdr.
+#define future_status(f) (cdr(f).value.integer)
+
+typedef struct {
+  ThreadPool *pool;
+  pthread_t thread;
+  Mutator mutator;
+  Pair **tasks;         // Queued futures, from `head` to `tail`.
+  size_t head;
+  size_t tail;
+  size_t cap;
+} Worker;
+
+struct ThreadPool {
+  LispContext *context;
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // Broadcast on any change below or to a future.
+  Worker *workers;
+  int nworkers;
+  int next;               // Worker the main thread queues to next.
+  int running;            // Workers running Lisp code (not idle or parked).
+  int blocked;            // Of those, waiting with `gc_inhibit` set.
+  bool shutdown;
+};
+
+Atom make_future(Pair *pair) {
+  Atom future;
+  future.type = AtomType_Future;
+  future.value.pair = pair;
+  return future;
+}
+
+Worker *current_worker() {
+  if (self == &lisp->main) return NULL;
+  return (Worker*) ((char*) self - offsetof(Worker, mutator));
+}
+
+// Queue `task` on `w`, or return false if there's no memory to; it's left
+// for whoever touches it to run.
+bool worker_push(Worker *w, Pair *task) {
+  if (w->tail == w->cap) {
+    if (w->head > 0) {
+      memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(Pair*));
+      w->tail -= w->head;
+      w->head = 0;
+    } else {
+      size_t cap = w->cap ? 2 * w->cap : 64;
+      Pair **bigger = realloc(w->tasks, cap * sizeof(Pair*));
+      if (!bigger) return false;
+      w->tasks = bigger;
+      w->cap = cap;
+    }
+  }
+  w->tasks[w->tail++] = task;
+  return true;
+}
+
+// Claim a queued future for `w`: the newest of its own, or else the oldest
+// of someone else's. Called with the lock held.
+bool pool_take(ThreadPool *pool, Worker *w, Atom *future) {
+  int start = w - pool->workers;
+  for (int i = 0; i < pool->nworkers; ++i) {
+    Worker *v = &pool->workers[(start + i) % pool->nworkers];
+    while (v->head < v->tail) {
+      Atom f = make_future(v == w ? v->tasks[--v->tail] : v->tasks[v->head++]);
+      if (v->head == v->tail) v->head = v->tail = 0;
+
+      // Futures touched before a worker got to them are already done.
+      if (future_status(f) == Future_Queued) {
+        future_status(f) = Future_Running;
+        *future = f;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Evaluate the call of a future this thread has claimed, and store the result.
+void future_run(Atom future) {
+  Atom pinned = self->pinned;
+  self->pinned = cons(future, pinned);
+
+  // Builtins take their arguments as they are; closures get them quoted.
+  Atom call = car(future);
+  Atom fn = car(call);
+  Atom expr = cdr(call);
+  if (fn.type != AtomType_Builtin) {
+    Atom quote = make_sym("QUOTE");
+    expr = nil;
+    PUSH_ROOT(expr);
+    for (Atom p = cdr(call); !nilp(p); p = cdr(p))
+      expr = cons(cons(quote, cons(car(p), nil)), expr);
+    POP_ROOTS(1);
+    list_reverse(&expr);
+  }
+  expr = cons(fn, expr);
+
+  Atom result;
+  Result r = eval_expr(expr, lisp->global_env, &result);
+
+  ThreadPool *pool = lisp->pool;
+  pthread_mutex_lock(&pool->lock);
+  set_car(future, r ? make_int(r) : result);
+  future_status(future) = r ? Future_Failed : Future_Done;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+
+  self->pinned = pinned;
+}
+
+void *worker_main(void *arg) {
+  Worker *w = arg;
+  ThreadPool *pool = w->pool;
+  lisp = pool->context;
+  self = &w->mutator;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->shutdown) {
+    Atom future;
+    if (lisp->stop_world || !pool_take(pool, w, &future)) {
+      pthread_cond_wait(&pool->changed, &pool->lock);
+      continue;
+    }
+
+    ++pool->running;
+    pthread_mutex_unlock(&pool->lock);
+    future_run(future);
+    pthread_mutex_lock(&pool->lock);
+    --pool->running;
+    pthread_cond_broadcast(&pool->changed);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+void gc_abandon();
+
+ThreadPool *pool_get() {
+  if (lisp->pool) return lisp->pool;
+
+  // Workers don't run the write barrier, so an incremental mark can't go on.
+  if (lisp->marking) gc_abandon();
+
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  if (!pool) out_of_memory();
+  pool->context = lisp;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->changed, NULL);
+
+  // The thread that touches a future can always run it, so by default leave
+  // it a CPU.
+  int n = lisp->threads;
+  if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  // Without workers, futures run when they're touched.
+  pool->workers = calloc(n > 0 ? n : 1, sizeof(Worker));
+  if (!pool->workers) n = 0;
+  lisp->pool = pool;
+
+  pthread_mutex_lock(&pool->lock);
+  for (int i = 0; i < n; ++i) {
+    Worker *w = &pool->workers[i];
+    w->pool = pool;
+    w->mutator.heap = &w->mutator.allocations;
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) break;
+    ++pool->nworkers;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return pool;
+}
+
+void pool_close(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nworkers; ++i) {
+    Worker *w = &pool->workers[i];
+    pthread_join(w->thread, NULL);
+
+    // Hand the worker's allocations over to the context.
+    gc_sweep(&w->mutator);
+    Allocation **p = &w->mutator.allocations;
+    while (*p) p = &(*p)->next;
+    *p = pool->context->last_allocation;
+    pool->context->last_allocation = w->mutator.allocations;
+    free(w->mutator.shadow);
+    free(w->tasks);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->changed);
+  free(pool->workers);
+  free(pool);
+}
+
+// Called by a worker at the top of the evaluation loop when `stop_world` is
+// set.
+void pool_safepoint() {
+  if (self == &lisp->main || self->gc_inhibit) return;
+
+  ThreadPool *pool = lisp->pool;
+  pthread_mutex_lock(&pool->lock);
+  --pool->running;
+  pthread_cond_broadcast(&pool->changed);
+  while (lisp->stop_world)
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  ++pool->running;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_want_gc(ThreadPool *pool) {
+  if (lisp->gc_wanted) return;
+
+  pthread_mutex_lock(&pool->lock);
+  lisp->gc_wanted = true;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for every worker to park. On success the lock is held until
+// `pool_resume`.
+bool pool_stop_world(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  lisp->stop_world = true;
+  while (pool->running > pool->blocked)
+    pthread_cond_wait(&pool->changed, &pool->lock);
+
+  if (pool->blocked) {
+    lisp->stop_world = false;
+    lisp->gc_wanted = false;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    return false;
+  }
+  return true;
+}
+
+void pool_resume(ThreadPool *pool) {
+  lisp->stop_world = false;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_mark(ThreadPool *pool) {
+  for (int i = 0; i < pool->nworkers; ++i) {
+    Worker *w = &pool->workers[i];
+    gc_mark_mutator(&w->mutator);
+    for (size_t j = w->head; j < w->tail; ++j)
+      gc_mark(make_future(w->tasks[j]));
+  }
+}
+
+void pool_sweep(ThreadPool *pool) {
+  for (int i = 0; i < pool->nworkers; ++i)
+    gc_sweep(&pool->workers[i].mutator);
+}
+
+void pool_defer_sweep(ThreadPool *pool) {
+  for (int i = 0; i < pool->nworkers; ++i)
+    gc_defer_sweep(&pool->workers[i].mutator);
+}
+
+void pool_count(ThreadPool *pool) {
+  for (int i = 0; i < pool->nworkers; ++i)
+    gc_count(&pool->workers[i].mutator);
+}
+
+// A future for the call `(f arg...)`, queued for the pool.
+Atom future_new(Atom call) {
+  ThreadPool *pool = pool_get();
+  Atom future = make_future(cons(call, make_int(Future_Queued)).value.pair);
+
+  if (pool->nworkers > 0) {
+    pthread_mutex_lock(&pool->lock);
+    Worker *w = current_worker();
+    if (!w) w = &pool->workers[pool->next++ % pool->nworkers];
+    if (worker_push(w, future.value.pair)) pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return future;
+}
+
+int future_touch(Atom future, Atom *result) {
+  ThreadPool *pool = lisp->pool;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    long status = future_status(future);
+    if (status == Future_Done || status == Future_Failed) break;
+
+    if (status == Future_Queued) {
+      // Nobody has started it, so don't wait.
+      future_status(future) = Future_Running;
+      pthread_mutex_unlock(&pool->lock);
+      future_run(future);
+      pthread_mutex_lock(&pool->lock);
+    } else if (self == &lisp->main) {
+      // The main thread collects for the workers while it waits.
+      if (lisp->gc_wanted && !self->gc_inhibit) {
+        pthread_mutex_unlock(&pool->lock);
+        gc(nil, nil, nil);
+        pthread_mutex_lock(&pool->lock);
+      } else {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+      }
+    } else {
+      // A worker is parked while it waits, unless it has unrooted atoms.
+      bool parked = !self->gc_inhibit;
+      if (parked) --pool->running; else ++pool->blocked;
+      pthread_cond_broadcast(&pool->changed);
+      pthread_cond_wait(&pool->changed, &pool->lock);
+      if (parked) {
+        while (lisp->stop_world)
+          pthread_cond_wait(&pool->changed, &pool->lock);
+        ++pool->running;
+      } else {
+        --pool->blocked;
+      }
+    }
+  }
+
+  Result r = Result_OK;
+  if (future_status(future) == Future_Done)
+    *result = car(future);
+  else
+    r = car(future).value.integer;
+  pthread_mutex_unlock(&pool->lock);
+  return r;
+}
+
+int future_call_builtin(Atom args, Atom *result) {
+  if (nilp(args)) return Error_Args;
+
+  Atom fn = car(args);
+  if (fn.type != AtomType_Builtin && fn.type != AtomType_Closure) {
+    printf("Expecting closure or builtin in future-call\n");
+    return Error_Type;
+  }
+
+  *result = future_new(args);
+  return Result_OK;
+}
+
+// (touch x) => the value of x, if it's a future, or x itself.
+int touch_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom x = car(args);
+  if (x.type != AtomType_Future) {
+    *result = x;
+    return Result_OK;
+  }
+  return future_touch(x, result);
+}
+
+int pmap_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  Atom fn = car(args);
+  Atom list = car(cdr(args));
+  if (fn.type != AtomType_Builtin && fn.type != AtomType_Closure) {
+    printf("Expecting closure or builtin in pmap\n");
+    return Error_Type;
+  }
+  if (!listp(list)) {
+    printf("Expecting list in pmap\n");
+    return Error_Type;
+  }
+
+  Atom futures = nil;
+  PUSH_ROOT(futures);
+  for (Atom p = list; !nilp(p); p = cdr(p))
+    futures = cons(future_new(cons(fn, cons(pair_car(p), nil))), futures);
+  POP_ROOTS(1);
+  list_reverse(&futures);
+
+  // Replace each future with its value, which leaves the result list.
+  Atom pinned = self->pinned;
+  self->pinned = cons(futures, pinned);
+  Result r = Result_OK;
+  for (Atom p = futures; !nilp(p) && !r; p = cdr(p))
+    r = future_touch(car(p), &car(p));
+  self->pinned = pinned;
+
+  if (!r) *result = futures;
+  return r;
+}
+
+// -----------------------------------------------------------------------------
+// Closure compilation
+//
+// With `--compile-closures`, closures that are called often enough are
+// compiled, at run time, into a tree of nodes, each carrying a pointer to the
+// C function (its template) that executes it. (The jit_ prefix of what follows
+// refers to compiling just in time.) Running the tree skips the frame list,
+// the argument reversal and the special form dispatch of `eval_expr`.
+// Parameters live in a C array rather than an environment, integer arithmetic
+// and comparisons on builtins are done inline, and calls in tail position
+// between compiled closures loop instead of recursing.
+//
+// With `--jit` the tree is also translated to x86-64 machine code (see
+// "Native code" below), which does constants, parameters, IF and calls
+// itself and calls the templates for the rest.
+//
+// Each template guards its assumptions: a builtin receiving a non-integer is
+// called normally, an operator that turns out to be a macro is handed back to
+// the interpreter in a materialised environment, and a closure that isn't
+// compiled (or would nest too deeply) goes through `apply`.
+//
+// Compiled code is discarded by every collection, which may free the
+// closures it was compiled from.
+// -----------------------------------------------------------------------------
+
+#define JIT_THRESHOLD 8
+#define JIT_MAX_ARGS 16
+#define JIT_MAX_DEPTH 256
+#define JIT_TABLE_SIZE 1024
+
+// Internal result: a compiled closure wants to tail call `frame->tail_code`.
+#define JIT_TAIL_CALL (-1)
+
+typedef struct JitNode JitNode;
+typedef struct JitFrame JitFrame;
+
+typedef int (*JitTemplate)(JitNode *node, JitFrame *frame, Atom *result);
+
+struct JitNode {
+  JitTemplate exec;
+  Atom expr;            // Source expression, for deoptimisation.
+  Atom value;           // Constant, or symbol of a free variable.
+  int index;            // Parameter slot.
+  bool tail;            // Call is in tail position.
+  Atom binding;         // Cached binding cell of a free variable...
+  unsigned long version; // ...valid while `env_version` matches.
+  int argc;
+  JitNode **argv;       // Operator and operands, or IF's three parts.
+  JitNode *next;        // All nodes of a JitCode, for freeing.
+};
+
+struct JitCode {
+  Atom env;             // Environment the closure was created in.
+  Atom params;
+  int nparams;
+  bool rest;
+  int nbody;
+  JitNode **body;
+  JitNode *nodes;
+  int (*native)(JitFrame *frame, Atom *result); // The body as machine code.
+  void *native_map;     // What `native` is in, from mmap.
+  size_t native_size;
+  JitCode *next;        // All compiled code, for freeing.
+};
+
+struct JitFrame {
+  JitCode *code;
+  Atom *argv;
+  JitCode *tail_code;
+  int tail_argc;
+  Atom *tail_argv;
+};
+
+struct JitEntry {
+  Pair *closure;
+  unsigned calls;
+  bool failed;
+  JitCode *code;
+};
+
+void jit_reset() {
+  while (lisp->jit_codes) {
+    JitCode *code = lisp->jit_codes;
+    lisp->jit_codes = code->next;
+    while (code->nodes) {
+      JitNode *node = code->nodes;
+      code->nodes = node->next;
+      free(node->argv);
+      free(node);
+    }
+    if (code->native_map) munmap(code->native_map, code->native_size);
+    free(code->body);
+    free(code);
+  }
+  memset(lisp->jit_table, 0, JIT_TABLE_SIZE * sizeof(JitEntry));
+}
+
+int jit_invoke(JitCode *code, Atom *vals, int argc, Atom *result);
+bool jit_emit(JitCode *code);
+
+// Evaluate the node's source expression with the interpreter, in an
+// environment equivalent to the compiled frame.
+int jit_deopt(JitNode *node, JitFrame *frame, Atom *result) {
+  JitCode *code = frame->code;
+  Atom env = env_create(code->env);
+  Atom p = code->params;
+  for (int i = 0; i < code->nparams; ++i, p = cdr(p))
+    env_bind(env, car(p), frame->argv[i]);
+  if (code->rest)
+    env_bind(env, p, frame->argv[code->nparams]);
+
+  ++self->gc_inhibit;
+  Result r = eval_expr(node->expr, env, result);
+  --self->gc_inhibit;
+  return r;
+}
+
+int jit_const(JitNode *node, JitFrame *frame, Atom *result) {
+  (void) frame;
+  *result = node->value;
+  return Result_OK;
+}
+
+int jit_local(JitNode *node, JitFrame *frame, Atom *result) {
+  *result = frame->argv[node->index];
+  return Result_OK;
+}
+
+int jit_global(JitNode *node, JitFrame *frame, Atom *result) {
+  if (node->version != lisp->env_version) {
+    Result r = env_lookup(frame->code->env, node->value, &node->binding);
+    if (r) return r;
+    node->version = lisp->env_version;
+  }
+  *result = cdr(node->binding);
+  return Result_OK;
+}
+
+int jit_if(JitNode *node, JitFrame *frame, Atom *result) {
+  Atom cond;
+  int r = node->argv[0]->exec(node->argv[0], frame, &cond);
+  if (r) return r;
+  JitNode *branch = node->argv[nilp(cond) ? 2 : 1];
+  return branch->exec(branch, frame, result);
+}
+
+JitCode *jit_lookup(Atom closure);
+
+// Call `fv[0]` with the arguments after it, which `node` has evaluated.
+int jit_apply(JitNode *node, JitFrame *frame, Atom *fv, Atom *result) {
+  Atom f = fv[0];
+  Atom *vals = fv + 1;
+  int argc = node->argc - 1;
+  int r;
+
+  if (f.type == AtomType_Builtin) {
+    Builtin fn = f.value.builtin;
+    if (argc == 2 && vals[0].type == AtomType_Integer && vals[1].type == AtomType_Integer) {
+      long a = vals[0].value.integer;
+      long b = vals[1].value.integer;
+      if (fn == add_builtin) { *result = make_int(a + b); return Result_OK; }
+      if (fn == sub_builtin) { *result = make_int(a - b); return Result_OK; }
+      if (fn == mul_builtin) { *result = make_int(a * b); return Result_OK; }
+      if (fn == integer_eq_builtin) { *result = boolToTF(a == b); return Result_OK; }
+      if (fn == integer_lt_builtin) { *result = boolToTF(a < b); return Result_OK; }
+      if (fn == integer_le_builtin) { *result = boolToTF(a <= b); return Result_OK; }
+      if (fn == integer_gt_builtin) { *result = boolToTF(a > b); return Result_OK; }
+      if (fn == integer_ge_builtin) { *result = boolToTF(a >= b); return Result_OK; }
+    } else if (argc == 1 && vals[0].type == AtomType_Pair) {
+      if (fn == car_builtin) { *result = pair_car(vals[0]); return Result_OK; }
+      if (fn == cdr_builtin) { *result = cdr(vals[0]); return Result_OK; }
+    }
+  } else if (f.type == AtomType_Closure && self->jit_depth < JIT_MAX_DEPTH) {
+    JitCode *callee = jit_lookup(f);
+    if (callee) {
+      if (!node->tail)
+        return jit_invoke(callee, vals, argc, result);
+
+      frame->tail_code = callee;
+      frame->tail_argc = argc;
+      memcpy(frame->tail_argv, vals, argc * sizeof(Atom));
+      return JIT_TAIL_CALL;
+    }
+  }
+
+  // Generic call.
+  Atom args = nil;
+  for (int i = argc - 1; i >= 0; --i)
+    args = cons(vals[i], args);
+  if (f.type == AtomType_Builtin)
+    return call_builtin(f.value.builtin, args, result);
+
+  ++self->gc_inhibit;
+  r = apply(f, args, result);
+  --self->gc_inhibit;
+  return r;
+}
+
+int jit_call(JitNode *node, JitFrame *frame, Atom *result) {
+  Atom fv[JIT_MAX_ARGS + 1];
+  int r = node->argv[0]->exec(node->argv[0], frame, &fv[0]);
+  if (r) return r;
+  if (fv[0].type == AtomType_Macro)
+    return jit_deopt(node, frame, result);
+
+  for (int i = 1; i < node->argc; ++i) {
+    r = node->argv[i]->exec(node->argv[i], frame, &fv[i]);
+    if (r) return r;
+  }
+  return jit_apply(node, frame, fv, result);
+}
+
+int jit_invoke(JitCode *code, Atom *vals, int argc, Atom *result) {
+  Atom argv[JIT_MAX_ARGS + 1];
+  Atom tail_argv[JIT_MAX_ARGS];
+  int r;
+
+  ++self->jit_depth;
+  for (;;) {
+    // Bind the arguments.
+    if (argc < code->nparams || (argc > code->nparams && !code->rest)) {
+      r = Error_Args;
+      break;
+    }
+    memcpy(argv, vals, code->nparams * sizeof(Atom));
+    if (code->rest) {
+      argv[code->nparams] = nil;
+      for (int i = argc - 1; i >= code->nparams; --i)
+        argv[code->nparams] = cons(vals[i], argv[code->nparams]);
+    }
+
+    JitFrame frame = { code, argv, NULL, 0, tail_argv };
+    r = Result_OK;
+    if (code->native) {
+      r = code->native(&frame, result);
+    } else {
+      for (int i = 0; i < code->nbody && !r; ++i)
+        r = code->body[i]->exec(code->body[i], &frame, result);
+    }
+
+    if (r != JIT_TAIL_CALL) break;
+
+    code = frame.tail_code;
+    argc = frame.tail_argc;
+    vals = tail_argv;
+  }
+  --self->jit_depth;
+
+  return r;
+}
+
+bool is_special_form(Atom op) {
+  static const char *names[] = {
+    "QUOTE", "DEFINE", "LAMBDA", "IF", "DEFMACRO", "APPLY", "GC"
+  };
+  if (op.type != AtomType_Symbol) return false;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    if (strcmp(op.value.symbol, names[i]) == 0) return true;
+  return false;
+}
+
+JitNode *jit_node(JitCode *code, JitTemplate exec, Atom expr, int argc) {
+  JitNode *node = calloc(1, sizeof(JitNode));
+  node->exec = exec;
+  node->expr = expr;
+  node->argc = argc;
+  node->argv = argc ? calloc(argc, sizeof(JitNode*)) : NULL;
+  node->next = code->nodes;
+  code->nodes = node;
+  return node;
+}
+
+// Returns NULL when `expr` uses anything the templates don't cover.
+JitNode *jit_compile_expr(JitCode *code, Atom expr, bool tail) {
+  if (expr.type == AtomType_Symbol) {
+    int i = 0;
+    Atom p = code->params;
+    for (; p.type == AtomType_Pair; p = cdr(p), ++i)
+      if (sym_eq(car(p), expr)) break;
+    if (p.type == AtomType_Pair || (code->rest && sym_eq(p, expr))) {
+      JitNode *node = jit_node(code, jit_local, expr, 0);
+      node->index = i;
+      return node;
+    }
+
+    JitNode *node = jit_node(code, jit_global, expr, 0);
+    node->value = expr;
+    node->version = lisp->env_version - 1;
+    return node;
+  }
+
+  if (expr.type != AtomType_Pair) {
+    JitNode *node = jit_node(code, jit_const, expr, 0);
+    node->value = expr;
+    return node;
+  }
+
+  if (!listp(expr)) return NULL;
+
+  Atom op = car(expr);
+  Atom args = cdr(expr);
+  int argc = 0;
+  for (Atom p = args; !nilp(p); p = cdr(p)) ++argc;
+
+  if (is_special_form(op)) {
+    if (strcmp(op.value.symbol, "QUOTE") == 0 && argc == 1) {
+      JitNode *node = jit_node(code, jit_const, expr, 0);
+      node->value = car(args);
+      return node;
+    }
+    if (strcmp(op.value.symbol, "IF") == 0 && argc == 3) {
+      JitNode *node = jit_node(code, jit_if, expr, 3);
+      node->argv[0] = jit_compile_expr(code, car(args), false);
+      node->argv[1] = jit_compile_expr(code, car(cdr(args)), tail);
+      node->argv[2] = jit_compile_expr(code, car(cdr(cdr(args))), tail);
+      if (!node->argv[0] || !node->argv[1] || !node->argv[2]) return NULL;
+      return node;
+    }
+    return NULL;
+  }
+
+  if (argc > JIT_MAX_ARGS) return NULL;
+
+  JitNode *node = jit_node(code, jit_call, expr, argc + 1);
+  node->tail = tail;
+  node->argv[0] = jit_compile_expr(code, op, false);
+  if (!node->argv[0]) return NULL;
+
+  // Macros are expanded by the interpreter; don't bother compiling their uses.
+  Atom binding;
+  if (node->argv[0]->exec == jit_global &&
+      env_find(code->env, op, &binding) && cdr(binding).type == AtomType_Macro)
+    return NULL;
+
+  for (int i = 1; i <= argc; ++i, args = cdr(args)) {
+    node->argv[i] = jit_compile_expr(code, car(args), false);
+    if (!node->argv[i]) return NULL;
+  }
+  return node;
+}
+
+JitCode *jit_compile(Atom closure) {
+  JitCode *code = calloc(1, sizeof(JitCode));
+  code->next = lisp->jit_codes;
+  lisp->jit_codes = code;
+
+  code->env = car(closure);
+  code->params = car(cdr(closure));
+  Atom body = cdr(cdr(closure));
+
+  Atom p = code->params;
+  for (; p.type == AtomType_Pair; p = cdr(p)) ++code->nparams;
+  code->rest = !nilp(p);
+  if (code->nparams > JIT_MAX_ARGS) return NULL;
+
+  for (p = body; !nilp(p); p = cdr(p)) ++code->nbody;
+  code->body = calloc(code->nbody, sizeof(JitNode*));
+  int i = 0;
+  for (p = body; !nilp(p); p = cdr(p), ++i) {
+    code->body[i] = jit_compile_expr(code, car(p), nilp(cdr(p)));
+    if (!code->body[i]) return NULL;
+  }
+
+  if (lisp->jit) jit_emit(code);
+  return code;
+}
+
+// Count a call to `closure`, and return its compiled code once it's hot.
+JitCode *jit_lookup(Atom closure) {
+  JitEntry *e = &lisp->jit_table[((uintptr_t) closure.value.pair >> 4) % JIT_TABLE_SIZE];
+  if (e->closure != closure.value.pair) {
+    e->closure = closure.value.pair;
+    e->calls = 0;
+    e->failed = false;
+    e->code = NULL;
+  }
+
+  if (!e->code && !e->failed && ++e->calls >= JIT_THRESHOLD) {
+    e->code = jit_compile(closure);
+    e->failed = e->code == NULL;
+  }
+
+  return e->code;
+}
+
+// Run `closure` as compiled code if it's hot, returning false if it isn't.
+bool jit_run(Atom closure, Atom args, Atom *result, int *err) {
+  if (!lisp->compile_closures || self != &lisp->main || self->jit_depth >= JIT_MAX_DEPTH)
+    return false;
+
+  JitCode *code = jit_lookup(closure);
+  if (!code) return false;
+
+  Atom vals[JIT_MAX_ARGS];
+  int argc = 0;
+  for (; !nilp(args); args = cdr(args)) {
+    if (argc == JIT_MAX_ARGS) return false;
+    vals[argc++] = car(args);
+  }
+
+  ++self->gc_inhibit;
+  *err = jit_invoke(code, vals, argc, result);
+  --self->gc_inhibit;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Native code
+//
+// With `--jit`, `jit_emit` translates a compiled closure's tree into x86-64
+// machine code, one function per closure of the same type as a template's
+// body loop: `int native(JitFrame *frame, Atom *result)`. Each node's value is
+// stored in a 16-byte slot on the machine stack, or in `*result`.
+//
+// Constants, parameters and IF are done inline. A call evaluates its operator
+// and operands into consecutive slots and hands them to `jit_apply`, which
+// does what the template does with them. Where the operator is a global bound
+// to one of the integer builtins when the closure is compiled, and still is
+// (the same binding cell, holding the same builtin, with `env_version`
+// unchanged), two integer operands are added, subtracted, multiplied or
+// compared inline. The guards fall back to `jit_apply` when an operand isn't
+// an integer, and to the whole `jit_call` template when the binding has
+// changed. Any other node, such as a global variable, calls its template.
+//
+// A non-zero result from anything called, an error or JIT_TAIL_CALL, is
+// returned as it is. The code is position independent and written to an
+// anonymous map, which is made executable, and no longer writable, before it
+// runs. Elsewhere than on x86-64, `--jit` is just `--compile-closures`.
+// -----------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+
+_Static_assert(sizeof(Atom) == 16 && sizeof(AtomType) == 4 && offsetof(Atom, value) == 8,
+               "native code copies atoms as a 4-byte type and an 8-byte value");
+
+#define X64_VALUE 8
+#define X64_CDR ((int32_t) sizeof(Atom))
+
+enum { X64_RAX = 0, X64_RCX = 1, X64_RDX = 2, X64_RBX = 3, X64_RSP = 4, X64_RSI = 6,
+       X64_RDI = 7, X64_R12 = 12 };
+
+// Condition codes; a condition's opposite is the same code with bit 0 flipped.
+enum { X64_E = 0x4, X64_NE = 0x5, X64_L = 0xc, X64_GE = 0xd, X64_LE = 0xe, X64_G = 0xf,
+       X64_ALWAYS = -1 };
+
+typedef struct {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+  bool failed;   // Out of memory; the code is abandoned.
+  size_t fail;   // Where the code returns a non-zero result.
+  int slots;     // Stack slots in use...
+  int max_slots; // ...and the most at any point.
+} X64;
+
+// [base + disp]
+typedef struct {
+  int base;
+  int32_t disp;
+} X64Mem;
+
+void x64_bytes(X64 *a, const void *bytes, size_t len) {
+  if (a->failed) return;
+  if (a->len + len > a->cap) {
+    size_t cap = a->cap ? 2 * a->cap : 1024;
+    unsigned char *buf = realloc(a->buf, cap);
+    if (!buf) {
+      a->failed = true;
+      return;
+    }
+    a->buf = buf;
+    a->cap = cap;
+  }
+  memcpy(a->buf + a->len, bytes, len);
+  a->len += len;
+}
+
+void x64_byte(X64 *a, int byte) {
+  unsigned char b = byte;
+  x64_bytes(a, &b, 1);
+}
+
+void x64_imm32(X64 *a, uint32_t imm) {
+  x64_bytes(a, &imm, 4);
+}
+
+X64Mem x64_offset(X64Mem m, int32_t offset) {
+  m.disp += offset;
+  return m;
+}
+
+// An instruction with opcode `op` (0x0f first if it's two bytes) and a
+// register or opcode extension `reg` with the memory operand `m`, on 64 bits
+// if `wide`.
+void x64_mem(X64 *a, bool wide, int op, int reg, X64Mem m) {
+  int rex = (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (m.base >= 8 ? 1 : 0);
+  if (rex) x64_byte(a, 0x40 | rex);
+  if (op > 0xff) x64_byte(a, op >> 8);
+  x64_byte(a, op & 0xff);
+  x64_byte(a, 0x80 | (reg & 7) << 3 | (m.base & 7)); // [base + disp32]
+  if ((m.base & 7) == X64_RSP) x64_byte(a, 0x24);    // ...which rsp and r12 need a SIB for.
+  x64_imm32(a, (uint32_t) m.disp);
+}
+
+// mov dst, src
+void x64_mov(X64 *a, int dst, int src) {
+  x64_byte(a, 0x48 | (src >= 8 ? 4 : 0) | (dst >= 8 ? 1 : 0));
+  x64_byte(a, 0x89);
+  x64_byte(a, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+// mov reg, imm64
+void x64_mov_imm(X64 *a, int reg, uint64_t imm) {
+  x64_byte(a, 0x48 | (reg >= 8 ? 1 : 0));
+  x64_byte(a, 0xb8 + (reg & 7));
+  x64_bytes(a, &imm, 8);
+}
+
+// A jump, conditional on `cc`, to be aimed with `x64_patch`.
+size_t x64_jump(X64 *a, int cc) {
+  if (cc == X64_ALWAYS) {
+    x64_byte(a, 0xe9);
+  } else {
+    x64_byte(a, 0x0f);
+    x64_byte(a, 0x80 | cc);
+  }
+  x64_imm32(a, 0);
+  return a->len - 4;
+}
+
+// Aim the jump whose displacement is at `at` at `target`.
+void x64_patch(X64 *a, size_t at, size_t target) {
+  if (a->failed) return;
+  int32_t rel = (int32_t) (target - (at + 4));
+  memcpy(a->buf + at, &rel, 4);
+}
+
+// Store the constant `atom` at `m`.
+void x64_store_atom(X64 *a, X64Mem m, Atom atom) {
+  x64_mem(a, false, 0xc7, 0, m); // mov dword [m], type
+  x64_imm32(a, atom.type);
+  uint64_t value;
+  memcpy(&value, &atom.value, 8);
+  x64_mov_imm(a, X64_RAX, value);
+  x64_mem(a, true, 0x89, X64_RAX, x64_offset(m, X64_VALUE));
+}
+
+// Jump to `target` unless the atom at `m` has type `type`.
+size_t x64_expect_type(X64 *a, X64Mem m, AtomType type) {
+  x64_mem(a, false, 0x81, 7, m); // cmp dword [m], type
+  x64_imm32(a, type);
+  return x64_jump(a, X64_NE);
+}
+
+// Call `fn` with `node`, the frame and `args` (rdx onwards, already loaded)
+// and return its result if that isn't zero.
+void x64_call(X64 *a, const void *fn, JitNode *node) {
+  x64_mov_imm(a, X64_RDI, (uintptr_t) node);
+  x64_mov(a, X64_RSI, X64_RBX);
+  x64_mov_imm(a, X64_RAX, (uintptr_t) fn);
+  x64_byte(a, 0xff); // call rax
+  x64_byte(a, 0xd0);
+  x64_byte(a, 0x85); // test eax, eax
+  x64_byte(a, 0xc0);
+  x64_patch(a, x64_jump(a, X64_NE), a->fail);
+}
+
+// Call `fn(node, frame, dest)`: a template, or `jit_deopt`.
+void x64_call_template(X64 *a, JitTemplate fn, JitNode *node, X64Mem dest) {
+  x64_mem(a, true, 0x8d, X64_RDX, dest); // lea rdx, dest
+  x64_call(a, (const void*) fn, node);
+}
+
+X64Mem x64_slot(int slot) {
+  return (X64Mem) { X64_RSP, 16 * slot };
+}
+
+int x64_alloc(X64 *a, int slots) {
+  int first = a->slots;
+  a->slots += slots;
+  if (a->slots > a->max_slots) a->max_slots = a->slots;
+  return first;
+}
+
+void jit_emit_node(X64 *a, JitCode *code, JitNode *node, X64Mem dest);
+
+// The instruction that does `fn` to two integers in rax and memory: the opcode
+// of an arithmetic one, or the condition under which a comparison is true.
+bool jit_inline_op(Builtin fn, int *op, int *cc) {
+  *op = 0;
+  *cc = X64_ALWAYS;
+  if (fn == add_builtin) *op = 0x03;
+  else if (fn == sub_builtin) *op = 0x2b;
+  else if (fn == mul_builtin) *op = 0x0faf;
+  else if (fn == integer_eq_builtin) *cc = X64_E;
+  else if (fn == integer_lt_builtin) *cc = X64_L;
+  else if (fn == integer_le_builtin) *cc = X64_LE;
+  else if (fn == integer_gt_builtin) *cc = X64_G;
+  else if (fn == integer_ge_builtin) *cc = X64_GE;
+  else return false;
+  return true;
+}
+
+void jit_emit_call(X64 *a, JitCode *code, JitNode *node, X64Mem dest) {
+  int argc = node->argc - 1;
+  Atom binding = nil;
+  int op = 0, cc = X64_ALWAYS;
+  bool inline_op = argc == 2 && node->argv[0]->exec == jit_global &&
+                   env_find(code->env, node->argv[0]->value, &binding) &&
+                   cdr(binding).type == AtomType_Builtin &&
+                   jit_inline_op(cdr(binding).value.builtin, &op, &cc);
+
+  int first = x64_alloc(a, node->argc);
+  X64Mem fv = x64_slot(first);
+  size_t done[4];
+  int ndone = 0;
+
+  size_t changed[3];
+  if (inline_op) {
+    // The operator is the builtin it was, through the same binding cell.
+    x64_mov_imm(a, X64_RAX, (uintptr_t) &lisp->env_version);
+    x64_mem(a, true, 0x8b, X64_RAX, (X64Mem) { X64_RAX, 0 });
+    x64_mov_imm(a, X64_RCX, lisp->env_version);
+    x64_byte(a, 0x48); // cmp rax, rcx
+    x64_byte(a, 0x39);
+    x64_byte(a, 0xc8);
+    changed[0] = x64_jump(a, X64_NE);
+    x64_mov_imm(a, X64_RAX, (uintptr_t) binding.value.pair);
+    changed[1] = x64_expect_type(a, (X64Mem) { X64_RAX, X64_CDR }, AtomType_Builtin);
+    x64_mov_imm(a, X64_RCX, (uintptr_t) cdr(binding).value.builtin);
+    x64_mem(a, true, 0x3b, X64_RCX, (X64Mem) { X64_RAX, X64_CDR + X64_VALUE }); // cmp rcx, [rax...]
+    changed[2] = x64_jump(a, X64_NE);
+    x64_store_atom(a, fv, cdr(binding));
+  } else {
+    jit_emit_node(a, code, node->argv[0], fv);
+    size_t not_macro = x64_expect_type(a, fv, AtomType_Macro);
+    x64_call_template(a, jit_deopt, node, dest);
+    done[ndone++] = x64_jump(a, X64_ALWAYS);
+    x64_patch(a, not_macro, a->len);
+  }
+
+  for (int i = 1; i <= argc; ++i)
+    jit_emit_node(a, code, node->argv[i], x64_slot(first + i));
+
+  size_t slow[2];
+  if (inline_op) {
+    X64Mem x = x64_slot(first + 1), y = x64_slot(first + 2);
+    slow[0] = x64_expect_type(a, x, AtomType_Integer);
+    slow[1] = x64_expect_type(a, y, AtomType_Integer);
+    x64_mem(a, true, 0x8b, X64_RAX, x64_offset(x, X64_VALUE));
+    if (op) {
+      x64_mem(a, true, op, X64_RAX, x64_offset(y, X64_VALUE));
+      x64_mem(a, false, 0xc7, 0, dest);
+      x64_imm32(a, AtomType_Integer);
+      x64_mem(a, true, 0x89, X64_RAX, x64_offset(dest, X64_VALUE));
+    } else {
+      x64_mem(a, true, 0x3b, X64_RAX, x64_offset(y, X64_VALUE));
+      size_t false_ = x64_jump(a, cc ^ 1);
+      x64_store_atom(a, dest, TRUE_SYM);
+      size_t true_done = x64_jump(a, X64_ALWAYS);
+      x64_patch(a, false_, a->len);
+      x64_store_atom(a, dest, nil);
+      x64_patch(a, true_done, a->len);
+    }
+    done[ndone++] = x64_jump(a, X64_ALWAYS);
+    x64_patch(a, slow[0], a->len);
+    x64_patch(a, slow[1], a->len);
+  }
+
+  x64_mem(a, true, 0x8d, X64_RDX, fv);   // lea rdx, fv
+  x64_mem(a, true, 0x8d, X64_RCX, dest); // lea rcx, dest
+  x64_call(a, (const void*) jit_apply, node);
+
+  if (inline_op) {
+    done[ndone++] = x64_jump(a, X64_ALWAYS);
+    for (int i = 0; i < 3; ++i) x64_patch(a, changed[i], a->len);
+    x64_call_template(a, jit_call, node, dest);
+  }
+
+  for (int i = 0; i < ndone; ++i) x64_patch(a, done[i], a->len);
+  a->slots = first;
+}
+
+// Store the value of `node` at `dest`.
+void jit_emit_node(X64 *a, JitCode *code, JitNode *node, X64Mem dest) {
+  if (node->exec == jit_const) {
+    x64_store_atom(a, dest, node->value);
+  } else if (node->exec == jit_local) {
+    x64_mem(a, true, 0x8b, X64_RAX, (X64Mem) { X64_RBX, offsetof(JitFrame, argv) });
+    X64Mem arg = { X64_RAX, (int32_t) (node->index * sizeof(Atom)) };
+    x64_mem(a, true, 0x8b, X64_RCX, arg);
+    x64_mem(a, true, 0x89, X64_RCX, dest);
+    x64_mem(a, true, 0x8b, X64_RCX, x64_offset(arg, X64_VALUE));
+    x64_mem(a, true, 0x89, X64_RCX, x64_offset(dest, X64_VALUE));
+  } else if (node->exec == jit_if) {
+    int cond = x64_alloc(a, 1);
+    jit_emit_node(a, code, node->argv[0], x64_slot(cond));
+    a->slots = cond;
+    x64_mem(a, false, 0x81, 7, x64_slot(cond)); // cmp dword [cond], AtomType_Nil
+    x64_imm32(a, AtomType_Nil);
+    size_t else_ = x64_jump(a, X64_E);
+    jit_emit_node(a, code, node->argv[1], dest);
+    size_t done = x64_jump(a, X64_ALWAYS);
+    x64_patch(a, else_, a->len);
+    jit_emit_node(a, code, node->argv[2], dest);
+    x64_patch(a, done, a->len);
+  } else if (node->exec == jit_call) {
+    jit_emit_call(a, code, node, dest);
+  } else {
+    x64_call_template(a, node->exec, node, dest);
+  }
+}
+
+// Give `code` machine code, returning false if it couldn't be.
+bool jit_emit(JitCode *code) {
+  X64 a = { NULL, 0, 0, false, 0, 0, 0 };
+
+  // Leave with eax, the result of whatever failed. `frame` patches both
+  // stack adjustments once the number of slots is known.
+  size_t frame[2];
+  x64_byte(&a, 0x48); // add rsp, frame
+  x64_byte(&a, 0x81);
+  x64_byte(&a, 0xc4);
+  frame[0] = a.len;
+  x64_imm32(&a, 0);
+  x64_byte(&a, 0x41); // pop r12
+  x64_byte(&a, 0x5c);
+  x64_byte(&a, 0x5b); // pop rbx
+  x64_byte(&a, 0xc3); // ret
+
+  size_t entry = a.len;
+  x64_byte(&a, 0x53); // push rbx
+  x64_byte(&a, 0x41); // push r12
+  x64_byte(&a, 0x54);
+  x64_byte(&a, 0x48); // sub rsp, frame
+  x64_byte(&a, 0x81);
+  x64_byte(&a, 0xec);
+  frame[1] = a.len;
+  x64_imm32(&a, 0);
+  x64_mov(&a, X64_RBX, X64_RDI);
+  x64_mov(&a, X64_R12, X64_RSI);
+
+  for (int i = 0; i < code->nbody; ++i)
+    jit_emit_node(&a, code, code->body[i], (X64Mem) { X64_R12, 0 });
+  x64_byte(&a, 0x31); // xor eax, eax
+  x64_byte(&a, 0xc0);
+  x64_patch(&a, x64_jump(&a, X64_ALWAYS), 0);
+
+  // The slots, and the return address and two registers pushed, keep the
+  // stack 16-byte aligned for calls.
+  uint32_t size = 16 * a.max_slots + 8;
+  for (int i = 0; i < 2 && !a.failed; ++i)
+    memcpy(a.buf + frame[i], &size, 4);
+
+  void *map = MAP_FAILED;
+  if (!a.failed)
+    map = mmap(NULL, a.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map != MAP_FAILED) {
+    memcpy(map, a.buf, a.len);
+    if (mprotect(map, a.len, PROT_READ | PROT_EXEC) == 0) {
+      code->native_map = map;
+      code->native_size = a.len;
+      code->native = (int (*)(JitFrame*, Atom*)) ((char*) map + entry);
+    } else {
+      munmap(map, a.len);
+    }
+  }
+  free(a.buf);
+  return code->native != NULL;
+}
+
+#else
+
+bool jit_emit(JitCode *code) {
+  (void) code;
+  return false;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// REPL
+// -----------------------------------------------------------------------------
+
+// Interned symbol names by prefix, for tab completion. The nodes are in one
+// array, and the children of each form a list ordered by character (folded
+// to upper case, like the reader), so a walk finds names in sorted order.
+typedef struct {
+  unsigned char c;
+  uint32_t child;   // First child, or 0.
+  uint32_t sibling; // Next child of the same parent, or 0.
+  const char *name; // Symbol whose name ends here, or NULL.
+} TrieNode;
+
+struct SymbolTrie {
+  TrieNode *nodes;  // nodes[0] is the root.
+  uint32_t count;
+  uint32_t cap;
+};
+
+// Add `name`, or return false if there's no memory to.
+bool sym_trie_insert(SymbolTrie *t, const char *name) {
+  // Make room for a whole new branch first, so `link` stays valid.
+  size_t len = strlen(name);
+  if (t->count + len > t->cap) {
+    uint32_t cap = t->cap ? t->cap : 1024;
+    while (t->count + len > cap) cap *= 2;
+    TrieNode *bigger = realloc(t->nodes, cap * sizeof(TrieNode));
+    if (!bigger) return false;
+    t->nodes = bigger;
+    t->cap = cap;
+  }
+
+  uint32_t n = 0;
+  for (const char *s = name; *s; ++s) {
+    unsigned char c = toupper((unsigned char) *s);
+    uint32_t *link = &t->nodes[n].child;
+    while (*link && t->nodes[*link].c < c) link = &t->nodes[*link].sibling;
+    if (!*link || t->nodes[*link].c != c) {
+      t->nodes[t->count] = (TrieNode) { c, 0, *link, NULL };
+      *link = t->count++;
+    }
+    n = *link;
+  }
+  if (!t->nodes[n].name) t->nodes[n].name = name;
+  return true;
+}
+
+void sym_trie_free(SymbolTrie *t);
+
+// A trie of `sym_table`, or NULL if out of memory.
+SymbolTrie *sym_trie_build() {
+  SymbolTrie *t = calloc(1, sizeof(SymbolTrie));
+  if (!t) return NULL;
+  t->cap = 1024;
+  t->nodes = malloc(t->cap * sizeof(TrieNode));
+  bool ok = t->nodes != NULL;
+  if (ok) t->nodes[t->count++] = (TrieNode) { 0, 0, 0, NULL };
+  for (Atom p = lisp->sym_table; ok && !nilp(p); p = cdr(p))
+    ok = sym_trie_insert(t, car(p).value.symbol);
+  if (!ok) {
+    sym_trie_free(t);
+    return NULL;
+  }
+  return t;
+}
+
+void sym_trie_free(SymbolTrie *t) {
+  if (t) free(t->nodes);
+  free(t);
+}
+
+// The names starting with `prefix`, in order, as a malloc'd array. Out of
+// memory, there are none.
+size_t sym_trie_find(SymbolTrie *t, const char *prefix, const char ***names) {
+  *names = NULL;
+  uint32_t n = 0;
+  for (const char *s = prefix; *s; ++s) {
+    unsigned char c = toupper((unsigned char) *s);
+    n = t->nodes[n].child;
+    while (n && t->nodes[n].c < c) n = t->nodes[n].sibling;
+    if (!n || t->nodes[n].c != c) return 0;
+  }
+
+  // Walk the subtree depth first, children before siblings.
+  size_t count = 0, cap = 0, depth = 0, stack_cap = 64;
+  uint32_t *stack = malloc(stack_cap * sizeof(uint32_t));
+  if (!stack) return 0;
+  if (t->nodes[n].child) stack[depth++] = t->nodes[n].child;
+  TrieNode *node = &t->nodes[n];
+  for (;;) {
+    if (node->name) {
+      if (count == cap) {
+        const char **bigger = realloc(*names, (cap ? 2 * cap : 16) * sizeof(char*));
+        if (!bigger) break;
+        *names = bigger;
+        cap = cap ? 2 * cap : 16;
+      }
+      (*names)[count++] = node->name;
+    }
+    if (depth == 0) {
+      free(stack);
+      return count;
+    }
+    node = &t->nodes[stack[--depth]];
+    if (depth + 2 > stack_cap) {
+      uint32_t *bigger = realloc(stack, 2 * stack_cap * sizeof(uint32_t));
+      if (!bigger) break;
+      stack = bigger;
+      stack_cap *= 2;
+    }
+    if (node->sibling) stack[depth++] = node->sibling;
+    if (node->child) stack[depth++] = node->child;
+  }
+  free(stack);
+  free(*names);
+  *names = NULL;
+  return 0;
+}
+
+// GNU readline function for tab completion.
+// Completes the names of interned symbols, found with `sym_trie`, that are
+// bound in the global environment, where the REPL evaluates.
+char* symbol_generator(const char* text, int state) {
+  static const char **names; // Note the statics.
+  static size_t count, next;
+  if (state == 0) {
+    free(names);
+    bool shared = lisp->pool != NULL; // Workers may be making symbols.
+    if (shared) pthread_mutex_lock(&lisp->shared_lock);
+    if (!lisp->sym_trie) lisp->sym_trie = sym_trie_build();
+    names = NULL;
+    count = lisp->sym_trie ? sym_trie_find(lisp->sym_trie, text, &names) : 0;
+    if (shared) pthread_mutex_unlock(&lisp->shared_lock);
+
+    // One walk of the bindings, rather than a lookup for each match.
+    PtrMap bound = { NULL, NULL, 0, 0 };
+    for (Atom env = lisp->global_env; !nilp(env); env = car(env))
+      for (Atom bs = cdr(env); !nilp(bs); bs = cdr(bs))
+        ptrmap_put(&bound, car(car(bs)).value.symbol, 1);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i)
+      if (ptrmap_get(&bound, names[i])) names[kept++] = names[i];
+    count = kept;
+    ptrmap_free(&bound);
+    next = 0;
+  }
+
+  // Readline frees each match it's given.
+  return next < count ? strdup(names[next++]) : NULL;
+}
+
+static char history_file[] = ".lisp_history";
+
+// Lines kept in `history_file` from one session to the next.
+#define HISTORY_MAX 1000
+
+const char *result_message(Result r) {
+  switch (r) {
+    case Result_OK: return "OK";
+    case Error_Syntax: return "Syntax error";
+    case Error_Unbound: return "Symbol not bound";
+    case Error_Args: return "Wrong number of arguments";
+    case Error_Type: return "Wrong type";
+    case Error_Limit: return "Evaluation step limit reached";
+  }
+  return "Unknown error";
+}
+
+void repl(Atom env) {
+  using_history();
+  // Lines are appended to the file as they're entered, so trim it here.
+  if (read_history(history_file) == 0)
+    history_truncate_file(history_file, HISTORY_MAX);
+  else
+    write_history(history_file); // Create it for `append_history`.
+  rl_completion_entry_function = symbol_generator;
+  char *input;
+  while ((input = readline("λ> ")) != NULL) {
+
+    // Continue if all ws (or comments).
+    const char* start;
+    const char* end;
+    if (lex(input, &start, &end) == Result_OK && *start == '\0') continue;
+
+    add_history(input);
+    append_history(1, history_file);
+
+    if (strcmp(input, ":q") == 0) {
+      puts("bye");
+      free(input);
+      break;
+    }
+
+    const char* p = input;
+    Atom expr;
+    Result r = read_expr(p, &p, &expr);
+
+    Atom result;
+    if (!r) r = eval_expr(expr, env, &result);
+
+    if (r) {
+      puts(result_message(r));
+    } else {
+      atom_print(result);
+      putchar('\n');
+    }
+    free(input);
+    gc_top_level(&env, NULL);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// old unit test, now a builtin function
+// -----------------------------------------------------------------------------
+
+void unit_test_1() {
+  printf("> make_int(42)\n");
+  atom_print(make_int(42));
+  putchar('\n');
+
+  printf("> make_sym(\"FOO\")\n");
+  atom_print(make_sym("FOO"));
+  putchar('\n');
+
+  printf("> cons(make_sym(\"X\"), make_sym(\"Y\"))\n");
+  atom_print(cons(make_sym("X"), make_sym("Y")));
+  putchar('\n');
+
+  printf("> cons(make_int(1), cons(make_int(2), cons(make_int(3), nil)))\n");
+  atom_print(cons(make_int(1), cons(make_int(2), cons(make_int(3), nil))));
+  putchar('\n');
+
+  printf("> sym_table\n");
+  atom_print(lisp->sym_table);
+  putchar('\n');
+}
+
+int unit_test_1_builtin(Atom args, Atom *result) {
+  ENSURE_0_ARGS();
+
+  unit_test_1();
+
+  *result = TRUE_SYM;
+  return Result_OK;
+}
+
+// -----------------------------------------------------------------------------
+// library
+// -----------------------------------------------------------------------------
+// Read the whole file at `path`, NUL-terminated, storing the number of bytes
+// read in `*size`.
+char* slurp_size(const char path[], size_t *size) {
+  FILE * file = fopen(path, "r");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char* buf = len < 0 ? NULL : malloc(len + 1);
+  if (buf == NULL) {
+    fclose(file);
+    return NULL;
+  }
+
+  *size = fread(buf, 1, len, file);
+  buf[*size] = '\0';
+  fclose(file);
+
+  return buf;
+}
+
+char* slurp(const char path[]) {
+  size_t size;
+  return slurp_size(path, &size);
+}
+
+// Read all of a stream that can't seek, such as a pipe.
+char* slurp_stream(FILE *file) {
+  size_t len = 0, cap = 4096;
+  char *buf = malloc(cap);
+  size_t n;
+  while (buf && (n = fread(buf + len, 1, cap - len - 1, file)) > 0) {
+    len += n;
+    if (cap - len == 1) buf = realloc(buf, cap *= 2);
+  }
+  if (buf) buf[len] = '\0';
+  return buf;
+}
+
+// Evaluate each form of `text`, storing the value of the last in `*last` if
+// that isn't NULL.
+Result eval_text(Atom env, const char *text, bool print, Atom *last) {
+  const char *p = text;
+  for (;;) {
+    // Stop once only whitespace (or comments) remain.
+    const char *start, *end;
+    if (lex(p, &start, &end) == Result_OK && *start == '\0') return Result_OK;
+
+    Atom expr, result;
+    Result r = read_expr(p, &p, &expr);
+    if (!r) r = eval_expr(expr, env, &result);
+    if (r) return r;
+
+    if (last) *last = result;
+    if (print) {
+      atom_print(result);
+      putchar('\n');
+    }
+    gc_top_level(&env, last);
+  }
+}
+
+void load_file(Atom env, const char path[], bool verbose) {
+  if (verbose) printf("Loading '%s' ...\n", path);
+  char *text = slurp(path);
+  if (text) {
+    const char *p = text;
+    Atom expr;
+    while (read_expr(p, &p, &expr) == Result_OK) {
+      Atom result;
+      Result r = eval_expr(expr, env, &result);
+      if (r) {
+        printf("Error in expression:\n\t");
+        atom_print(expr);
+        putchar('\n');
+      } else if (verbose) {
+        atom_print(result);
+        putchar('\n');
+      }
+      gc_top_level(&env, NULL);
+    }
+    free(text);
+  }
+}
+
+int save_image_builtin(Atom args, Atom *result);
+int serialize_builtin(Atom args, Atom *result);
+int deserialize_builtin(Atom args, Atom *result);
+int serialize_to_file_builtin(Atom args, Atom *result);
+int deserialize_from_file_builtin(Atom args, Atom *result);
+int profile_start_builtin(Atom args, Atom *result);
+int profile_stop_builtin(Atom args, Atom *result);
+int open_file_builtin(Atom args, Atom *result);
+int make_pipe_builtin(Atom args, Atom *result);
+int listen_unix_builtin(Atom args, Atom *result);
+int connect_unix_builtin(Atom args, Atom *result);
+int close_port_builtin(Atom args, Atom *result);
+int require_builtin(Atom args, Atom *result);
+Atom module_path();
+int read_async_builtin(Atom args, Atom *result);
+int write_async_builtin(Atom args, Atom *result);
+int accept_async_builtin(Atom args, Atom *result);
+int run_event_loop_builtin(Atom args, Atom *result);
+int vm_stats_builtin(Atom args, Atom *result);
+
+// Every builtin, by the name it's bound to in the initial environment. Heap
+// images refer to builtins by these names.
+static const struct {
+  const char *name;
+  Builtin fn;
+} builtins[] = {
+  { "APPLY", apply_builtin },
+
+  { "CAR", car_builtin },
+  { "CDR", cdr_builtin },
+  { "CONS", cons_builtin },
+  { "WEAK-CONS", weak_cons_builtin },
+  { "FINALIZE", finalize_builtin },
+  { "PAIR?", pairp_builtin },
+  { "EQ?", eqp_builtin },
+  { "WRITE-TO-STRING", write_to_string_builtin },
+
+  { "UNIT-TEST-1", unit_test_1_builtin },
+
+  { "+", add_builtin },
+  { "-", sub_builtin },
+  { "*", mul_builtin },
+  { "/", div_builtin },
+
+  { "=", integer_eq_builtin },
+  { "<", integer_lt_builtin },
+  { "<=", integer_le_builtin },
+  { ">", integer_gt_builtin },
+  { ">=", integer_ge_builtin },
+
+  { "GC-STATS", gc_stats_builtin },
+  { "VM-STATS", vm_stats_builtin },
+  { "SAVE-IMAGE", save_image_builtin },
+
+  { "FUTURE-CALL", future_call_builtin },
+  { "TOUCH", touch_builtin },
+  { "PMAP", pmap_builtin },
+
+  { "SERIALIZE", serialize_builtin },
+  { "DESERIALIZE", deserialize_builtin },
+  { "SERIALIZE-TO-FILE", serialize_to_file_builtin },
+  { "DESERIALIZE-FROM-FILE", deserialize_from_file_builtin },
+
+  { "PROFILE-START", profile_start_builtin },
+  { "PROFILE-STOP", profile_stop_builtin },
+
+  { "OPEN-FILE", open_file_builtin },
+  { "MAKE-PIPE", make_pipe_builtin },
+  { "LISTEN-UNIX", listen_unix_builtin },
+  { "CONNECT-UNIX", connect_unix_builtin },
+  { "CLOSE-PORT", close_port_builtin },
+  { "REQUIRE", require_builtin },
+  { "READ-ASYNC", read_async_builtin },
+  { "WRITE-ASYNC", write_async_builtin },
+  { "ACCEPT-ASYNC", accept_async_builtin },
+  { "RUN-EVENT-LOOP", run_event_loop_builtin },
+};
+
+#ifdef LISP_STATS
+_Static_assert(sizeof(builtins) / sizeof(builtins[0]) <= VM_STATS_BUILTINS,
+               "VM_STATS_BUILTINS is too small");
+
+int builtin_index(Builtin fn) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i)
+    if (builtins[i].fn == fn) return i;
+  return -1;
+}
+
+void vm_stats_add(VmStats *total, Mutator *m) {
+  total->eval_steps += stat_get(m->stats.eval_steps);
+  total->frames += stat_get(m->stats.frames);
+  total->env_lookups += stat_get(m->stats.env_lookups);
+  total->env_links += stat_get(m->stats.env_links);
+  total->macro_expansions += stat_get(m->stats.macro_expansions);
+  for (int i = 0; i < VM_STATS_BUILTINS; ++i) {
+    total->builtin_calls[i] += stat_get(m->stats.builtin_calls[i]);
+    total->builtin_time[i] += stat_get(m->stats.builtin_time[i]);
+  }
+}
+
+// The counters of every thread of the context, summed.
+void vm_stats_total(VmStats *total) {
+  vm_stats_add(total, &lisp->main);
+  ThreadPool *pool = lisp->pool;
+  if (pool) {
+    for (int i = 0; i < pool->nworkers; ++i)
+      vm_stats_add(total, &pool->workers[i].mutator);
+  }
+}
+#endif
+
+// (vm-stats) => the evaluator's counters as an association list, ending with
+// `(BUILTINS (name calls . microseconds)...)`, or NIL if they weren't built
+// in.
+int vm_stats_builtin(Atom args, Atom *result) {
+  ENSURE_0_ARGS();
+
+  *result = nil;
+#ifdef LISP_STATS
+  VmStats total = { 0 };
+  vm_stats_total(&total);
+
+  Atom calls = nil;
+  PUSH_ROOT(calls);
+  for (int i = sizeof(builtins) / sizeof(builtins[0]) - 1; i >= 0; --i) {
+    if (!total.builtin_calls[i]) continue;
+    Atom name = make_sym(builtins[i].name);
+    calls = cons(cons(name,
+                      cons(make_int(total.builtin_calls[i]), make_int(total.builtin_time[i] / 1000))),
+                 calls);
+  }
+  Atom name = make_sym("BUILTINS");
+  *result = cons(cons(name, calls), nil);
+  POP_ROOTS(1);
+
+  const struct {
+    const char *name;
+    unsigned long value;
+  } fields[] = {
+    { "EVAL-STEPS", total.eval_steps },
+    { "FRAMES", total.frames },
+    { "ENV-LOOKUPS", total.env_lookups },
+    { "ENV-LINKS", total.env_links },
+    { "MACRO-EXPANSIONS", total.macro_expansions },
+  };
+  for (int i = sizeof(fields) / sizeof(fields[0]) - 1; i >= 0; --i)
+    *result = cons(cons(make_sym(fields[i].name), make_int(fields[i].value)), *result);
+#endif
+  return Result_OK;
+}
+
+// Print the counters, for `--vm-stats`.
+void vm_stats_print(FILE *out) {
+#ifdef LISP_STATS
+  VmStats total = { 0 };
+  vm_stats_total(&total);
+
+  unsigned long lookups = total.env_lookups;
+  fprintf(out, "eval steps        %12lu\n", (unsigned long) total.eval_steps);
+  fprintf(out, "frames            %12lu\n", (unsigned long) total.frames);
+  fprintf(out, "env lookups       %12lu\n", lookups);
+  fprintf(out, "env links walked  %12lu (%.2f per lookup)\n", (unsigned long) total.env_links,
+          lookups ? (double) total.env_links / lookups : 0.0);
+  fprintf(out, "macro expansions  %12lu\n", (unsigned long) total.macro_expansions);
+  fprintf(out, "\n%-24s %12s %12s\n", "builtin", "calls", "total ms");
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+    if (!total.builtin_calls[i]) continue;
+    fprintf(out, "%-24s %12lu %12.3f\n", builtins[i].name,
+            (unsigned long) total.builtin_calls[i], total.builtin_time[i] / 1e6);
+  }
+#else
+  fprintf(out, "vm-stats: built without LISP_STATS\n");
+#endif
+}
+
+Atom initial_env() {
+  Atom env = env_create(nil);
+  lisp->global_env = env;
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i)
+    env_set(env, make_sym(builtins[i].name), make_builtin(builtins[i].fn));
+
+  env_set(env, TRUE_SYM, TRUE_SYM);
+  Atom path = module_path();
+  PUSH_ROOT(path);
+  env_set(env, make_sym("*MODULE-PATH*"), path);
+  env_set(env, make_sym("*MODULES*"), nil);
+  POP_ROOTS(1);
+  return env;
+}
+
+// -----------------------------------------------------------------------------
+// Heap images
+//
+// `(save-image "file")` writes everything reachable from the global
+// environment and the symbol table, and `lisp --image file` maps it back in
+// instead of building the environment and loading library.lisp.
+//
+// A file is a header, an array of Allocation records and a section of
+// NUL-terminated strings (symbol names, string contents and builtin names).
+// References are stored in `value.integer` as offsets from the start of the
+// file and turned back into pointers once it's mapped; builtins are looked up
+// again by name in `builtins`. The records are then used in place.
+//
+// The map is private and writable, so turning offsets into pointers copies
+// every page of records: what's shared with the page cache, and with other
+// processes using the image, is the string section only. Loading still
+// avoids parsing and evaluating library.lisp, but not the memory for its heap.
+//
+// An image is checked before anything uses it, as it could be any file:
+// every reference must be to the start of a record of the right kind, every
+// string must lie in the string section, and the symbol table, the
+// environment and each closure must have the shapes the evaluator assumes.
+// -----------------------------------------------------------------------------
+
+#define IMAGE_MAGIC "LISPIMG"
+#define IMAGE_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t allocation_size;
+  uint64_t count;   // Allocation records, following the header.
+  uint64_t strings; // Offset of the string section.
+  uint64_t size;
+  Atom env;
+  Atom sym_table;
+} ImageHeader;
+
+typedef struct {
+  PtrMap records;        // Allocation -> index
+  Allocation **order;
+  size_t count;
+  size_t cap;
+  PtrMap names;          // Symbol or builtin name -> string offset
+  FILE *strings;
+  char *text;
+  size_t text_len;
+  uint64_t strings_base;
+} ImageWriter;
+
+void image_visit(ImageWriter *w, Atom atom) {
+  switch (atom.type) {
+    case AtomType_Pair:
+    case AtomType_Closure:
+    case AtomType_Macro:
+    case AtomType_Future:
+    case AtomType_String: {
+      Allocation *a = (Allocation*) atom.value.pair;
+      if (ptrmap_get(&w->records, a)) return;
+      if (w->count == w->cap) {
+        w->cap = w->cap ? 2 * w->cap : 1024;
+        w->order = checked_realloc(w->order, w->cap * sizeof(Allocation*));
+      }
+      ptrmap_put(&w->records, a, w->count);
+      w->order[w->count++] = a;
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+uint64_t image_string(ImageWriter *w, const void *key, const char *s, size_t len) {
+  size_t *offset = key ? ptrmap_get(&w->names, key) : NULL;
+  if (offset) return w->strings_base + *offset;
+
+  fflush(w->strings);
+  size_t at = w->text_len;
+  fwrite(s, 1, len, w->strings);
+  fputc('\0', w->strings);
+  if (key) ptrmap_put(&w->names, key, at);
+  return w->strings_base + at;
+}
+
+bool image_encode(ImageWriter *w, Atom atom, Atom *out) {
+  memset(out, 0, sizeof(Atom));
+  out->type = atom.type;
+  switch (atom.type) {
+    case AtomType_Nil:
+      break;
+    case AtomType_Integer:
+      out->value.integer = atom.value.integer;
+      break;
+    case AtomType_Pair:
+    case AtomType_Closure:
+    case AtomType_Macro:
+    case AtomType_Future:
+    case AtomType_String:
+      out->value.integer = sizeof(ImageHeader) +
+        *ptrmap_get(&w->records, atom.value.pair) * sizeof(Allocation) +
+        offsetof(Allocation, pair);
+      break;
+    case AtomType_Symbol:
+      out->value.integer = image_string(w, atom.value.symbol, atom.value.symbol,
+                                        strlen(atom.value.symbol));
+      break;
+    case AtomType_Builtin:
+      for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (builtins[i].fn == atom.value.builtin) {
+          out->value.integer = image_string(w, builtins[i].name, builtins[i].name,
+                                            strlen(builtins[i].name));
+          return true;
+        }
+      }
+      printf("Builtin %p has no name, so can't be saved in an image\n", atom.value.builtin);
+      return false;
+    case AtomType_Port:
+      printf("Ports can't be saved in an image\n");
+      return false;
+  }
+  return true;
+}
+
+bool image_save(const char path[], Atom env) {
+  ImageWriter w;
+  memset(&w, 0, sizeof(w));
+
+  // Number everything reachable.
+  image_visit(&w, env);
+  image_visit(&w, lisp->sym_table);
+  for (size_t i = 0; i < w.count; ++i) {
+    if (!w.order[i]->string) {
+      image_visit(&w, w.order[i]->pair.atom[0]);
+      image_visit(&w, w.order[i]->pair.atom[1]);
+    }
+  }
+
+  w.strings = open_memstream(&w.text, &w.text_len);
+  w.strings_base = sizeof(ImageHeader) + w.count * sizeof(Allocation);
+
+  bool ok = true;
+  Allocation *records = calloc(w.count ? w.count : 1, sizeof(Allocation));
+  if (!records || !w.strings) {
+    printf("Out of memory in save-image\n");
+    ok = false;
+  }
+  for (size_t i = 0; ok && i < w.count; ++i) {
+    Allocation *a = w.order[i];
+    records[i].string = a->string;
+    records[i].weak = a->weak;
+    if (a->string) {
+      image_encode(&w, a->pair.atom[0], &records[i].pair.atom[0]);
+      records[i].pair.atom[1].value.integer =
+        image_string(&w, NULL, a->pair.atom[1].value.symbol, a->pair.atom[0].value.integer);
+    } else {
+      ok = image_encode(&w, a->pair.atom[0], &records[i].pair.atom[0]) &&
+           image_encode(&w, a->pair.atom[1], &records[i].pair.atom[1]);
+    }
+  }
+
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  if (ok) {
+    ok = image_encode(&w, env, &header.env) &&
+         image_encode(&w, lisp->sym_table, &header.sym_table);
+  }
+  if (w.strings) fclose(w.strings);
+
+  if (ok) {
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.allocation_size = sizeof(Allocation);
+    header.count = w.count;
+    header.strings = w.strings_base;
+    header.size = w.strings_base + w.text_len;
+
+    FILE *file = fopen(path, "wb");
+    if (!file ||
+        fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(records, sizeof(Allocation), w.count, file) != w.count ||
+        fwrite(w.text, 1, w.text_len, file) != w.text_len) {
+      perror(path);
+      ok = false;
+    }
+    if (file && fclose(file) != 0) ok = false;
+  }
+
+  free(records);
+  free(w.text);
+  free(w.order);
+  ptrmap_free(&w.records);
+  ptrmap_free(&w.names);
+  return ok;
+}
+
+bool image_relocate(char *base, const ImageHeader *header, Atom *atom) {
+  uint64_t offset = atom->value.integer;
+  switch (atom->type) {
+    case AtomType_Nil:
+    case AtomType_Integer:
+      return true;
+    case AtomType_Pair:
+    case AtomType_Closure:
+    case AtomType_Macro:
+    case AtomType_Future:
+    case AtomType_String: {
+      // The pair of a record, which holds a string if and only if `atom` is one.
+      uint64_t first = sizeof(ImageHeader) + offsetof(Allocation, pair);
+      if (offset < first || offset >= header->strings || (offset - first) % sizeof(Allocation))
+        return false;
+      const Allocation *a = (const Allocation*) (base + offset - offsetof(Allocation, pair));
+      if (a->string != (atom->type == AtomType_String)) return false;
+      atom->value.pair = (Pair*) (base + offset);
+      return true;
+    }
+    case AtomType_Symbol:
+      if (offset < header->strings || offset >= header->size) return false;
+      atom->value.symbol = base + offset;
+      return true;
+    case AtomType_Builtin:
+      if (offset < header->strings || offset >= header->size) return false;
+      for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (strcmp(builtins[i].name, base + offset) == 0) {
+          atom->value.builtin = builtins[i].fn;
+          return true;
+        }
+      }
+      printf("Image refers to unknown builtin '%s'\n", base + offset);
+      return false;
+    case AtomType_Port:
+      return false; // Never written to an image.
+  }
+  return false;
+}
+
+bool image_load(const char path[], Atom *env) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ImageHeader)) {
+    perror(path);
+    if (fd >= 0) close(fd);
+    return false;
+  }
+
+  char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+
+  ImageHeader *header = (ImageHeader*) base;
+  bool ok = memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0 &&
+            header->version == IMAGE_VERSION &&
+            header->allocation_size == sizeof(Allocation) &&
+            header->size == (uint64_t) st.st_size &&
+            header->count <= (header->size - sizeof(ImageHeader)) / sizeof(Allocation) &&
+            header->strings == sizeof(ImageHeader) + header->count * sizeof(Allocation) &&
+            header->strings <= header->size &&
+            (header->size == header->strings || base[header->size - 1] == '\0');
+
+  Allocation *records = (Allocation*) (base + sizeof(ImageHeader));
+  for (uint64_t i = 0; ok && i < header->count; ++i) {
+    Allocation *a = &records[i];
+    a->mark = 0;
+    a->next = NULL;
+    if (a->string > 1 || a->weak > 1 || a->block || (a->string && a->weak)) {
+      ok = false;
+    } else if (a->string) {
+      // The bytes and the NUL after them are in the string section.
+      Atom len = a->pair.atom[0];
+      uint64_t offset = a->pair.atom[1].value.integer;
+      ok = len.type == AtomType_Integer && len.value.integer >= 0 &&
+           offset >= header->strings && offset < header->size &&
+           (uint64_t) len.value.integer < header->size - offset &&
+           base[offset + len.value.integer] == '\0';
+      a->pair.atom[1].value.symbol = base + offset;
+    } else {
+      ok = image_relocate(base, header, &a->pair.atom[0]) &&
+           image_relocate(base, header, &a->pair.atom[1]);
+    }
+  }
+  ok = ok && image_relocate(base, header, &header->env) &&
+       image_relocate(base, header, &header->sym_table);
+
+  // With every reference a pointer to a record, check what's walked without
+  // checks: each walk is of at most `count` pairs, so a cycle fails.
+  size_t limit = header->count;
+  Atom p = header->sym_table;
+  for (; ok && p.type == AtomType_Pair; p = cdr(p))
+    ok = limit-- && car(p).type == AtomType_Symbol;
+  ok = ok && nilp(p);
+  PtrMap envs = { NULL, NULL, 0, 0 };
+  size_t walk = 0;
+  limit = header->count;
+  ok = ok && env_valid(header->env, &envs, ++walk, &limit);
+  for (uint64_t i = 0; ok && i < header->count; ++i) {
+    for (int j = 0; ok && j < 2 && !records[i].string; ++j) {
+      Atom x = records[i].pair.atom[j];
+      limit = header->count;
+      if (x.type == AtomType_Closure || x.type == AtomType_Macro)
+        ok = closure_valid(x, &limit) && env_valid(car(x), &envs, ++walk, &limit);
+    }
+  }
+  ptrmap_free(&envs);
+
+  if (!ok) {
+    printf("'%s' is not a usable image\n", path);
+    munmap(base, st.st_size);
+    return false;
+  }
+
+  lisp->image_base = base;
+  lisp->image_size = st.st_size;
+  lisp->image_heap = records;
+  lisp->image_count = header->count;
+  lisp->sym_table = header->sym_table;
+  lisp->global_env = *env = header->env;
+  ++lisp->env_version;
+  return true;
+}
+
+int save_image_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom path = car(args);
+  if (path.type != AtomType_String) {
+    printf("Expecting a string in save-image\n");
+    return Error_Type;
+  }
+
+  if (!image_save(string_data(path), lisp->global_env)) return Error_Type;
+
+  *result = TRUE_SYM;
+  return Result_OK;
+}
+
+// -----------------------------------------------------------------------------
+// Binary serialization
+//
+// `(serialize obj)` encodes an atom graph as a string of bytes and
+// `(deserialize bytes)` decodes it; `serialize-to-file` and
+// `deserialize-from-file` do the same through a file, streaming in both
+// directions.
+//
+// After a 4 byte magic number the encoding is a single item:
+//
+//   NIL
+//   INTEGER  zigzag varint
+//   SYMBOL   varint length, name     - defines the next symbol number
+//   SYMREF   varint symbol number
+//   STRING   varint length, bytes    - defines the next object number
+//   PAIR     car item, cdr item      - defines the next object number
+//   CLOSURE, MACRO                   - as PAIR
+//   REF      varint object number
+//   BUILTIN  varint length, name
+//
+// Symbol definitions form the symbol table, written as symbols are first
+// used. Pairs and strings met a second time are written as a REF, which keeps
+// sharing and cycles intact.
+// -----------------------------------------------------------------------------
+
+#define SERIAL_MAGIC "LSB1"
+
+enum {
+  Serial_Nil,
+  Serial_Integer,
+  Serial_Symbol,
+  Serial_SymRef,
+  Serial_String,
+  Serial_Pair,
+  Serial_Closure,
+  Serial_Macro,
+  Serial_Ref,
+  Serial_Builtin
+};
+
+typedef struct {
+  Printer *out;
+  PtrMap objects;  // Allocation -> object number
+  PtrMap symbols;  // Symbol name -> symbol number
+  size_t nobjects;
+  size_t nsymbols;
+} Serializer;
+
+void serial_varint(Serializer *s, unsigned long n) {
+  char buf[10];
+  size_t len = 0;
+  do {
+    buf[len++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+    n >>= 7;
+  } while (n);
+  printer_write(s->out, buf, len);
+}
+
+void serial_bytes(Serializer *s, const char *bytes, size_t len) {
+  serial_varint(s, len);
+  printer_write(s->out, bytes, len);
+}
+
+// Write `atom`. The cdrs of pairs whose cars are being written wait on a
+// stack of their own rather than the C stack, however deep the nesting.
+bool serial_write(Serializer *s, Atom atom) {
+  Atom *pending = NULL;
+  size_t npending = 0, cap = 0;
+  bool ok = true;
+  for (;;) {
+    switch (atom.type) {
+      case AtomType_Nil:
+        printer_putc(s->out, Serial_Nil);
+        break;
+      case AtomType_Integer: {
+        unsigned long n = atom.value.integer;
+        printer_putc(s->out, Serial_Integer);
+        serial_varint(s, (n << 1) ^ (atom.value.integer < 0 ? ~0UL : 0));
+        break;
+      }
+      case AtomType_Symbol: {
+        size_t *n = ptrmap_get(&s->symbols, atom.value.symbol);
+        if (n) {
+          printer_putc(s->out, Serial_SymRef);
+          serial_varint(s, *n);
+        } else {
+          ptrmap_put(&s->symbols, atom.value.symbol, s->nsymbols++);
+          printer_putc(s->out, Serial_Symbol);
+          serial_bytes(s, atom.value.symbol, strlen(atom.value.symbol));
+        }
+        break;
+      }
+      case AtomType_Builtin:
+        ok = false;
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]) && !ok; ++i) {
+          if (builtins[i].fn == atom.value.builtin) {
+            printer_putc(s->out, Serial_Builtin);
+            serial_bytes(s, builtins[i].name, strlen(builtins[i].name));
+            ok = true;
+          }
+        }
+        if (!ok) printf("Builtin %p has no name, so can't be serialized\n", atom.value.builtin);
+        break;
+      case AtomType_Future:
+        printf("Futures can't be serialized\n");
+        ok = false;
+        break;
+      case AtomType_Port:
+        printf("Ports can't be serialized\n");
+        ok = false;
+        break;
+      case AtomType_Pair:
+      case AtomType_Closure:
+      case AtomType_Macro:
+      case AtomType_String: {
+        size_t *n = ptrmap_get(&s->objects, atom.value.pair);
+        if (n) {
+          printer_putc(s->out, Serial_Ref);
+          serial_varint(s, *n);
+          break;
+        }
+        ptrmap_put(&s->objects, atom.value.pair, s->nobjects++);
+
+        if (atom.type == AtomType_String) {
+          printer_putc(s->out, Serial_String);
+          serial_bytes(s, string_data(atom), string_length(atom));
+          break;
+        }
+
+        printer_putc(s->out, atom.type == AtomType_Pair ? Serial_Pair :
+                             atom.type == AtomType_Closure ? Serial_Closure : Serial_Macro);
+        if (npending == cap) {
+          cap = cap ? 2 * cap : 64;
+          Atom *bigger = realloc(pending, cap * sizeof(Atom));
+          if (!bigger) {
+            printf("Out of memory in serialize\n");
+            ok = false;
+            break;
+          }
+          pending = bigger;
+        }
+        pending[npending++] = cdr(atom);
+        atom = car(atom);
+        continue;
+      }
+    }
+    if (!ok || npending == 0) break;
+    atom = pending[--npending];
+  }
+  free(pending);
+  return ok;
+}
+
+bool serialize(Printer *out, Atom atom) {
+  Serializer s = { out, { NULL, NULL, 0, 0 }, { NULL, NULL, 0, 0 }, 0, 0 };
+  printer_puts(out, SERIAL_MAGIC);
+  bool ok = serial_write(&s, atom);
+  ptrmap_free(&s.objects);
+  ptrmap_free(&s.symbols);
+  return ok;
+}
+
+typedef struct {
+  const unsigned char *p;   // Input in memory...
+  const unsigned char *end;
+  FILE *in;                 // ...or from a stream.
+  size_t in_size;           // See serial_remaining.
+  Atom *objects;
+  size_t nobjects;
+  size_t objects_cap;
+  Atom *symbols;
+  size_t nsymbols;
+  size_t symbols_cap;
+  char *buf;
+} Deserializer;
+
+int serial_getc(Deserializer *d) {
+  if (d->in) return fgetc(d->in);
+  return d->p < d->end ? *d->p++ : EOF;
+}
+
+bool serial_read_varint(Deserializer *d, unsigned long *n) {
+  *n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = serial_getc(d);
+    if (c == EOF) return false;
+    *n |= (unsigned long) (c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+// Longest run of bytes accepted from a stream whose size isn't known.
+#define SERIAL_MAX_BYTES (1ul << 30)
+
+// An upper bound on the bytes still to be read, so that a corrupt length is
+// rejected before anything is allocated for it. For a stream this is the
+// size of the file, looked up once.
+size_t serial_remaining(Deserializer *d) {
+  if (!d->in) return (size_t) (d->end - d->p);
+  if (!d->in_size) {
+    struct stat st;
+    d->in_size = fstat(fileno(d->in), &st) == 0 && S_ISREG(st.st_mode)
+                 ? (size_t) st.st_size : SERIAL_MAX_BYTES;
+  }
+  return d->in_size;
+}
+
+// Read a length-prefixed run of bytes into `d->buf`, NUL-terminated.
+bool serial_read_bytes(Deserializer *d, size_t *len) {
+  unsigned long n;
+  if (!serial_read_varint(d, &n)) return false;
+  if (n > serial_remaining(d)) return false;
+  char *buf = realloc(d->buf, n + 1);
+  if (!buf) return false;
+  d->buf = buf;
+  if (d->in) {
+    if (fread(buf, 1, n, d->in) != n) return false;
+  } else {
+    memcpy(buf, d->p, n);
+    d->p += n;
+  }
+  buf[n] = '\0';
+  *len = n;
+  return true;
+}
+
+Atom *serial_push(Atom **items, size_t *count, size_t *cap, Atom atom) {
+  if (*count == *cap) {
+    *cap = *cap ? 2 * *cap : 256;
+    *items = realloc(*items, *cap * sizeof(Atom));
+  }
+  (*items)[*count] = atom;
+  return &(*items)[(*count)++];
+}
+
+// Read an item into `*result`. As in `serial_write`, the cdrs of pairs whose
+// cars are being read wait on a stack, here of the places they go.
+int serial_read(Deserializer *d, Atom *result) {
+  Atom **pending = NULL;
+  size_t npending = 0, cap = 0;
+  int r = Result_OK;
+  while (!r) {
+    unsigned long n;
+    size_t len;
+    int tag = serial_getc(d);
+    switch (tag) {
+      case Serial_Nil:
+        *result = nil;
+        break;
+      case Serial_Integer:
+        if (!serial_read_varint(d, &n)) r = Error_Syntax;
+        else *result = make_int((long) (n >> 1) ^ -(long) (n & 1));
+        break;
+      case Serial_Symbol:
+        if (!serial_read_bytes(d, &len)) {
+          r = Error_Syntax;
+          break;
+        }
+        *result = make_sym(d->buf);
+        serial_push(&d->symbols, &d->nsymbols, &d->symbols_cap, *result);
+        break;
+      case Serial_SymRef:
+        if (!serial_read_varint(d, &n) || n >= d->nsymbols) r = Error_Syntax;
+        else *result = d->symbols[n];
+        break;
+      case Serial_String:
+        if (!serial_read_bytes(d, &len)) {
+          r = Error_Syntax;
+          break;
+        }
+        *result = make_string(d->buf, len);
+        serial_push(&d->objects, &d->nobjects, &d->objects_cap, *result);
+        break;
+      case Serial_Ref:
+        if (!serial_read_varint(d, &n) || n >= d->nobjects) r = Error_Syntax;
+        else *result = d->objects[n];
+        break;
+      case Serial_Builtin:
+        if (!serial_read_bytes(d, &len)) {
+          r = Error_Syntax;
+          break;
+        }
+        r = Error_Syntax;
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]) && r; ++i) {
+          if (strcmp(builtins[i].name, d->buf) == 0) {
+            *result = make_builtin(builtins[i].fn);
+            r = Result_OK;
+          }
+        }
+        if (r) printf("Unknown builtin '%s' in serialized data\n", d->buf);
+        break;
+      case Serial_Pair:
+      case Serial_Closure:
+      case Serial_Macro: {
+        // Number the pair before reading its car, which may refer back to it.
+        Atom p = cons(nil, nil);
+        p.type = tag == Serial_Pair ? AtomType_Pair :
+                 tag == Serial_Closure ? AtomType_Closure : AtomType_Macro;
+        serial_push(&d->objects, &d->nobjects, &d->objects_cap, p);
+        *result = p;
+
+        if (npending == cap) {
+          cap = cap ? 2 * cap : 64;
+          Atom **bigger = realloc(pending, cap * sizeof(Atom*));
+          if (!bigger) {
+            printf("Out of memory in deserialize\n");
+            r = Error_Limit;
+            break;
+          }
+          pending = bigger;
+        }
+        pending[npending++] = &cdr(p);
+        result = &car(p);
+        continue;
+      }
+      default:
+        r = Error_Syntax;
+        break;
+    }
+    if (npending == 0) break;
+    result = pending[--npending];
+  }
+  free(pending);
+  return r;
+}
+
+int deserialize(Deserializer *d, Atom *result) {
+  for (const char *m = SERIAL_MAGIC; *m; ++m)
+    if (serial_getc(d) != *m) return Error_Syntax;
+
+  // Objects being read are only reachable from `d->objects`, which isn't a
+  // root, so don't collect until they're all linked together.
+  ++self->gc_inhibit;
+  int r = serial_read(d, result);
+  --self->gc_inhibit;
+
+  // Nothing in the data has been applied yet; don't let a closure that
+  // `make_closure` would have refused get that far.
+  PtrMap envs = { NULL, NULL, 0, 0 };
+  for (size_t i = 0; i < d->nobjects && !r; ++i) {
+    Atom x = d->objects[i];
+    if (x.type != AtomType_Closure && x.type != AtomType_Macro) continue;
+    size_t limit = d->nobjects;
+    if (!closure_valid(x, &limit) || !env_valid(car(x), &envs, i + 1, &limit)) {
+      printf("Malformed %s in serialized data\n", x.type == AtomType_Closure ? "closure" : "macro");
+      r = Error_Syntax;
+    }
   }
+  ptrmap_free(&envs);
+  free(d->objects);
+  free(d->symbols);
+  free(d->buf);
+  return r;
+}
 
-INTEGER_RELOP(integer_eq_builtin, ==)
-INTEGER_RELOP(integer_lt_builtin, <)
-INTEGER_RELOP(integer_le_builtin, <=)
-INTEGER_RELOP(integer_gt_builtin, >)
-INTEGER_RELOP(integer_ge_builtin, >=)
+int serialize_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Printer out = { NULL, 0, 0, NULL };
+  if (!serialize(&out, car(args))) {
+    free(out.buf);
+    return Error_Type;
+  }
+  *result = make_string(out.buf, out.len);
+  free(out.buf);
+  return Result_OK;
+}
+
+int deserialize_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom bytes = car(args);
+  if (bytes.type != AtomType_String) {
+    printf("Expecting a string in deserialize\n");
+    return Error_Type;
+  }
+
+  Deserializer d;
+  memset(&d, 0, sizeof(d));
+  d.p = (const unsigned char*) string_data(bytes);
+  d.end = d.p + string_length(bytes);
+  return deserialize(&d, result);
+}
+
+int serialize_to_file_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
+
+  Atom path = car(cdr(args));
+  if (path.type != AtomType_String) {
+    printf("Expecting a string in serialize-to-file\n");
+    return Error_Type;
+  }
+
+  FILE *file = fopen(string_data(path), "wb");
+  if (!file) {
+    perror(string_data(path));
+    return Error_Type;
+  }
+
+  char buf[4096];
+  Printer out = { buf, 0, sizeof(buf), file };
+  bool ok = serialize(&out, car(args));
+  printer_flush(&out);
+  if (fclose(file) != 0) ok = false;
+  if (!ok) return Error_Type;
+
+  *result = TRUE_SYM;
+  return Result_OK;
+}
+
+int deserialize_from_file_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom path = car(args);
+  if (path.type != AtomType_String) {
+    printf("Expecting a string in deserialize-from-file\n");
+    return Error_Type;
+  }
+
+  FILE *file = fopen(string_data(path), "rb");
+  if (!file) {
+    perror(string_data(path));
+    return Error_Type;
+  }
+
+  Deserializer d;
+  memset(&d, 0, sizeof(d));
+  d.in = file;
+  int r = deserialize(&d, result);
+  fclose(file);
+  return r;
+}
 
 // -----------------------------------------------------------------------------
-// Stack frames.
+// Modules
+//
+// `(require 'name)` loads name.lisp from the first directory in the list of
+// strings *MODULE-PATH* (from $LISP_PATH, colon-separated, by default ".")
+// that has it. The module is evaluated in its own environment, a child of the
+// global one, and each of its definitions is then bound globally as
+// NAME:SYMBOL to its value at that point. Loaded modules are listed in
+// *MODULES*, and a module already there isn't loaded again.
+//
+// The forms of a module are cached next to it, serialized, in name.lispc
+// along with a hash of the source, so an unchanged module is read back
+// without being parsed. A cache that's stale, unreadable or can't be written
+// is ignored.
 // -----------------------------------------------------------------------------
 
-Atom list_get(Atom list, int k) {
-  while (k--)
-    list = cdr(list);
-  return car(list);
+#define MODULE_CACHE_SUFFIX "c"
+
+uint64_t module_hash(const char *text) {
+  uint64_t h = 14695981039346656037ull;
+  for (const unsigned char *p = (const unsigned char*) text; *p; ++p)
+    h = (h ^ *p) * 1099511628211ull;
+  return h;
 }
 
-void list_set(Atom list, int k, Atom value) {
-  while (k--)
-    list = cdr(list);
-  car(list) = value;
+// Read the forms of `text` into the list `*forms`.
+int module_parse(const char *text, Atom *forms) {
+  const char *p = text;
+  Atom expr = nil;
+  PUSH_ROOT(expr);
+  int r = Result_OK;
+  *forms = nil;
+  for (;;) {
+    const char *start, *end;
+    if (lex(p, &start, &end) == Result_OK && *start == '\0') break;
+    r = read_expr(p, &p, &expr);
+    if (r) break;
+    *forms = cons(expr, *forms);
+  }
+  POP_ROOTS(1);
+  list_reverse(forms);
+  return r;
 }
 
-void list_reverse(Atom *list) {
-  Atom tail = nil;
-  while (!nilp(*list)) {
-    Atom p = cdr(*list);
-    cdr(*list) = tail;
-    tail = *list;
-    *list = p;
+// The forms in the cache file `cache`, if it's for source whose hash is `hash`.
+// It's read whole and deserialized from memory, so that no length in a corrupt
+// file can reach past its end.
+bool module_cache_read(const char *cache, uint64_t hash, Atom *forms) {
+  size_t size;
+  char *bytes = slurp_size(cache, &size);
+  if (!bytes) return false;
+  Deserializer d;
+  memset(&d, 0, sizeof(d));
+  d.p = (const unsigned char*) bytes;
+  d.end = d.p + size;
+  Atom entry;
+  bool ok = deserialize(&d, &entry) == Result_OK && entry.type == AtomType_Pair &&
+            car(entry).type == AtomType_Integer &&
+            (uint64_t) car(entry).value.integer == hash;
+  free(bytes);
+  if (ok) *forms = cdr(entry);
+  return ok;
+}
+
+// Write the cache atomically, so that a concurrent reader never sees half.
+void module_cache_write(const char *cache, uint64_t hash, Atom forms) {
+  size_t len = strlen(cache) + 32;
+  char *temp = malloc(len);
+  if (!temp) return;
+  snprintf(temp, len, "%s.%ld", cache, (long) getpid());
+
+  FILE *file = fopen(temp, "wb");
+  if (file) {
+    Atom entry = cons(make_int((long) hash), forms);
+    char buf[4096];
+    Printer out = { buf, 0, sizeof(buf), file };
+    bool ok = serialize(&out, entry);
+    printer_flush(&out);
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(temp, cache) != 0) remove(temp);
+  }
+  free(temp);
+}
+
+// Read the forms of the module at `path`, through its cache.
+int module_read(const char *path, Atom *forms) {
+  char *text = slurp(path);
+  if (!text) {
+    perror(path);
+    return Error_Type;
+  }
+  uint64_t hash = module_hash(text);
+
+  size_t len = strlen(path) + sizeof(MODULE_CACHE_SUFFIX);
+  char *cache = malloc(len);
+  if (cache) snprintf(cache, len, "%s%s", path, MODULE_CACHE_SUFFIX);
+
+  // Without memory for the cache's name, just parse.
+  int r = Result_OK;
+  if (!cache || !module_cache_read(cache, hash, forms)) {
+    r = module_parse(text, forms);
+    if (!r && cache) module_cache_write(cache, hash, *forms);
+  }
+  free(cache);
+  free(text);
+  return r;
+}
+
+// Set `*path` to the file for module `name` on *MODULE-PATH*, malloc'd.
+int module_find(Atom name, char **path) {
+  Atom dirs = nil;
+  if (env_find(lisp->global_env, make_sym("*MODULE-PATH*"), &dirs)) {
+    for (dirs = cdr(dirs); dirs.type == AtomType_Pair; dirs = cdr(dirs)) {
+      Atom dir = car(dirs);
+      if (dir.type != AtomType_String) continue;
+      size_t len = string_length(dir) + strlen(name.value.symbol) + sizeof("/.lisp");
+      *path = malloc(len);
+      if (!*path) {
+        printf("Out of memory in require\n");
+        return Error_Limit;
+      }
+      snprintf(*path, len, "%s/%s.lisp", string_data(dir), name.value.symbol);
+      for (char *c = *path + string_length(dir); *c; ++c) *c = tolower(*c);
+      if (access(*path, R_OK) == 0) return Result_OK;
+      free(*path);
+    }
+  }
+  printf("Module '%s' not found on *MODULE-PATH*\n", name.value.symbol);
+  return Error_Unbound;
+}
+
+// (require 'name) => name
+int require_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
+
+  Atom name = car(args);
+  if (name.type != AtomType_Symbol) {
+    printf("Expecting a symbol in require\n");
+    return Error_Type;
+  }
+  *result = name;
+
+  Atom modules_sym = make_sym("*MODULES*"), loaded = nil;
+  env_find(lisp->global_env, modules_sym, &loaded);
+  for (Atom m = nilp(loaded) ? nil : cdr(loaded); m.type == AtomType_Pair; m = cdr(m))
+    if (car(m).type == AtomType_Symbol && sym_eq(car(m), name)) return Result_OK;
+
+  char *path;
+  int r = module_find(name, &path);
+  if (r) return r;
+
+  // Listed while it loads, so that modules requiring each other finish.
+  Atom env = nil, forms = nil;
+  PUSH_ROOT(env);
+  PUSH_ROOT(forms);
+  Atom modules = nilp(loaded) ? nil : cdr(loaded);
+  env_set(lisp->global_env, modules_sym, cons(name, modules));
+
+  env = env_create(lisp->global_env);
+  r = module_read(path, &forms);
+  for (; !r && !nilp(forms); forms = cdr(forms)) {
+    Atom value;
+    r = eval_expr(car(forms), env, &value);
+  }
+
+  if (r) {
+    // Unlist it, leaving any modules it loaded itself.
+    printf("Error loading module '%s' from %s\n", name.value.symbol, path);
+    env_find(lisp->global_env, modules_sym, &loaded);
+    Atom prev = loaded;
+    for (Atom m = cdr(loaded); m.type == AtomType_Pair; prev = m, m = cdr(m)) {
+      if (car(m).type == AtomType_Symbol && sym_eq(car(m), name)) {
+        if (prev.value.pair == loaded.value.pair) // Not the binding itself.
+          env_set(lisp->global_env, modules_sym, cdr(m));
+        else
+          set_cdr(prev, cdr(m));
+        break;
+      }
+    }
+  } else {
+    size_t prefix = strlen(name.value.symbol);
+    for (Atom bs = cdr(env); !nilp(bs); bs = cdr(bs)) {
+      const char *sym = car(car(bs)).value.symbol;
+      char *qualified = malloc(prefix + strlen(sym) + 2);
+      if (!qualified) {
+        printf("Out of memory in require\n");
+        r = Error_Limit;
+        break;
+      }
+      sprintf(qualified, "%s:%s", name.value.symbol, sym);
+      env_set(lisp->global_env, make_sym(qualified), cdr(car(bs)));
+      free(qualified);
+    }
+  }
+  POP_ROOTS(2);
+  free(path);
+  return r;
+}
+
+// *MODULE-PATH* from $LISP_PATH.
+Atom module_path() {
+  const char *path = getenv("LISP_PATH");
+  if (!path || !*path) path = ".";
+  Atom dirs = nil;
+  PUSH_ROOT(dirs);
+  for (const char *p = path;; ++p) {
+    const char *end = p + strcspn(p, ":");
+    if (end > p) dirs = cons(make_string(p, end - p), dirs);
+    if (!*end) break;
+    p = end;
+  }
+  POP_ROOTS(1);
+  list_reverse(&dirs);
+  return dirs;
+}
+
+// -----------------------------------------------------------------------------
+// Profiler
+//
+// While a profile is running, every closure call on the main thread records
+// the environment it creates, and SIGPROF arrives every PROFILE_INTERVAL
+// microseconds of CPU time and sets `profile_tick`. The next evaluation step
+// then records the Lisp call stack: the calls whose environments are those of
+// the frames of every running `eval_expr`. A closure is named by the first
+// DEFINE or DEFMACRO that binds it (see `profile_name`), or by its binding in
+// the global environment when the profile starts, and is `<lambda>`
+// otherwise. A tail call replaces its caller's environment, so it's counted
+// as made by the caller's caller. Workers aren't sampled.
+//
+// `--profile file` profiles the whole run and `(profile expr [file])` just
+// `expr`. Both print a flat report and a call graph and, given a file, write
+// the stacks to it in the collapsed format of flamegraph.pl.
+// -----------------------------------------------------------------------------
+
+#define PROFILE_INTERVAL 1000
+#define PROFILE_MAX_DEPTH 64
+
+typedef struct {
+  const char **names;   // Outermost first.
+  int depth;
+  unsigned long count;
+} ProfileStack;
+
+struct Profile {
+  ProfileStack *stacks; // Open-addressed by their names.
+  size_t count;
+  size_t cap;
+  unsigned long samples;
+  PtrMap calls;         // Environment -> name of the closure called.
+};
+
+void profile_signal(int sig) {
+  (void) sig;
+  profile_tick = true;
+}
+
+// Record `name` for `value` if it's a closure or macro without one.
+void profile_name(Atom value, Atom sym) {
+  if (value.type != AtomType_Closure && value.type != AtomType_Macro) return;
+
+  if (lisp->pool) pthread_mutex_lock(&lisp->shared_lock);
+  if (!lisp->closure_names) lisp->closure_names = calloc(1, sizeof(PtrMap));
+  PtrMap *names = lisp->closure_names;
+  if (names && !ptrmap_get(names, value.value.pair))
+    ptrmap_put(names, value.value.pair, (uintptr_t) sym.value.symbol);
+  if (lisp->pool) pthread_mutex_unlock(&lisp->shared_lock);
+}
+
+const char *profile_closure_name(Atom closure) {
+  size_t *name = lisp->closure_names ? ptrmap_get(lisp->closure_names, closure.value.pair) : NULL;
+  return name ? (const char*) (uintptr_t) *name : "<lambda>";
+}
+
+// Record that `env` was created to call `closure`.
+void profile_call(Atom env, Atom closure) {
+  ptrmap_put(&lisp->profile->calls, env.value.pair, (uintptr_t) profile_closure_name(closure));
+}
+
+// Drop the entries of `m` whose keys are allocations left unmarked.
+void ptrmap_prune(PtrMap *m) {
+  PtrMap live = { NULL, NULL, 0, 0 };
+  for (size_t i = 0; i < m->cap; ++i) {
+    Allocation *a = (Allocation*) m->keys[i];
+    if (a && atomic_load_explicit(&a->mark, memory_order_relaxed))
+      ptrmap_put(&live, a, m->values[i]);
+  }
+  ptrmap_free(m);
+  *m = live;
+}
+
+// Forget closures and calls the collection about to finish found
+// unreachable, while their marks are still set.
+void profile_prune() {
+  if (lisp->closure_names) ptrmap_prune(lisp->closure_names);
+  if (lisp->profile) ptrmap_prune(&lisp->profile->calls);
+}
+
+// The names the profiler holds, as the keys of a new map, so that they can
+// outlive their symbols.
+PtrMap *profile_names() {
+  PtrMap *names = calloc(1, sizeof(PtrMap));
+  if (!names) return NULL;
+  if (lisp->closure_names) {
+    for (size_t i = 0; i < lisp->closure_names->cap; ++i) {
+      if (lisp->closure_names->keys[i])
+        ptrmap_put(names, (const char*) (uintptr_t) lisp->closure_names->values[i], 0);
+    }
+  }
+  Profile *p = lisp->profile;
+  for (size_t i = 0; p && i < p->cap; ++i) {
+    for (int j = 0; p->stacks[i].names && j < p->stacks[i].depth; ++j)
+      ptrmap_put(names, p->stacks[i].names[j], 0);
+  }
+  return names;
+}
+
+// Likewise for a compaction, moving the rest to their copies' addresses.
+void ptrmap_forward(PtrMap *m) {
+  PtrMap moved = { NULL, NULL, 0, 0 };
+  for (size_t i = 0; i < m->cap; ++i) {
+    Allocation *a = (Allocation*) m->keys[i];
+    if (!a) continue;
+    unsigned char mark = atomic_load_explicit(&a->mark, memory_order_relaxed);
+    if (gc_in_image(a) && mark)
+      ptrmap_put(&moved, a, m->values[i]);
+    else if (!gc_in_image(a) && mark == GC_FORWARDED)
+      ptrmap_put(&moved, a->pair.atom[0].value.pair, m->values[i]);
+  }
+  ptrmap_free(m);
+  *m = moved;
+}
+
+void profile_forward() {
+  if (lisp->closure_names) ptrmap_forward(lisp->closure_names);
+  if (lisp->profile) ptrmap_forward(&lisp->profile->calls);
+}
+
+uint64_t profile_hash(const char **names, int depth) {
+  uint64_t h = 14695981039346656037ull;
+  for (int i = 0; i < depth; ++i)
+    h = (h ^ (uintptr_t) names[i]) * 1099511628211ull;
+  return h;
+}
+
+void profile_count(Profile *p, const char **names, int depth) {
+  if (2 * (p->count + 1) > p->cap) {
+    Profile bigger = { NULL, 0, p->cap ? 2 * p->cap : 256, p->samples, p->calls };
+    bigger.stacks = calloc(bigger.cap, sizeof(ProfileStack));
+    if (!bigger.stacks) return;
+    for (size_t i = 0; i < p->cap; ++i) {
+      ProfileStack *s = &p->stacks[i];
+      if (!s->names) continue;
+      size_t j = profile_hash(s->names, s->depth) & (bigger.cap - 1);
+      while (bigger.stacks[j].names) j = (j + 1) & (bigger.cap - 1);
+      bigger.stacks[j] = *s;
+    }
+    free(p->stacks);
+    *p = bigger;
+  }
+
+  size_t i = profile_hash(names, depth) & (p->cap - 1);
+  for (;;) {
+    ProfileStack *s = &p->stacks[i];
+    if (!s->names) {
+      s->names = malloc(depth * sizeof(const char*));
+      if (!s->names) return;
+      memcpy(s->names, names, depth * sizeof(const char*));
+      s->depth = depth;
+      ++p->count;
+    }
+    if (s->depth == depth && memcmp(s->names, names, depth * sizeof(const char*)) == 0) {
+      ++s->count;
+      ++p->samples;
+      return;
+    }
+    i = (i + 1) & (p->cap - 1);
+  }
+}
+
+// Called at the top of the evaluation loop when `profile_tick` is set.
+void profile_sample() {
+  if (self != &lisp->main) return;
+  profile_tick = false;
+  if (!lisp->profile) return;
+
+  // Walk the environments innermost first, then reverse. Neighbouring frames
+  // usually share one.
+  PtrMap *calls = &lisp->profile->calls;
+  const char *names[PROFILE_MAX_DEPTH];
+  int depth = 0;
+  Pair *last = NULL;
+  for (EvalRoots *r = self->roots; r && depth < PROFILE_MAX_DEPTH; r = r->prev) {
+    Atom env = *r->env;
+    for (Atom frame = *r->stack; depth < PROFILE_MAX_DEPTH; frame = car(frame)) {
+      size_t *name = env.value.pair != last ? ptrmap_get(calls, env.value.pair) : NULL;
+      if (name) names[depth++] = (const char*) (uintptr_t) *name;
+      last = env.value.pair;
+      if (nilp(frame)) break;
+      env = list_get(frame, 1);
+    }
+  }
+  if (depth == 0) names[depth++] = "<toplevel>";
+
+  for (int i = 0, j = depth - 1; i < j; ++i, --j) {
+    const char *name = names[i];
+    names[i] = names[j];
+    names[j] = name;
+  }
+  profile_count(lisp->profile, names, depth);
+}
+
+void profile_free(Profile *p) {
+  if (!p) return;
+  for (size_t i = 0; i < p->cap; ++i)
+    free(p->stacks[i].names);
+  free(p->stacks);
+  ptrmap_free(&p->calls);
+  free(p);
+}
+
+void profile_start() {
+  profile_free(lisp->profile);
+  lisp->profile = calloc(1, sizeof(Profile));
+
+  // Name what's already bound, e.g. by a heap image.
+  for (Atom b = cdr(lisp->global_env); !nilp(b); b = cdr(b))
+    profile_name(cdr(car(b)), car(car(b)));
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profile_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  struct itimerval timer = { { 0, PROFILE_INTERVAL }, { 0, PROFILE_INTERVAL } };
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Stop the profile and return it for the caller to report and free.
+Profile *profile_stop() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  Profile *p = lisp->profile;
+  lisp->profile = NULL;
+  return p;
+}
+
+typedef struct {
+  const char *name;
+  unsigned long self;
+  unsigned long total;
+} ProfileEntry;
+
+typedef struct {
+  const char *caller;
+  const char *callee;
+  unsigned long count;
+} ProfileEdge;
+
+int profile_entry_cmp(const void *a, const void *b) {
+  const ProfileEntry *x = a, *y = b;
+  if (x->total != y->total) return x->total < y->total ? 1 : -1;
+  return x->self < y->self ? 1 : x->self > y->self ? -1 : 0;
+}
+
+int profile_edge_cmp(const void *a, const void *b) {
+  const ProfileEdge *x = a, *y = b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+// Print the flat profile and call graph. Each sample counts once towards the
+// total of every function on its stack, however deep the recursion, and once
+// towards each distinct call it shows.
+void profile_report(Profile *p, FILE *out) {
+  size_t nentries = 0, nedges = 0, entries_cap = 64, edges_cap = 64;
+  ProfileEntry *entries = malloc(entries_cap * sizeof(ProfileEntry));
+  ProfileEdge *edges = malloc(edges_cap * sizeof(ProfileEdge));
+  if (!entries || !edges) goto oom;
+
+  for (size_t i = 0; i < p->cap; ++i) {
+    ProfileStack *s = &p->stacks[i];
+    if (!s->names) continue;
+
+    for (int j = 0; j < s->depth; ++j) {
+      const char *name = s->names[j];
+      bool seen = false;
+      for (int k = 0; k < j && !seen; ++k)
+        seen = s->names[k] == name;
+
+      size_t e = 0;
+      while (e < nentries && entries[e].name != name) ++e;
+      if (e == nentries) {
+        if (nentries == entries_cap) {
+          ProfileEntry *bigger = realloc(entries, 2 * entries_cap * sizeof(ProfileEntry));
+          if (!bigger) goto oom;
+          entries = bigger;
+          entries_cap *= 2;
+        }
+        entries[nentries++] = (ProfileEntry) { name, 0, 0 };
+      }
+      if (!seen) entries[e].total += s->count;
+      if (j == s->depth - 1) entries[e].self += s->count;
+
+      if (j == 0) continue;
+      const char *caller = s->names[j - 1];
+      seen = false;
+      for (int k = 1; k < j && !seen; ++k)
+        seen = s->names[k - 1] == caller && s->names[k] == name;
+      if (seen) continue;
+
+      size_t g = 0;
+      while (g < nedges && (edges[g].caller != caller || edges[g].callee != name)) ++g;
+      if (g == nedges) {
+        if (nedges == edges_cap) {
+          ProfileEdge *bigger = realloc(edges, 2 * edges_cap * sizeof(ProfileEdge));
+          if (!bigger) goto oom;
+          edges = bigger;
+          edges_cap *= 2;
+        }
+        edges[nedges++] = (ProfileEdge) { caller, name, 0 };
+      }
+      edges[g].count += s->count;
+    }
+  }
+  qsort(entries, nentries, sizeof(ProfileEntry), profile_entry_cmp);
+  qsort(edges, nedges, sizeof(ProfileEdge), profile_edge_cmp);
+
+  double samples = p->samples ? p->samples : 1;
+  fprintf(out, "Flat profile: %lu samples, %d us apart\n", p->samples, PROFILE_INTERVAL);
+  fprintf(out, "  self%%  total%%      self     total  name\n");
+  for (size_t i = 0; i < nentries; ++i) {
+    ProfileEntry *e = &entries[i];
+    fprintf(out, "%6.1f%% %6.1f%% %9lu %9lu  %s\n",
+            100 * e->self / samples, 100 * e->total / samples, e->self, e->total, e->name);
+  }
+
+  fprintf(out, "\nCall graph:\n");
+  for (size_t i = 0; i < nentries; ++i) {
+    ProfileEntry *e = &entries[i];
+    fprintf(out, "%6.1f%%  %s\n", 100 * e->total / samples, e->name);
+    for (size_t g = 0; g < nedges; ++g)
+      if (edges[g].callee == e->name)
+        fprintf(out, "          %9lu  called from %s\n", edges[g].count, edges[g].caller);
+    for (size_t g = 0; g < nedges; ++g)
+      if (edges[g].caller == e->name)
+        fprintf(out, "          %9lu  calls %s\n", edges[g].count, edges[g].callee);
+  }
+  free(entries);
+  free(edges);
+  return;
+
+oom:
+  fprintf(out, "Out of memory in profile report\n");
+  free(entries);
+  free(edges);
+}
+
+// Write one line per distinct stack, for flamegraph.pl.
+bool profile_write_collapsed(Profile *p, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return false;
+  }
+  for (size_t i = 0; i < p->cap; ++i) {
+    ProfileStack *s = &p->stacks[i];
+    if (!s->names) continue;
+    for (int j = 0; j < s->depth; ++j)
+      fprintf(file, "%s%s", j ? ";" : "", s->names[j]);
+    fprintf(file, " %lu\n", s->count);
+  }
+  if (fclose(file) != 0) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+// (profile-start) => T, starting a profile; see the `profile` macro.
+int profile_start_builtin(Atom args, Atom *result) {
+  ENSURE_0_ARGS();
+
+  profile_start();
+
+  *result = TRUE_SYM;
+  return Result_OK;
+}
+
+// (profile-stop value [file]) => value, after stopping the profile and
+// reporting it.
+int profile_stop_builtin(Atom args, Atom *result) {
+  if (nilp(args) || (!nilp(cdr(args)) && !nilp(cdr(cdr(args)))))
+    return Error_Args;
+
+  Atom path = nilp(cdr(args)) ? nil : car(cdr(args));
+  if (!nilp(path) && path.type != AtomType_String) {
+    printf("Expecting a string in profile-stop\n");
+    return Error_Type;
+  }
+
+  Profile *p = profile_stop();
+  if (!p) {
+    printf("No profile running\n");
+    return Error_Type;
+  }
+  profile_report(p, stdout);
+  bool ok = nilp(path) || profile_write_collapsed(p, string_data(path));
+  profile_free(p);
+  if (!ok) return Error_Type;
+
+  *result = car(args);
+  return Result_OK;
+}
+
+// -----------------------------------------------------------------------------
+// Ports and the event loop
+//
+// A port is a non-blocking file descriptor: a file, either end of a pipe, or
+// a Unix socket, listening or connected. Ports aren't allocations. A port atom
+// holds the index of its slot in the context's table and, in the high bits,
+// the slot's generation, so that it still refers to a closed port once the
+// slot is reused. Ports are closed by `close-port`, never collected.
+//
+// `read-async`, `write-async` and `accept-async` queue an operation on
+// `io_ops`, as a list (port kind callback . data). `run-event-loop` waits with
+// epoll until queued operations can make progress, performs them in the order
+// they were queued, and calls their callbacks, which may queue more, until
+// none are left. Regular files can't be waited on, so operations on them are
+// always ready. Only the thread that entered the context may use ports.
+// -----------------------------------------------------------------------------
+
+typedef enum {
+  Io_Read,
+  Io_Write,
+  Io_Accept
+} IoKind;
+
+#define IO_EVENTS 64
+#define IO_READ_SIZE 4096
+
+struct Port {
+  int fd;              // -1 once closed.
+  unsigned gen;        // Bumped when closed.
+  bool file;           // A regular file, which epoll can't wait on.
+  bool listening;
+  uint32_t registered; // Events epoll is waiting on `fd` for.
+  uint32_t wanted;     // Events the queued operations need.
+  uint32_t ready;      // Events the last wait found.
+  uint32_t served;     // Events operations have been performed for since.
+  long next_free;      // Once closed, the next closed slot or -1.
+};
+
+// A new port for `fd`, which it owns from now on, or nil (with `fd` closed)
+// if there's no memory for one.
+Atom make_port(int fd, bool listening) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  size_t slot;
+  if (lisp->free_port >= 0) {
+    slot = lisp->free_port;
+    lisp->free_port = lisp->ports[slot].next_free;
+  } else {
+    Port *bigger = realloc(lisp->ports, (lisp->nports + 1) * sizeof(Port));
+    if (!bigger) {
+      printf("Out of memory for a port\n");
+      close(fd);
+      return nil;
+    }
+    lisp->ports = bigger;
+    slot = lisp->nports++;
+    lisp->ports[slot].gen = 0;
+  }
+
+  Port *p = &lisp->ports[slot];
+  struct stat st;
+  p->fd = fd;
+  p->file = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  p->listening = listening;
+  p->registered = p->wanted = p->ready = p->served = 0;
+
+  Atom a;
+  a.type = AtomType_Port;
+  a.value.integer = (long) p->gen << 32 | slot;
+  return a;
+}
+
+// The port `port` refers to, or NULL if it's been closed.
+Port *port_open(Atom port) {
+  Port *p = &lisp->ports[port.value.integer & 0xffffffff];
+  return p->gen == (unsigned) (port.value.integer >> 32) && p->fd >= 0 ? p : NULL;
+}
+
+// Likewise for an argument of builtin `fn`, saying why if it's NULL.
+Port *port_get(Atom atom, const char *fn) {
+  if (self != &lisp->main) {
+    printf("Only the main thread can use ports, in %s\n", fn);
+    return NULL;
   }
-  *list = tail;
+  if (atom.type != AtomType_Port) {
+    printf("Expecting a port in %s\n", fn);
+    return NULL;
+  }
+  Port *p = port_open(atom);
+  if (!p) printf("Port is closed, in %s\n", fn);
+  return p;
 }
 
-//
-// Frames take the following form:
-//
-//   (parent env evaluated-op (pending-arg...) (evaluated-arg...) (body...))
-//
-Atom make_frame(Atom parent, Atom env, Atom tail) {
-  return cons(
-    parent,
-    cons(env,
-    cons(nil, // op
-    cons(tail,
-    cons(nil, // args
-    cons(nil, // body
-    nil))))));
+void port_close(Port *p) {
+  close(p->fd);
+  p->fd = -1;
+  ++p->gen;
+  p->next_free = lisp->free_port;
+  lisp->free_port = p - lisp->ports;
 }
 
-// -----------------------------------------------------------------------------
-// Evaluation
-//   - a literal evaluates to itself.
-//   - a symbol is looked up in the environment. It's an error if no binding exists.
-//   - a list expression of one of the following is a _special form_:
-//     - (QUOTE expr) => evaluates to expr (which is returned without evaluating).
-//     - (DEFINE sym expr) => creates a binding for `sym` in the evaluation environment.
-//                            The final result is `sym`.
-//     - (DEFINE (name args...) body...) => (DEFINE name (LAMBDA (args...) body...)
-//     - (LAMBDA args body...)
-//     - (IF cond when_true when_false)
-//     - (DEFMACRO (name arg...) body...)
-// -----------------------------------------------------------------------------
+// (open-file path [mode]): mode is READ (the default), WRITE or APPEND.
+int open_file_builtin(Atom args, Atom *result) {
+  if (nilp(args) || (!nilp(cdr(args)) && !nilp(cdr(cdr(args))))) return Error_Args;
 
-int eval_do_exec(Atom *stack, Atom *expr, Atom *env) {
-  *env = list_get(*stack, 1);
-  Atom body = list_get(*stack, 5);
-  *expr = car(body);
-  body = cdr(body);
-  if (nilp(body)) {
-    // Finished function - pop the stack.
-    *stack = car(*stack);
+  Atom path = car(args);
+  Atom mode = nilp(cdr(args)) ? make_sym("READ") : car(cdr(args));
+  if (path.type != AtomType_String || mode.type != AtomType_Symbol) {
+    printf("Expecting a string and a symbol in open-file\n");
+    return Error_Type;
+  }
+
+  int flags;
+  if (strcmp(mode.value.symbol, "READ") == 0) {
+    flags = O_RDONLY;
+  } else if (strcmp(mode.value.symbol, "WRITE") == 0) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (strcmp(mode.value.symbol, "APPEND") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
   } else {
-    list_set(*stack, 5, body);
+    printf("Expecting READ, WRITE or APPEND in open-file\n");
+    return Error_Type;
   }
 
-  return Result_OK;
+  int fd = open(string_data(path), flags | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    perror(string_data(path));
+    return Error_Type;
+  }
+  *result = make_port(fd, false);
+  return nilp(*result) ? Error_Limit : Result_OK;
 }
 
-int eval_do_bind(Atom *stack, Atom *expr, Atom *env) {
-  Atom body = list_get(*stack, 5);
-  if (!nilp(body))
-    return eval_do_exec(stack, expr, env);
-
-  Atom op = list_get(*stack, 2);
-  Atom args = list_get(*stack, 4);
+// (make-pipe) => (read-port . write-port)
+int make_pipe_builtin(Atom args, Atom *result) {
+  ENSURE_0_ARGS();
 
-  *env = env_create(car(op));
-  Atom arg_names = car(cdr(op));
-  body = cdr(cdr(op));
-  list_set(*stack, 1, *env);
-  list_set(*stack, 5, body);
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("make-pipe");
+    return Error_Type;
+  }
+  Atom in = make_port(fds[0], false);
+  if (nilp(in)) {
+    close(fds[1]);
+    return Error_Limit;
+  }
+  Atom out = make_port(fds[1], false);
+  if (nilp(out)) {
+    port_close(port_open(in));
+    return Error_Limit;
+  }
+  *result = cons(in, out);
+  return Result_OK;
+}
 
-  // Bind the arguments.
-  while (!nilp(arg_names)) {
-    if (arg_names.type == AtomType_Symbol) {
-      env_set(*env, arg_names, args);
-      args = nil;
-      break;
-    }
+// A Unix socket address for `path`, or false if it's too long.
+bool unix_address(Atom path, struct sockaddr_un *addr, const char *fn) {
+  if (path.type != AtomType_String) {
+    printf("Expecting a string in %s\n", fn);
+    return false;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (string_length(path) >= (long) sizeof(addr->sun_path)) {
+    printf("Socket path is too long, in %s\n", fn);
+    return false;
+  }
+  memcpy(addr->sun_path, string_data(path), string_length(path));
+  return true;
+}
 
-    if (nilp(args))
-      return Error_Args;
-    env_set(*env, car(arg_names), car(args));
-    arg_names = cdr(arg_names);
-    args = cdr(args);
+// A socket listening at `addr`, replacing any file there, or -1 with errno set.
+int unix_listen(const struct sockaddr_un *addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  unlink(addr->sun_path);
+  if (bind(fd, (const struct sockaddr*) addr, sizeof(*addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
   }
-  if (!nilp(args))
-    return Error_Args;
+  return fd;
+}
 
-  list_set(*stack, 4, nil);
+// (listen-unix path): a port accepting connections to a socket at `path`,
+// which replaces any file there.
+int listen_unix_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
 
-  return eval_do_exec(stack, expr, env);
+  struct sockaddr_un addr;
+  if (!unix_address(car(args), &addr, "listen-unix")) return Error_Type;
+
+  int fd = unix_listen(&addr);
+  if (fd < 0) {
+    perror(addr.sun_path);
+    return Error_Type;
+  }
+  *result = make_port(fd, true);
+  return nilp(*result) ? Error_Limit : Result_OK;
 }
 
-int eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result) {
-  Atom op = list_get(*stack, 2);
-  Atom args = list_get(*stack, 4);
+// (connect-unix path): a port connected to the socket at `path`.
+int connect_unix_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
 
-  if (!nilp(args)) {
-    list_reverse(&args);
-    list_set(*stack, 4, args);
+  struct sockaddr_un addr;
+  if (!unix_address(car(args), &addr, "connect-unix")) return Error_Type;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    perror(addr.sun_path);
+    if (fd >= 0) close(fd);
+    return Error_Type;
   }
+  *result = make_port(fd, false);
+  return nilp(*result) ? Error_Limit : Result_OK;
+}
 
-  if (op.type == AtomType_Symbol) {
-    if (strcmp(op.value.symbol, "APPLY") == 0) {
-      // Replace the current frame.
-      *stack = car(*stack);
-      *stack = make_frame(*stack, *env, nil);
-      op = car(args);
-      args = car(cdr(args));
-      if (!listp(args))
-        return Error_Syntax;
+// (close-port port): close it, dropping the operations queued on it.
+int close_port_builtin(Atom args, Atom *result) {
+  ENSURE_1_ARG();
 
-      list_set(*stack, 2, op);
-      list_set(*stack, 4, args);
-    }
+  Port *p = port_get(car(args), "close-port");
+  if (!p) return Error_Type;
+
+  Atom prev = nil;
+  for (Atom op = lisp->io_ops; !nilp(op); op = cdr(op)) {
+    if (car(car(op)).value.integer != car(args).value.integer)
+      prev = op;
+    else if (nilp(prev))
+      lisp->io_ops = cdr(op);
+    else
+      set_cdr(prev, cdr(op));
   }
+  port_close(p);
+  *result = TRUE_SYM;
+  return Result_OK;
+}
 
-  if (op.type == AtomType_Builtin) {
-    *stack = car(*stack);
-    *expr = cons(op, args);
-    return Result_OK;
-  } else if (op.type != AtomType_Closure) {
-    printf("Expecting closure\n");
+// Queue an operation for `run-event-loop`: (port kind callback . data).
+int io_queue(Atom args, IoKind kind, Atom data, const char *fn) {
+  Port *p = port_get(car(args), fn);
+  if (!p) return Error_Type;
+  if (p->listening != (kind == Io_Accept)) {
+    printf("Expecting a %s port in %s\n", p->listening ? "connected" : "listening", fn);
+    return Error_Type;
+  }
+  Atom callback = car(cdr(args));
+  if (!nilp(callback) && callback.type != AtomType_Builtin && callback.type != AtomType_Closure) {
+    printf("Expecting closure, builtin or nil in %s\n", fn);
     return Error_Type;
   }
 
-  return eval_do_bind(stack, expr, env);
+  PUSH_ROOT(data);
+  Atom op = cons(car(args), cons(make_int(kind), cons(callback, data)));
+  lisp->io_ops = cons(op, lisp->io_ops);
+  POP_ROOTS(1);
+  return Result_OK;
 }
 
-int eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result) {
-  *env = list_get(*stack, 1);
-  Atom op = list_get(*stack, 2);
-  Atom body = list_get(*stack, 5);
+// (read-async port callback): once there's input, call (callback string)
+// with up to IO_READ_SIZE bytes of it, or (callback nil) at the end.
+int read_async_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
 
-  if (!nilp(body)) {
-    // Still running a procedure; ignore the result.
-    return eval_do_apply(stack, expr, env, result);
+  *result = nil;
+  return io_queue(args, Io_Read, nil, "read-async");
+}
+
+// (write-async port string callback): write all of `string`, then call
+// (callback port), or (callback nil) if it can't be.
+int write_async_builtin(Atom args, Atom *result) {
+  ENSURE_3_ARGS();
+
+  Atom s = car(cdr(args));
+  if (s.type != AtomType_String) {
+    printf("Expecting a string in write-async\n");
+    return Error_Type;
   }
+  Atom rest = cons(car(args), cdr(cdr(args)));
+  PUSH_ROOT(rest);
+  int r = io_queue(rest, Io_Write, cons(s, make_int(0)), "write-async");
+  POP_ROOTS(1);
+  *result = nil;
+  return r;
+}
 
-  Atom args;
-  if (nilp(op)) {
-    // Finished evaluating operator.
-    op = *result;
-    list_set(*stack, 2, op);
+// (accept-async port callback): call (callback connection) with the port of
+// the next connection to a listening port.
+int accept_async_builtin(Atom args, Atom *result) {
+  ENSURE_2_ARGS();
 
-    if (op.type == AtomType_Macro) {
-      // Don't evaluate macro arguments.
-      args = list_get(*stack, 3);
-      *stack = make_frame(*stack, *env, nil);
-      op.type = AtomType_Closure;
-      list_set(*stack, 2, op);
-      list_set(*stack, 4, args);
-      return eval_do_bind(stack, expr, env);
+  *result = nil;
+  return io_queue(args, Io_Accept, nil, "accept-async");
+}
+
+// Perform the operation `op`, whose port is ready for it, storing the
+// argument for its callback in `*arg`. False if it has to wait after all.
+bool io_perform(Port *p, Atom op, Atom *arg) {
+  Atom data = cdr(cdr(cdr(op)));
+  switch (car(cdr(op)).value.integer) {
+    case Io_Read: {
+      char buf[IO_READ_SIZE];
+      ssize_t n = read(p->fd, buf, sizeof(buf));
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+      if (n < 0 && errno != ECONNRESET) perror("read-async");
+      *arg = n > 0 ? make_string(buf, n) : nil;
+      return true;
     }
-  } else if (op.type == AtomType_Symbol) {
-    // Finished working on special form.
-    if (strcmp(op.value.symbol, "DEFINE") == 0) {
-      Atom sym = list_get(*stack, 4);
-      (void) env_set(*env, sym, *result);
-      *stack = car(*stack);
-      *expr = cons(make_sym("QUOTE"), cons(sym, nil));
-      return Result_OK;
-    } else if (strcmp(op.value.symbol, "IF") == 0) {
-      args = list_get(*stack, 3);
-      *expr = nilp(*result) ? car(cdr(args)) : car(args);
-      *stack = car(*stack);
-      return Result_OK;
-    } else {
-      goto store_arg;
+    case Io_Write: {
+      Atom s = car(data);
+      long offset = cdr(data).value.integer;
+      ssize_t n = write(p->fd, string_data(s) + offset, string_length(s) - offset);
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) return false;
+      if (n < 0) {
+        perror("write-async");
+        *arg = nil;
+        return true;
+      }
+      set_cdr(data, make_int(offset + n));
+      *arg = car(op);
+      return offset + n == string_length(s);
+    }
+    case Io_Accept: {
+      int fd = accept(p->fd, NULL, NULL);
+      if (fd < 0 && (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)) return false;
+      if (fd < 0) perror("accept-async");
+      *arg = fd < 0 ? nil : make_port(fd, false);
+      return true;
     }
-  } else if (op.type == AtomType_Macro) {
-    // Finished evaluating macro.
-    *expr = *result;
-    *stack = car(*stack);
-    return Result_OK;
-  } else {
-store_arg:
-    // Store evaluated argument.
-    args = list_get(*stack, 4);
-    list_set(*stack, 4, cons(*result, args));
   }
+  return true;
+}
 
-  args = list_get(*stack, 3);
-  if (nilp(args)) {
-    // No more arguments left to evaluate.
-    return eval_do_apply(stack, expr, env, result);
+uint32_t io_events(Atom op) {
+  return car(cdr(op)).value.integer == Io_Write ? EPOLLOUT : EPOLLIN;
+}
+
+// Wait until some port with operations queued is ready for them.
+bool io_wait() {
+  if (lisp->epoll_fd < 0) {
+    lisp->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (lisp->epoll_fd < 0) {
+      perror("run-event-loop");
+      return false;
+    }
+    // A peer that's gone should fail a write, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
   }
 
-  // Evaluate next argument.
-  *expr = car(args);
-  list_set(*stack, 3, cdr(args));
-  return Result_OK;
+  for (size_t i = 0; i < lisp->nports; ++i)
+    lisp->ports[i].wanted = 0;
+  bool files = false;
+  for (Atom op = lisp->io_ops; !nilp(op); op = cdr(op)) {
+    Port *p = &lisp->ports[car(car(op)).value.integer & 0xffffffff];
+    p->wanted |= io_events(car(op));
+    files = files || p->file;
+  }
+
+  for (size_t i = 0; i < lisp->nports; ++i) {
+    Port *p = &lisp->ports[i];
+    p->ready = p->served = 0;
+    if (p->fd < 0) continue;
+    if (p->file) {
+      p->ready = EPOLLIN | EPOLLOUT;
+    } else if (p->wanted != p->registered) {
+      struct epoll_event e = { .events = p->wanted, .data.u64 = i };
+      int how = !p->registered ? EPOLL_CTL_ADD : p->wanted ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+      if (epoll_ctl(lisp->epoll_fd, how, p->fd, &e) != 0) {
+        perror("run-event-loop");
+        return false;
+      }
+      p->registered = p->wanted;
+    }
+  }
+
+  struct epoll_event events[IO_EVENTS];
+  int n = epoll_wait(lisp->epoll_fd, events, IO_EVENTS, files ? 0 : -1);
+  if (n < 0 && errno != EINTR) {
+    perror("run-event-loop");
+    return false;
+  }
+  for (int i = 0; i < n; ++i) {
+    // A hang-up or error is reported to whichever operation is waiting.
+    uint32_t ready = events[i].events;
+    if (ready & (EPOLLHUP | EPOLLERR)) ready |= EPOLLIN | EPOLLOUT;
+    lisp->ports[events[i].data.u64].ready = ready;
+  }
+  return true;
 }
 
-Result eval_expr(Atom expr, Atom env, Atom *result) {
-  static int count = 0;
-  Result err = Result_OK;
-  Atom stack = nil;
+// Put the operations of `ops`, newest first, at the oldest end of `io_ops`,
+// dropping any on ports a callback has closed.
+void io_requeue(Atom ops) {
+  Atom last = nil;
+  for (Atom p = lisp->io_ops; !nilp(p); p = cdr(p)) last = p;
+  while (!nilp(ops)) {
+    Atom cell = ops;
+    ops = cdr(ops);
+    if (!port_open(car(car(cell)))) continue;
+    if (nilp(last))
+      lisp->io_ops = cell;
+    else
+      set_cdr(last, cell);
+    last = cell;
+  }
+  if (!nilp(last)) set_cdr(last, nil);
+}
 
-  do {
-    if (++count == 10000) {
-      gc(expr, env, stack);
-      count = 0;
-    }
-    if (expr.type == AtomType_Symbol) {
-      err = env_get(env, expr, result);
-    } else if (expr.type != AtomType_Pair) {
-      *result = expr;
-    } else if (!listp(expr)) {
-      return Error_Syntax;
-    } else {
-      Atom op = car(expr);
-      Atom args = cdr(expr);
+// (run-event-loop): perform queued operations and call their callbacks until
+// none are left. An error in a callback stops the loop, leaving the rest
+// queued.
+int run_event_loop_builtin(Atom args, Atom *result) {
+  ENSURE_0_ARGS();
 
-      if (op.type == AtomType_Symbol) {
-        // Handle special forms.
-        if (strcmp(op.value.symbol, "GC") == 0) {
-          ENSURE_0_ARGS();
-          gc(expr, env, stack);
-          *result = TRUE_SYM;
-          return Result_OK;
-        } else if (strcmp(op.value.symbol, "QUOTE") == 0) {
-          ENSURE_1_ARG();
-          *result = car(args);
-        } else if (strcmp(op.value.symbol, "DEFINE") == 0) {
-          if (nilp(args) || nilp(cdr(args))) return Error_Args; // At least two args.
+  if (self != &lisp->main) {
+    printf("Only the main thread can use ports, in run-event-loop\n");
+    return Error_Type;
+  }
 
-          Atom sym = car(args);
-          if (sym.type == AtomType_Pair) {
-            // (DEFINE (name args...) body...)
-            err = make_closure(env, cdr(sym), cdr(args), result);
-            sym = car(sym);
-            if (sym.type != AtomType_Symbol) {
-              printf("DEFINE expecting symbol\n");
-              return Error_Type;
-            }
-            (void) env_set(env, sym, *result);
-            *result = sym;
-          } else if (sym.type == AtomType_Symbol) {
-            // (DEFINE sym expr)
-            ENSURE_2_ARGS();
-            stack = make_frame(stack, env, nil);
-            list_set(stack, 2, op);
-            list_set(stack, 4, sym);
-            expr = car(cdr(args));
-            continue;
-          } else {
-            printf("Invalid type for DEFINE\n");
-            return Error_Type;
-          }
-        } else if (strcmp(op.value.symbol, "LAMBDA") == 0) {
-          if (nilp(args) || nilp(cdr(args))) return Error_Args;
-          err = make_closure(env, car(args), cdr(args), result);
-        } else if (strcmp(op.value.symbol, "IF") == 0) {
-          ENSURE_3_ARGS();
+  Atom due = nil, later = nil, op = nil, arg = nil;
+  PUSH_ROOT(due);
+  PUSH_ROOT(later);
+  PUSH_ROOT(op);
+  PUSH_ROOT(arg);
+  int r = Result_OK;
+  while (!r && !nilp(lisp->io_ops)) {
+    if (!io_wait()) {
+      r = Error_Type;
+      break;
+    }
+
+    // Take the oldest operation for each ready port and direction, in the
+    // order they were queued, leaving the rest.
+    Atom ops = lisp->io_ops;
+    lisp->io_ops = nil;
+    list_reverse(&ops);
+    while (!nilp(ops)) {
+      Atom cell = ops;
+      ops = cdr(ops);
+      Port *p = &lisp->ports[car(car(cell)).value.integer & 0xffffffff];
+      uint32_t events = io_events(car(cell));
+      if ((p->ready & events) && !(p->served & events)) {
+        p->served |= events;
+        set_cdr(cell, due);
+        due = cell;
+      } else {
+        set_cdr(cell, lisp->io_ops);
+        lisp->io_ops = cell;
+      }
+    }
+    list_reverse(&due);
+
+    // Operations that aren't finished, such as a write the port only took
+    // part of, are older than anything queued on their port since, so they
+    // go back at the oldest end of the queue.
+    later = nil;
+    while (!nilp(due)) {
+      Atom cell = due;
+      op = car(cell);
+      due = cdr(due);
+      // An earlier callback may have closed the port.
+      Port *p = port_open(car(op));
+      if (!p) continue;
+      if (!io_perform(p, op, &arg)) {
+        set_cdr(cell, later);
+        later = cell;
+        continue;
+      }
+      Atom callback = car(cdr(cdr(op)));
+      if (nilp(callback)) continue;
+      arg = cons(arg, nil);
+      r = apply(callback, arg, result);
+      if (r) {
+        // Requeue what's left too.
+        while (!nilp(due)) {
+          cell = due;
+          due = cdr(due);
+          set_cdr(cell, later);
+          later = cell;
+        }
+      }
+    }
+    io_requeue(later);
+  }
+  POP_ROOTS(4);
 
-          stack = make_frame(stack, env, cdr(args));
-          list_set(stack, 2, op);
-          expr = car(args);
-          continue;
-        } else if (strcmp(op.value.symbol, "DEFMACRO") == 0) {
+  *result = nil;
+  return r;
+}
 
-          if (nilp(args) || nilp(cdr(args)))
-            return Error_Args;
+// -----------------------------------------------------------------------------
+// Serving requests
+//
+// `lisp --serve path` loads the library once, then evaluates requests sent to
+// a Unix socket at `path`, so that a caller doesn't pay for starting up each
+// time. A request is a 4-byte big-endian length followed by that many bytes of
+// source text. Its forms are evaluated in a new environment whose parent is
+// the global one, so definitions don't outlive the request. The response is
+// likewise a 4-byte length and then a status byte, 0 followed by the printed
+// value of the last form, or the Result code of an error followed by its
+// message. Connections can send any number of requests; they're served one at
+// a time, as they arrive. A client that doesn't read its responses isn't sent
+// more, but doesn't hold up the others.
+// -----------------------------------------------------------------------------
 
-          if (car(args).type != AtomType_Pair) {
-            printf("Expecting symbol in DEFMACRO\n");
-            return Error_Syntax;
-          }
+#define SERVE_MAX_REQUEST (16 << 20)
+
+// Responses waiting to be sent beyond which a client's requests aren't read.
+#define SERVE_MAX_PENDING (1 << 20)
+
+typedef struct {
+  int fd;
+  char *buf;      // Input not yet evaluated.
+  size_t len;
+  size_t cap;
+  Printer out;    // Responses, of which the first `sent` bytes have been sent.
+  size_t sent;
+  uint32_t events; // Those the epoll set is waiting for.
+} ServeClient;
+
+// Evaluate `text` in a child of `env`, appending the response to `out`.
+void serve_request(Atom env, const char *text, Printer *out) {
+  Atom child = env_create(env);
+  Atom result = nil;
+  PUSH_ROOT(child);
+  Result r = eval_text(child, text, false, &result);
+  POP_ROOTS(1);
+
+  size_t start = out->len;
+  printer_write(out, "\0\0\0\0", 4);
+  printer_putc(out, (char) r);
+  if (r)
+    printer_puts(out, result_message(r));
+  else
+    print_atom(out, result);
 
-          Atom name = car(car(args));
-          if (name.type != AtomType_Symbol) {
-            printf("DEFMACRO expecting symbol\n");
-            return Error_Type;
-          }
+  uint32_t n = out->len - start - 4;
+  for (int i = 0; i < 4; ++i)
+    out->buf[start + i] = n >> (24 - 8 * i);
+}
 
-          Atom macro;
-          err = make_closure(env, cdr(car(args)), cdr(args), &macro);
-          if (!err) {
-            macro.type = AtomType_Macro; // Clobber AtomType_Closure.
-            *result = name;
-            (void) env_set(env, name, macro);
-          }
-        } else if (strcmp(op.value.symbol, "APPLY") == 0) {
-          if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
-            return Error_Args;
+// Send as much of `c`'s pending responses as the socket takes.
+bool serve_flush(ServeClient *c) {
+  while (c->sent < c->out.len) {
+    ssize_t n = write(c->fd, c->out.buf + c->sent, c->out.len - c->sent);
+    if (n < 0 && errno == EAGAIN) return true;
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return false;
+    c->sent += n;
+  }
+  c->out.len = c->sent = 0;
+  return true;
+}
 
-          stack = make_frame(stack, env, cdr(args));
-          list_set(stack, 2, op);
-          expr = car(args);
-          continue;
-        } else {
-          goto push;
+// Answer each complete request `c` has sent, reading no further than the end
+// of the next one, then wait for whatever it's ready for. False once the
+// connection should be closed.
+bool serve_client(Atom *env, ServeClient *c, int epoll_fd) {
+  if (!serve_flush(c)) return false;
+
+  size_t done = 0;
+  while (c->out.len - c->sent < SERVE_MAX_PENDING) {
+    size_t want = 4;
+    if (c->len - done >= 4) {
+      const unsigned char *h = (const unsigned char*) c->buf + done;
+      uint32_t size = (uint32_t) h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3];
+      if (size > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "Request of %u bytes is too long\n", size);
+        return false;
+      }
+      want = 4 + (size_t) size;
+      if (c->len - done >= want) {
+        char *text = strndup(c->buf + done + 4, size);
+        if (!text) {
+          fprintf(stderr, "Out of memory for a request\n");
+          return false;
         }
-      } else if (op.type == AtomType_Builtin) {
-        err = (*op.value.builtin)(args, result);
-      } else {
-      push:
-        // Handle function application.
-        stack = make_frame(stack, env, args);
-        expr = op;
+        serve_request(*env, text, &c->out);
+        free(text);
+        fflush(stdout);
+        done += want;
+        if (!serve_flush(c)) return false;
         continue;
       }
     }
 
-    if (nilp(stack))
-      break;
+    memmove(c->buf, c->buf + done, c->len - done);
+    c->len -= done;
+    done = 0;
+    if (c->cap < want || c->cap - c->len < IO_READ_SIZE) {
+      size_t cap = c->cap ? 2 * c->cap : 2 * IO_READ_SIZE;
+      if (cap < want) cap = want;
+      char *bigger = realloc(c->buf, cap);
+      if (!bigger) {
+        fprintf(stderr, "Out of memory for a request\n");
+        return false;
+      }
+      c->buf = bigger;
+      c->cap = cap;
+    }
+    size_t room = want > c->len ? want - c->len : 0;
+    if (room < IO_READ_SIZE) room = IO_READ_SIZE;
+    if (room > c->cap - c->len) room = c->cap - c->len;
+    ssize_t n = read(c->fd, c->buf + c->len, room);
+    if (n < 0 && errno == EAGAIN) break;
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    c->len += n;
+  }
+  memmove(c->buf, c->buf + done, c->len - done);
+  c->len -= done;
+
+  uint32_t events = (c->out.len - c->sent < SERVE_MAX_PENDING ? EPOLLIN : 0) |
+                    (c->sent < c->out.len ? EPOLLOUT : 0);
+  if (events != c->events) {
+    struct epoll_event e = { .events = events, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &e);
+    c->events = events;
+  }
+  return true;
+}
 
-    if (!err)
-      err = eval_do_return(&stack, &expr, &env, result);
-  } while (!err);
+// Serve requests at `path` with children of `*env` until killed. Returns
+// only if the socket can't be set up.
+bool serve(Atom *env, const char *path) {
+  struct sockaddr_un addr;
+  if (!unix_address(make_string(path, strlen(path)), &addr, "--serve")) return false;
+  int server = unix_listen(&addr);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event e = { .events = EPOLLIN, .data.ptr = NULL };
+  if (server < 0 || epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server, &e) != 0) {
+    perror(path);
+    return false;
+  }
+  fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+  signal(SIGPIPE, SIG_IGN);
 
-  gc(expr, env, stack);
+  for (;;) {
+    struct epoll_event events[IO_EVENTS];
+    int n = epoll_wait(epoll_fd, events, IO_EVENTS, -1);
+    if (n < 0 && errno != EINTR) {
+      perror("--serve");
+      return false;
+    }
 
-  return err;
+    for (int i = 0; i < n; ++i) {
+      ServeClient *c = events[i].data.ptr;
+      if (!c) {
+        int fd;
+        while ((fd = accept(server, NULL, NULL)) >= 0) {
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+          fcntl(fd, F_SETFD, FD_CLOEXEC);
+          c = calloc(1, sizeof(ServeClient));
+          if (!c) {
+            fprintf(stderr, "Out of memory for a connection\n");
+            close(fd);
+            continue;
+          }
+          c->fd = fd;
+          c->events = EPOLLIN;
+          struct epoll_event ce = { .events = EPOLLIN, .data.ptr = c };
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ce);
+        }
+      } else if (!serve_client(env, c, epoll_fd)) {
+        close(c->fd); // Which also takes it out of the epoll set.
+        free(c->buf);
+        free(c->out.buf);
+        free(c);
+      }
+    }
+  }
 }
 
 // -----------------------------------------------------------------------------
-// REPL
+// Contexts
+//
+// The embedding API of lisp.h. Internally the running context is the
+// thread-local `lisp` rather than a parameter of every function, and each
+// entry point switches to its context for the duration of the call.
 // -----------------------------------------------------------------------------
 
-static Atom generator_env;
+LispContext *lisp_enter(LispContext *context) {
+  LispContext *previous = lisp;
+  lisp = context;
+  self = context ? &context->main : NULL;
+  return previous;
+}
 
-// GNU readline function for tab completion.
-// Looks for symbols in the current environment.
-char* symbol_generator(const char* text, int state) {
-  static Atom parent;
-  static Atom bindings; // Note the statics.
-  static int len;
-  if (state == 0) {
-    parent = car(generator_env);
-    bindings = cdr(generator_env);
-    len = strlen(text);
+// A context with nothing in it yet, for `initial_env` or `image_load` to fill.
+LispContext *context_new() {
+  LispContext *context = calloc(1, sizeof(LispContext));
+  if (!context) return NULL;
+
+  context->call_cache = calloc(CALL_CACHE_SIZE, sizeof(CallCache));
+  context->jit_table = calloc(JIT_TABLE_SIZE, sizeof(JitEntry));
+  if (!context->call_cache || !context->jit_table) {
+    free(context->call_cache);
+    free(context->jit_table);
+    free(context);
+    return NULL;
   }
+  context->main.heap = &context->last_allocation;
+  context->gc_budget = 1000;
+  context->gc_threshold = GC_MIN_ALLOCATIONS;
+  context->free_port = -1;
+  context->epoll_fd = -1;
+  pthread_mutex_init(&context->shared_lock, NULL);
+  return context;
+}
 
-  // Find `text` in the bindings.
-  while (!nilp(bindings)) {
-    Atom binding = car(bindings);
-    Atom sym = car(binding);
-    const char *name = sym.value.symbol;
-    if (strncasecmp(name, text, len) == 0) {
-      bindings = cdr(bindings);
-      return strdup(name);
-    }
-    bindings = cdr(bindings);
+LispContext *lisp_open(void) {
+  LispContext *context = context_new();
+  if (!context) return NULL;
+
+  // Everything allocated so far is on the context's lists, so `lisp_close`
+  // can free it.
+  LispContext *previous = lisp_enter(context);
+  jmp_buf oom;
+  if (setjmp(oom)) {
+    lisp_close(context);
+    lisp_enter(previous);
+    return NULL;
   }
-  return NULL;
+  context->oom = &oom;
+  initial_env();
+  context->oom = NULL;
+  lisp_enter(previous);
+  return context;
 }
 
-static char history_file[] = ".lisp_history";
-
-void repl(Atom env) {
-  using_history();
-  read_history(history_file);
-  generator_env = env;
-  rl_completion_entry_function = symbol_generator;
-  char *input;
-  while ((input = readline("λ> ")) != NULL) {
-
-    // Continue if all ws (or comments).
-    const char* start;
-    const char* end;
-    if (lex(input, &start, &end) == Result_OK && *start == '\0') continue;
+void lisp_close(LispContext *context) {
+  LispContext *previous = lisp_enter(context);
+  if (context->pool) pool_close(context->pool);
+  if (context->markers) gc_markers_close(context->markers);
+  if (context->profile) profile_free(profile_stop());
+  gc_sweep(&context->main);
+  jit_reset();
+
+  // Symbol names are the only memory not owned by an allocation, except for
+  // those in a mapped image.
+  for (Atom p = context->sym_table; !nilp(p); p = cdr(p)) {
+    const char *name = car(p).value.symbol;
+    if (!symbol_in_image(name)) free(symbol_header(name));
+  }
 
-    add_history(input);
-    write_history(history_file);
+  while (context->last_allocation) {
+    Allocation *a = context->last_allocation;
+    context->last_allocation = a->next;
+    if (a->string) free((char*) a->pair.atom[1].value.symbol);
+    if (!a->block) free(a);
+  }
+  while (context->blocks) {
+    Block *b = context->blocks;
+    context->blocks = b->next;
+    free(b);
+  }
 
-    if (strcmp(input, ":q") == 0) {
-      puts("bye");
-      free(input);
-      break;
-    }
+  for (size_t i = 0; i < context->nports; ++i) {
+    if (context->ports[i].fd >= 0) close(context->ports[i].fd);
+  }
+  free(context->ports);
+  if (context->epoll_fd >= 0) close(context->epoll_fd);
+
+  if (context->image_base) munmap(context->image_base, context->image_size);
+  free(context->call_cache);
+  free(context->jit_table);
+  free(context->mark_stack.items);
+  free(context->mark_stack.weak);
+  free(context->main.shadow);
+  free(context->gc_protected);
+  sym_trie_free(context->sym_trie);
+  if (context->closure_names) ptrmap_free(context->closure_names);
+  free(context->closure_names);
+  pthread_mutex_destroy(&context->shared_lock);
+  free(context);
+  lisp_enter(previous == context ? NULL : previous);
+}
 
-    const char* p = input;
-    Atom expr;
-    Result r = read_expr(p, &p, &expr);
+int lisp_load(LispContext *context, const char *path) {
+  char *text = slurp(path);
+  if (!text) {
+    perror(path);
+    return Error_Type;
+  }
 
-    Atom result;
-    if (!r) r = eval_expr(expr, env, &result);
+  LispContext *previous = lisp_enter(context);
+  Result r = eval_text(context->global_env, text, false, NULL);
+  lisp_enter(previous);
+  free(text);
+  return r;
+}
 
-    switch (r) {
-      case Result_OK:
-        atom_print(result);
-        putchar('\n');
-        break;
-      case Error_Syntax:
-        puts("Syntax error");
-        break;
-      case Error_Unbound:
-        puts("Symbol not bound");
-        break;
-      case Error_Args:
-        puts("Wrong number of arguments");
-        break;
-      case Error_Type:
-        puts("Wrong type");
-        break;
+int lisp_eval(LispContext *context, const char *text, char **output) {
+  LispContext *previous = lisp_enter(context);
+  Atom result = nil;
+  Result r = eval_text(context->global_env, text, false, &result);
+  if (output) {
+    *output = NULL;
+    if (!r) {
+      Printer p = { NULL, 0, 0, NULL };
+      print_atom(&p, result);
+      printer_putc(&p, '\0');
+      *output = p.buf;
     }
-    free(input);
   }
+  lisp_enter(previous);
+  return r;
+}
+
+const char *lisp_error_message(int error) {
+  return result_message(error);
 }
 
 // -----------------------------------------------------------------------------
-// old unit test, now a builtin function
+// Compiler to C
+//
+// `lisp --compile-to-c file...` translates top-level (DEFINE (name args...)
+// body...) forms into C builtins that call the runtime directly. The DEFINE
+// still makes a closure, which keeps its source, and `aot_attach` gives it the
+// builtin to run instead (see `aot_run`), so it prints, compares and is
+// profiled like any other. Macros are expanded at compile time, so every form
+// is also evaluated once it has been compiled. Anything the compiler doesn't
+// handle (LAMBDA, internal DEFINE, other top-level forms) is only evaluated by
+// the generated `aot_load`, from its source text. The output is #included
+// into this file when LISP_AOT_SOURCE is defined (see the `lisp-aot` target).
 // -----------------------------------------------------------------------------
 
-void unit_test_1() {
-  printf("> make_int(42)\n");
-  atom_print(make_int(42));
-  putchar('\n');
+typedef struct {
+  Atom *syms;
+  int nsyms;
+  char **consts;
+  int nconsts;
+  FILE *defs;   // Generated functions.
+  FILE *init;   // Statements of `aot_load`, in source order.
+  int nfns;
+} Compiler;
+
+typedef struct {
+  FILE *out;
+  int id;
+  Atom name;
+  Atom params;
+  int nparams;
+  bool rest;
+  int ntemps;
+  int indent;
+  bool self_tail_call;
+} CompiledFn;
+
+void compile_emit(CompiledFn *fn, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  fprintf(fn->out, "%*s", 2 * fn->indent, "");
+  vfprintf(fn->out, format, ap);
+  va_end(ap);
+}
 
-  printf("> make_sym(\"FOO\")\n");
-  atom_print(make_sym("FOO"));
-  putchar('\n');
+void compile_char(FILE *out, char c) {
+  if (c == '\n') fputs("\\n", out);
+  else if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+  else fputc(c, out);
+}
 
-  printf("> cons(make_sym(\"X\"), make_sym(\"Y\"))\n");
-  atom_print(cons(make_sym("X"), make_sym("Y")));
-  putchar('\n');
+// Write `atom` as it would be read back, escaped for a C string literal.
+void compile_literal(FILE *out, Atom atom) {
+  Printer p = { NULL, 0, 0, NULL };
+  print_atom(&p, atom);
+  for (size_t i = 0; i < p.len; ++i)
+    compile_char(out, p.buf[i]);
+  free(p.buf);
+}
 
-  printf("> cons(make_int(1), cons(make_int(2), cons(make_int(3), nil)))\n");
-  atom_print(cons(make_int(1), cons(make_int(2), cons(make_int(3), nil))));
-  putchar('\n');
+int compile_sym(Compiler *c, Atom sym) {
+  for (int i = 0; i < c->nsyms; ++i)
+    if (sym_eq(c->syms[i], sym)) return i;
+  c->syms = realloc(c->syms, (c->nsyms + 1) * sizeof(Atom));
+  c->syms[c->nsyms] = sym;
+  return c->nsyms++;
+}
 
-  printf("> sym_table\n");
-  atom_print(sym_table);
-  putchar('\n');
+// Constants are kept as text: the forms they come from may be collected once
+// they've been evaluated.
+int compile_const(Compiler *c, Atom a) {
+  char *text;
+  size_t len;
+  FILE *out = open_memstream(&text, &len);
+  compile_literal(out, a);
+  fclose(out);
+
+  c->consts = realloc(c->consts, (c->nconsts + 1) * sizeof(char*));
+  c->consts[c->nconsts] = text;
+  return c->nconsts++;
 }
 
-int unit_test_1_builtin(Atom args, Atom *result) {
-  ENSURE_0_ARGS();
+// Emit statements storing the value of `expr` in `t[target]`. Returns false if
+// `expr` uses a form the compiler doesn't handle.
+bool compile_expr(Compiler *c, CompiledFn *fn, Atom env, Atom expr, int target, bool tail) {
+
+  if (expr.type == AtomType_Symbol) {
+    int i = 0;
+    Atom p = fn->params;
+    for (; p.type == AtomType_Pair; p = cdr(p), ++i)
+      if (sym_eq(car(p), expr)) break;
+    if (p.type == AtomType_Pair || (fn->rest && sym_eq(p, expr))) {
+      compile_emit(fn, "t[%d] = v[%d];\n", target, i);
+    } else {
+      compile_emit(fn, "if ((r = env_get(aot_env, aot_sym[%d], &t[%d]))) goto done;\n",
+              compile_sym(c, expr), target);
+    }
+    return true;
+  }
 
-  unit_test_1();
+  if (expr.type == AtomType_Integer) {
+    compile_emit(fn, "t[%d] = make_int(%ldL);\n", target, expr.value.integer);
+    return true;
+  }
 
-  *result = TRUE_SYM;
-  return Result_OK;
-}
+  if (nilp(expr)) {
+    compile_emit(fn, "t[%d] = nil;\n", target);
+    return true;
+  }
 
-// -----------------------------------------------------------------------------
-// library
-// -----------------------------------------------------------------------------
-char* slurp(const char path[]) {
-  FILE * file = fopen(path, "r");
-  if (!file) return NULL;
-  fseek(file, 0, SEEK_END);
-  long len = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  if (expr.type == AtomType_String) {
+    compile_emit(fn, "t[%d] = aot_const[%d];\n", target, compile_const(c, expr));
+    return true;
+  }
 
-  char* buf = malloc(len + 1);
-  if (buf == NULL) return NULL;
+  if (expr.type != AtomType_Pair || !listp(expr)) return false;
+
+  Atom op = car(expr);
+  Atom args = cdr(expr);
+  int argc = 0;
+  for (Atom p = args; !nilp(p); p = cdr(p)) ++argc;
+
+  if (is_special_form(op)) {
+    if (strcmp(op.value.symbol, "QUOTE") == 0 && argc == 1) {
+      Atom value = car(args);
+      if (value.type == AtomType_Symbol) {
+        compile_emit(fn, "t[%d] = aot_sym[%d];\n", target, compile_sym(c, value));
+        return true;
+      } else if (value.type == AtomType_Pair || value.type == AtomType_String) {
+        compile_emit(fn, "t[%d] = aot_const[%d];\n", target, compile_const(c, value));
+        return true;
+      }
+      return compile_expr(c, fn, env, value, target, tail);
+    }
+    if (strcmp(op.value.symbol, "IF") == 0 && argc == 3) {
+      int cond = fn->ntemps++;
+      if (!compile_expr(c, fn, env, car(args), cond, false)) return false;
+      compile_emit(fn, "if (!nilp(t[%d])) {\n", cond);
+      ++fn->indent;
+      if (!compile_expr(c, fn, env, car(cdr(args)), target, tail)) return false;
+      --fn->indent;
+      compile_emit(fn, "} else {\n");
+      ++fn->indent;
+      if (!compile_expr(c, fn, env, car(cdr(cdr(args))), target, tail)) return false;
+      --fn->indent;
+      compile_emit(fn, "}\n");
+      return true;
+    }
+    return false;
+  }
 
-  fread(buf, 1, len, file);
-  buf[len] = '\0';
-  fclose(file);
+  // Expand macros now, using the definitions seen so far.
+  Atom binding;
+  if (op.type == AtomType_Symbol && env_find(env, op, &binding) &&
+      cdr(binding).type == AtomType_Macro) {
+    Atom macro = cdr(binding);
+    macro.type = AtomType_Closure;
+    Atom expansion = nil;
+    PUSH_ROOT(expansion);
+    bool ok = !apply(macro, args, &expansion) &&
+              compile_expr(c, fn, env, expansion, target, tail);
+    POP_ROOTS(1);
+    return ok;
+  }
 
-  return buf;
+  int f = fn->ntemps++;
+  if (!compile_expr(c, fn, env, op, f, false)) return false;
+
+  int first = fn->ntemps;
+  fn->ntemps += argc;
+  for (int i = 0; i < argc; ++i, args = cdr(args))
+    if (!compile_expr(c, fn, env, car(args), first + i, false)) return false;
+
+  int list = fn->ntemps++;
+  compile_emit(fn, "t[%d] = nil;\n", list);
+  for (int i = argc - 1; i >= 0; --i)
+    compile_emit(fn, "t[%d] = cons(t[%d], t[%d]);\n", list, first + i, list);
+
+  // A self call in tail position loops, as long as the name still refers to
+  // this function.
+  if (tail && op.type == AtomType_Symbol && sym_eq(op, fn->name)) {
+    compile_emit(fn, "if (aot_code(t[%d]) == aot_fn_%d) {\n", f, fn->id);
+    compile_emit(fn, "  args = t[%d];\n", list);
+    compile_emit(fn, "  goto entry;\n");
+    compile_emit(fn, "}\n");
+    fn->self_tail_call = true;
+  }
+  compile_emit(fn, "if ((r = apply(t[%d], t[%d], &t[%d]))) goto done;\n", f, list, target);
+  return true;
 }
 
-void load_file(Atom env, const char path[]) {
-  printf("Loading '%s' ...\n", path);
-  char *text = slurp(path);
-  if (text) {
+// Give the closure a compiled DEFINE bound to `name` the builtin `code`, ahead
+// of its body.
+void aot_attach(Atom env, Atom name, Builtin code) {
+  Atom f;
+  if (env_get(env, name, &f) || f.type != AtomType_Closure) return;
+  set_cdr(cdr(f), cons(make_builtin(code), cdr(cdr(f))));
+}
+
+// Try to compile (DEFINE (name params...) body...) into `c->defs`.
+bool compile_function(Compiler *c, Atom env, Atom name, Atom params, Atom body) {
+  CompiledFn fn = { NULL, c->nfns++, name, params, 0, false, 1, 1, false };
+  Atom p = params;
+  for (; p.type == AtomType_Pair; p = cdr(p)) {
+    if (car(p).type != AtomType_Symbol) return false;
+    ++fn.nparams;
+  }
+  if (!nilp(p) && p.type != AtomType_Symbol) return false;
+  fn.rest = !nilp(p);
+  if (nilp(body) || !listp(body)) return false;
+
+  char *text;
+  size_t len;
+  fn.out = open_memstream(&text, &len);
+  bool ok = true;
+  for (Atom b = body; ok && !nilp(b); b = cdr(b))
+    ok = compile_expr(c, &fn, env, car(b), 0, nilp(cdr(b)));
+  fclose(fn.out);
+
+  if (ok) {
+    int id = fn.id;
+    fprintf(c->defs, "// ");
+    compile_literal(c->defs, name);
+    fprintf(c->defs, "\nstatic int aot_fn_%d(Atom args, Atom *result) {\n", id);
+    fprintf(c->defs,
+            "  Atom v[%d];\n  Atom t[%d];\n  int r = Result_OK;\n"
+            "  for (int i = 0; i < %d; ++i) v[i] = nil;\n"
+            "  for (int i = 0; i < %d; ++i) t[i] = nil;\n"
+            "  PUSH_ROOTS(v, %d);\n  PUSH_ROOTS(t, %d);\n\n",
+            fn.nparams + 1, fn.ntemps, fn.nparams + 1, fn.ntemps, fn.nparams + 1, fn.ntemps);
+    if (fn.self_tail_call)
+      fprintf(c->defs, "entry:\n");
+    fprintf(c->defs,
+            "  for (int i = 0; i < %d; ++i, args = cdr(args)) {\n"
+            "    if (nilp(args)) {\n"
+            "      r = Error_Args;\n"
+            "      goto done;\n"
+            "    }\n"
+            "    v[i] = car(args);\n"
+            "  }\n", fn.nparams);
+    if (fn.rest)
+      fprintf(c->defs, "  v[%d] = args;\n\n", fn.nparams);
+    else
+      fprintf(c->defs, "  if (!nilp(args)) {\n    r = Error_Args;\n    goto done;\n  }\n\n");
+    fputs(text, c->defs);
+    fprintf(c->defs, "\n  *result = t[0];\ndone:\n  POP_ROOTS(2);\n  return r;\n}\n\n");
+
+    fprintf(c->init, "  aot_attach(env, aot_sym[%d], aot_fn_%d);\n",
+            compile_sym(c, name), id);
+  }
+  free(text);
+  return ok;
+}
+
+void compile_form(Compiler *c, Atom env, Atom expr) {
+  // Every form is evaluated from source, so a DEFINE makes its closure before
+  // any compiled code is attached to it.
+  fprintf(c->init, "  aot_eval(env, \"");
+  compile_literal(c->init, expr);
+  fprintf(c->init, "\");\n");
+
+  if (expr.type == AtomType_Pair && car(expr).type == AtomType_Symbol &&
+      strcmp(car(expr).value.symbol, "DEFINE") == 0 && listp(expr) &&
+      !nilp(cdr(expr)) && car(cdr(expr)).type == AtomType_Pair) {
+    Atom proto = car(cdr(expr));
+    if (car(proto).type == AtomType_Symbol)
+      compile_function(c, env, car(proto), cdr(proto), cdr(cdr(expr)));
+  }
+}
+
+bool compile_to_c(int nfiles, const char *files[], FILE *out) {
+  Compiler c = { NULL, 0, NULL, 0, NULL, NULL, 0 };
+  char *defs, *init;
+  size_t defs_len, init_len;
+  c.defs = open_memstream(&defs, &defs_len);
+  c.init = open_memstream(&init, &init_len);
+
+  bool ok = true;
+  Atom env = initial_env();
+  for (int i = 0; ok && i < nfiles; ++i) {
+    char *text = slurp(files[i]);
+    if (!text) {
+      fprintf(stderr, "Cannot read '%s'\n", files[i]);
+      ok = false;
+      break;
+    }
     const char *p = text;
-    Atom expr;
-    while (read_expr(p, &p, &expr) == Result_OK) {
+    Atom expr = nil;
+    PUSH_ROOT(expr); // Macros are expanded while it's compiled.
+    while (ok && read_expr(p, &p, &expr) == Result_OK) {
+      compile_form(&c, env, expr);
       Atom result;
-      Result r = eval_expr(expr, env, &result);
-      if (r) {
-        printf("Error in expression:\n\t");
-        atom_print(expr);
-        putchar('\n');
-      } else {
-        atom_print(result);
-        putchar('\n');
+      if (eval_expr(expr, env, &result)) {
+        fprintf(stderr, "Error evaluating an expression in '%s'\n", files[i]);
+        ok = false;
       }
     }
+    POP_ROOTS(1);
     free(text);
   }
+  fclose(c.defs);
+  fclose(c.init);
+
+  if (ok) {
+    fprintf(out, "// Generated by `lisp --compile-to-c`. Do not edit.\n\n");
+    fprintf(out, "static Atom aot_env;\nstatic Atom aot_sym[%d];\nstatic Atom aot_const[%d];\n\n",
+            c.nsyms + 1, c.nconsts + 1);
+    fputs(defs, out);
+    fprintf(out,
+            "static void aot_eval(Atom env, const char *text) {\n"
+            "  Atom expr, result;\n"
+            "  if (read_expr(text, &text, &expr) || eval_expr(expr, env, &result))\n"
+            "    printf(\"Error in expression:\\n\\t%%s\\n\", text);\n"
+            "}\n\n");
+    fprintf(out, "void aot_load(Atom env) {\n  aot_env = env;\n");
+    fprintf(out, "  gc_protect(&aot_env, 1);\n  gc_protect(aot_sym, %d);\n  gc_protect(aot_const, %d);\n",
+            c.nsyms, c.nconsts);
+    for (int i = 0; i < c.nsyms; ++i) {
+      fprintf(out, "  aot_sym[%d] = make_sym(\"", i);
+      compile_literal(out, c.syms[i]);
+      fprintf(out, "\");\n");
+    }
+    for (int i = 0; i < c.nconsts; ++i) {
+      fprintf(out, "  {\n    const char *p = \"%s\";\n", c.consts[i]);
+      fprintf(out, "    read_expr(p, &p, &aot_const[%d]);\n  }\n", i);
+    }
+    fputs(init, out);
+    fprintf(out, "}\n");
+  }
+
+  for (int i = 0; i < c.nconsts; ++i) free(c.consts[i]);
+  free(c.consts);
+  free(c.syms);
+  free(defs);
+  free(init);
+  return ok;
 }
 
-Atom initial_env() {
-  Atom env = env_create(nil);
-  env_set(env, make_sym("APPLY"), make_builtin(apply_builtin));
+#ifdef LISP_AOT_SOURCE
+#include LISP_AOT_SOURCE
+#endif
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [--compile-closures] [--jit] [--threads n] [--gc-threads n]\n"
+    "          [--gc-incremental] [--gc-budget us] [--gc-copy]\n"
+    "          [--gc-weak-symbols] [--gc-trace] [--gc-stress] [--profile file]\n"
+    "          [--vm-stats]\n"
+    "          [--image file] [--no-library] [--serve socket] [-q]\n"
+    "          [-e expr]... [file|-]...\n"
+    "       %s --compile-to-c file... [-o out.c]\n"
+    "\n"
+    "With no expressions or files, and a terminal on stdin, runs the REPL.\n"
+    "Otherwise each -e expression and file is evaluated in order, stopping at\n"
+    "the first error. Results of -e expressions and of stdin are printed\n"
+    "unless -q is given.\n"
+    "\n"
+    "--compile-closures compiles closures that are called often into trees of\n"
+    "C functions, which run them without the evaluator's environments and\n"
+    "special form dispatch. --jit also translates those trees to machine code,\n"
+    "with inline integer arithmetic, on x86-64.\n"
+    "\n"
+    "--threads sets the number of workers for futures and pmap; by default\n"
+    "there's one for each CPU but the first.\n"
+    "\n"
+    "--gc-threads sets the number of threads marking during a collection; by\n"
+    "default there's one for each CPU, up to 8.\n"
+    "\n"
+    "--gc-incremental spreads each collection over many short pauses, of at\n"
+    "most --gc-budget microseconds (default 1000) each, until the first future\n"
+    "is made.\n"
+    "\n"
+    "--gc-copy also compacts the heap between top-level forms after any\n"
+    "collection, copying what's live into one contiguous block, until the\n"
+    "first future is made.\n"
+    "\n"
+    "--gc-weak-symbols likewise collects symbols nothing refers to, which\n"
+    "otherwise live as long as the process.\n"
+    "\n"
+    "--gc-trace logs a line to stderr for each collection.\n"
+    "\n"
+    "--gc-stress collects at every allocation, to find atoms that aren't kept\n"
+    "alive. It's very slow.\n"
+    "\n"
+    "--profile samples the Lisp call stack while running, then reports to\n"
+    "stderr and writes the stacks to file for flamegraph.pl.\n"
+    "\n"
+    "--vm-stats prints the evaluator's counters at exit, if built with\n"
+    "-DLISP_STATS=ON.\n"
+    "\n"
+    "--serve evaluates requests sent to a Unix socket, after the expressions\n"
+    "and files, until killed. Each request is a 4-byte big-endian length and\n"
+    "then source text, evaluated in a new child of the global environment.\n"
+    "Each response is a 4-byte length, a status byte (0, or the error code)\n"
+    "and the printed value of the last form or the error message.\n",
+    name, name);
+}
 
-  env_set(env, make_sym("CAR"), make_builtin(car_builtin));
-  env_set(env, make_sym("CDR"), make_builtin(cdr_builtin));
-  env_set(env, make_sym("CONS"), make_builtin(cons_builtin));
-  env_set(env, make_sym("PAIR?"), make_builtin(pairp_builtin));
-  env_set(env, make_sym("EQ?"), make_builtin(eqp_builtin));
+// Threads a context may be asked to start, by `--threads` or `--gc-threads`.
+#define MAX_THREADS 1024
+
+// Parse `s`, the argument of an option, which must be a decimal integer from
+// `min` to `max`.
+bool parse_option(const char *s, long min, long max, long *value) {
+  char *end;
+  errno = 0;
+  long n = strtol(s, &end, 10);
+  if (end == s || *end || errno || n < min || n > max) return false;
+  *value = n;
+  return true;
+}
 
-  env_set(env, make_sym("UNIT-TEST-1"), make_builtin(unit_test_1_builtin));
+#ifdef LISP_FUZZ
+// libFuzzer entry point (see the `lisp-fuzz` target): read and evaluate the
+// input in a fresh context, collecting at every allocation, and print each
+// result.
+// Builtins that touch files or start threads are unbound first.
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+  static const char *unsafe[] = {
+    "SAVE-IMAGE", "SERIALIZE-TO-FILE", "DESERIALIZE-FROM-FILE",
+    "FUTURE-CALL", "TOUCH", "PMAP", "PROFILE-START", "PROFILE-STOP",
+    "OPEN-FILE", "MAKE-PIPE", "LISTEN-UNIX", "CONNECT-UNIX", "RUN-EVENT-LOOP",
+    "REQUIRE"
+  };
+
+  char *text = malloc(size + 1);
+  if (!text) return 0;
+  memcpy(text, data, size);
+  text[size] = '\0';
+
+  LispContext *context = lisp_open();
+  LispContext *previous = lisp_enter(context);
+  context->gc_stress = true;
+  context->eval_limit = 100000;
+  for (size_t i = 0; i < sizeof(unsafe) / sizeof(unsafe[0]); ++i)
+    env_set(context->global_env, make_sym(unsafe[i]), nil);
+
+  const char *p = text;
+  Atom expr, result;
+  while (read_expr(p, &p, &expr) == Result_OK &&
+         eval_expr(expr, context->global_env, &result) == Result_OK) {
+    Printer out = { NULL, 0, 0, NULL };
+    print_atom(&out, result);
+    free(out.buf);
+  }
 
-  env_set(env, make_sym("+"), make_builtin(add_builtin));
-  env_set(env, make_sym("-"), make_builtin(sub_builtin));
-  env_set(env, make_sym("*"), make_builtin(mul_builtin));
-  env_set(env, make_sym("/"), make_builtin(div_builtin));
+  lisp_enter(previous);
+  lisp_close(context);
+  free(text);
+  return 0;
+}
+#endif
 
-  env_set(env, make_sym("="), make_builtin(integer_eq_builtin));
-  env_set(env, make_sym("<"), make_builtin(integer_lt_builtin));
-  env_set(env, make_sym("<="), make_builtin(integer_le_builtin));
-  env_set(env, make_sym(">"), make_builtin(integer_gt_builtin));
-  env_set(env, make_sym(">="), make_builtin(integer_ge_builtin));
+#ifndef LISP_NO_MAIN
+static const char *profile_path = NULL;
 
-  env_set(env, TRUE_SYM, TRUE_SYM);
+void vm_stats_exit() {
+  fflush(stdout);
+  vm_stats_print(stderr);
+}
 
-  return env;
+// At exit from a `--profile` run, report to stderr and write the stacks.
+void profile_exit() {
+  Profile *p = profile_stop();
+  if (!p) return;
+  fflush(stdout);
+  profile_report(p, stderr);
+  profile_write_collapsed(p, profile_path);
+  profile_free(p);
 }
 
-// -----------------------------------------------------------------------------
-// main
-// -----------------------------------------------------------------------------
 int main(int argc, const char* argv[]) {
-  printf(
-    "lisp version %d.%d.%d\n",
-    LISP_VERSION_MAJOR,
-    LISP_VERSION_MINOR,
-    LISP_VERSION_PATCH
-  );
+  lisp_enter(context_new());
+  if (!lisp) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
 
-  Atom env = initial_env();
-  load_file(env, "library.lisp");
-  repl(env);
+  typedef struct {
+    bool expr;
+    const char *text; // Expression, or file name ("-" for stdin).
+  } Job;
+  Job *jobs = malloc(argc * sizeof(Job));
+  if (!jobs) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  int njobs = 0;
+  int status = 0;
+  long n; // An option's value.
+  bool compile = false;
+  bool quiet = false;
+  bool library = true;
+  const char *output = NULL;
+  const char *image = NULL;
+  const char *socket_path = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--compile-closures") == 0) {
+      lisp->compile_closures = true;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      lisp->compile_closures = true;
+      lisp->jit = true;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc &&
+               parse_option(argv[i + 1], 0, MAX_THREADS, &n)) {
+      lisp->threads = n;
+      ++i;
+    } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc &&
+               parse_option(argv[i + 1], 0, MAX_THREADS, &n)) {
+      lisp->gc_threads = n;
+      ++i;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (strcmp(argv[i], "--vm-stats") == 0) {
+      atexit(vm_stats_exit);
+    } else if (strcmp(argv[i], "--gc-trace") == 0) {
+      lisp->gc_trace = true;
+    } else if (strcmp(argv[i], "--gc-stress") == 0) {
+      lisp->gc_stress = true;
+    } else if (strcmp(argv[i], "--gc-incremental") == 0) {
+      lisp->gc_incremental = true;
+    } else if (strcmp(argv[i], "--gc-copy") == 0) {
+      lisp->gc_copy = true;
+    } else if (strcmp(argv[i], "--gc-weak-symbols") == 0) {
+      lisp->gc_weak_symbols = true;
+    } else if (strcmp(argv[i], "--gc-budget") == 0 && i + 1 < argc &&
+               parse_option(argv[i + 1], 1, 3600000000L, &n)) {
+      lisp->gc_budget = n; // Up to an hour, so it's safe in nanoseconds.
+      ++i;
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      image = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--compile-to-c") == 0) {
+      compile = true;
+    } else if (strcmp(argv[i], "-o") == 0 && compile && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "-q") == 0) {
+      quiet = true;
+    } else if (strcmp(argv[i], "--no-library") == 0) {
+      library = false;
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      jobs[njobs++] = (Job) { true, argv[++i] };
+    } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
+      jobs[njobs++] = (Job) { false, argv[i] };
+    } else {
+      usage(argv[0]);
+      status = 1;
+      goto done;
+    }
+  }
+
+  if (compile) {
+    for (int i = 0; i < njobs; ++i) {
+      if (jobs[i].expr) {
+        usage(argv[0]);
+        status = 1;
+        goto done;
+      }
+    }
+
+    const char **files = malloc((njobs ? njobs : 1) * sizeof(char*));
+    FILE *out = NULL;
+    status = 1;
+    if (!files) {
+      fprintf(stderr, "Out of memory\n");
+    } else if (!(out = output ? fopen(output, "w") : stdout)) {
+      perror(output);
+    } else {
+      for (int i = 0; i < njobs; ++i) files[i] = jobs[i].text;
+      bool ok = compile_to_c(njobs, files, out);
+      if (out != stdout) fclose(out);
+      if (!ok && output) remove(output);
+      status = ok ? 0 : 1;
+    }
+    free(files);
+    goto done;
+  }
+
+  bool interactive = njobs == 0 && !socket_path && isatty(STDIN_FILENO);
+  if (njobs == 0 && !interactive && !socket_path)
+    jobs[njobs++] = (Job) { false, "-" };
+
+  if (interactive) {
+    printf(
+      "lisp version %d.%d.%d\n",
+      LISP_VERSION_MAJOR,
+      LISP_VERSION_MINOR,
+      LISP_VERSION_PATCH
+    );
+  } else {
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+  }
+
+  Atom env = nil;
+  PUSH_ROOT(env);
+  if (image) {
+    if (!image_load(image, &env)) {
+      status = 1;
+      goto done;
+    }
+  } else {
+    env = initial_env();
+#ifdef LISP_AOT_SOURCE
+    if (library) aot_load(env);
+#else
+    if (library) load_file(env, "library.lisp", interactive);
+#endif
+  }
+
+  if (profile_path) {
+    profile_start();
+    atexit(profile_exit);
+  }
+
+  if (interactive) {
+    repl(env);
+    goto done;
+  }
+
+  for (int i = 0; i < njobs; ++i) {
+    const char *name = jobs[i].expr ? "-e" : jobs[i].text;
+    Result r;
+    if (jobs[i].expr) {
+      r = eval_text(env, jobs[i].text, !quiet, NULL);
+    } else {
+      bool is_stdin = strcmp(jobs[i].text, "-") == 0;
+      char *text = is_stdin ? slurp_stream(stdin) : slurp(jobs[i].text);
+      if (!text) {
+        fflush(stdout);
+        perror(jobs[i].text);
+        status = 1;
+        goto done;
+      }
+      r = eval_text(env, text, is_stdin && !quiet, NULL);
+      free(text);
+    }
+
+    if (r) {
+      fflush(stdout);
+      fprintf(stderr, "%s: %s\n", name, result_message(r));
+      status = 1;
+      goto done;
+    }
+  }
+
+  fflush(stdout);
+  if (socket_path) status = serve(&env, socket_path) ? 0 : 1;
+
+done:
+  free(jobs);
+  return status;
 }
+#endif
@@ -0,0 +1,38 @@
+#ifndef LISP_H
+#define LISP_H
+
+// Embedding API.
+//
+// Each LispContext is a complete interpreter with its own heap, symbol table
+// and global environment. Contexts share no state, so several can live in one
+// process, e.g. one per worker thread. A context may be used from any thread
+// but only by one thread at a time.
+//
+// Functions returning int return 0 on success or an error code, which
+// `lisp_error_message` describes.
+
+typedef struct LispContext LispContext;
+
+// A new interpreter with the builtins bound, or NULL if out of memory.
+// library.lisp isn't loaded; use `lisp_load` for that.
+LispContext *lisp_open(void);
+
+// Free the context and everything allocated in it.
+void lisp_close(LispContext *context);
+
+// Evaluate every form in the file at `path`.
+int lisp_load(LispContext *context, const char *path);
+
+// Evaluate every form in `text`. If `output` isn't NULL, it's set to the
+// printed value of the last form (a malloc'd string for the caller to free),
+// or NULL on error.
+int lisp_eval(LispContext *context, const char *text, char **output);
+
+const char *lisp_error_message(int error);
+
+// Make `context` the one the calling thread is running and return the
+// previous one. The functions above do this themselves; it's only needed to
+// call into lisp.c's internals directly.
+LispContext *lisp_enter(LispContext *context);
+
+#endif
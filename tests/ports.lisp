@@ -0,0 +1,74 @@
+;;
+;; Ports and the event loop, over pipes and a Unix socket in the current
+;; directory. tests/run also checks that each NAME.out written here matches
+;; NAME.expected.
+;;
+
+;; A string bigger than a pipe holds is written in parts, and a second write
+;; queued behind it must follow it, not land in the middle. The reader copies
+;; each chunk to pipe.out as it arrives; pipe.expected gets the same strings
+;; written to a file, which takes them whole.
+(define big (write-to-string (iota 40000)))
+(define pipe (make-pipe))
+(define pipe-out (open-file "pipe.out" 'write))
+(define pipe-expected (open-file "pipe.expected" 'write))
+(write-async pipe-expected big nil)
+(write-async pipe-expected "ZZZZ" nil)
+
+(write-async (cdr pipe) big
+  (lambda (port) (check (eq? port (cdr pipe)) t)))
+;; Closing the write end from the last callback is the reader's end of file.
+(write-async (cdr pipe) "ZZZZ"
+  (lambda (port) (close-port port)))
+
+(define (copy-chunks chunks)
+  (lambda (s)
+    (if s
+        (begin
+          (write-async pipe-out s nil)
+          (read-async (car pipe) (copy-chunks (+ chunks 1))))
+        (begin
+          ;; 64 KiB pipes take the big string in a handful of parts.
+          (check (> chunks 4) t)
+          (close-port (car pipe))))))
+(read-async (car pipe) (copy-chunks 0))
+
+;; Operations queued on a port that's closed from another callback are
+;; dropped, so the loop still ends. Nothing is ever written to `idle`.
+(define idle (make-pipe))
+(read-async (car idle) (lambda (s) (check 'read-from-idle-pipe s)))
+
+;; A socket echo: the client's "ping" comes back and is written to echo.out,
+;; then the client closes and the server sees the end of the stream.
+(define echo-out (open-file "echo.out" 'write))
+(define echo-expected (open-file "echo.expected" 'write))
+(write-async echo-expected "ping" nil)
+
+(define server (listen-unix "test.sock"))
+(accept-async server
+  (lambda (conn)
+    (close-port server)
+    (read-async conn
+      (lambda (s)
+        (write-async conn s
+          (lambda (port)
+            (read-async conn
+              (lambda (s)
+                (check s nil)
+                (close-port conn)
+                (close-port (car idle))
+                (close-port (cdr idle))))))))))
+
+(define client (connect-unix "test.sock"))
+(write-async client "ping"
+  (lambda (port)
+    (read-async client
+      (lambda (s)
+        (write-async echo-out s nil)
+        (close-port client)))))
+
+(run-event-loop)
+(close-port pipe-out)
+(close-port pipe-expected)
+(close-port echo-out)
+(close-port echo-expected)
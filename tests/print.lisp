@@ -0,0 +1,26 @@
+;;
+;; Printing structure with cycles, which `deserialize` can build. Each value
+;; is written to print.out, and what it should print to print.expected.
+;;
+
+(define out (open-file "print.out" 'write))
+(define expected (open-file "print.expected" 'write))
+
+(define (check-print bytes want)
+  (write-async out (write-to-string (deserialize bytes)) nil)
+  (write-async out "\n" nil)
+  (write-async expected want nil)
+  (write-async expected "\n" nil))
+
+;; x = (x x): the car direction, and a pair reached twice inside itself.
+(check-print "LSB1\x05\x08\x00\x05\x08\x00\x00" "#0=(#0# #0#)")
+;; A cdr chain that loops back to its start.
+(check-print "LSB1\x05\x01\x02\x05\x01\x04\x05\x01\x06\x08\x00" "#0=(1 2 3 . #0#)")
+;; Shared but not in a cycle: printed in full each time.
+(check-print "LSB1\x05\x05\x01\x02\x05\x01\x04\x00\x05\x08\x01\x00" "((1 2) (1 2))")
+;; A cycle inside a list, reached twice.
+(check-print "LSB1\x05\x05\x01\x02\x05\x08\x01\x00\x05\x08\x01\x00" "(#0=(1 #0#) #0#)")
+
+(run-event-loop)
+(close-port out)
+(close-port expected)